@@ -0,0 +1,146 @@
+#include <cstdio>
+#include <memory>
+#include <vector>
+
+#include "../riscv_vm/elf.h"
+#include "../riscv_vm/memory.h"
+
+#include "../riscv_core/riscv.h"
+
+// riscv_aot translates the code of a RISC-V ELF file ahead of time and writes
+// it out as a JIT code cache, which riscv_vm can start from using the
+// '--jit-cache' option.  anything the translator cannot reach statically (i.e.
+// code only reached through function pointers or jump tables) is left for the
+// JIT to translate at runtime.
+
+namespace {
+
+riscv_word_t imp_mem_ifetch(struct riscv_t *rv, riscv_word_t addr) {
+  memory_t *mem = (memory_t*)rv_userdata(rv);
+  return mem->read_ifetch(addr);
+}
+
+riscv_word_t imp_mem_read_w(struct riscv_t *rv, riscv_word_t addr) {
+  memory_t *mem = (memory_t*)rv_userdata(rv);
+  return mem->read_w(addr);
+}
+
+riscv_half_t imp_mem_read_s(struct riscv_t *rv, riscv_word_t addr) {
+  memory_t *mem = (memory_t*)rv_userdata(rv);
+  return mem->read_s(addr);
+}
+
+riscv_byte_t imp_mem_read_b(struct riscv_t *rv, riscv_word_t addr) {
+  memory_t *mem = (memory_t*)rv_userdata(rv);
+  return mem->read_b(addr);
+}
+
+void imp_mem_write_w(struct riscv_t *rv, riscv_word_t addr, riscv_word_t data) {
+  memory_t *mem = (memory_t*)rv_userdata(rv);
+  mem->write(addr, (uint8_t*)&data, sizeof(data));
+}
+
+void imp_mem_write_s(struct riscv_t *rv, riscv_word_t addr, riscv_half_t data) {
+  memory_t *mem = (memory_t*)rv_userdata(rv);
+  mem->write(addr, (uint8_t*)&data, sizeof(data));
+}
+
+void imp_mem_write_b(struct riscv_t *rv, riscv_word_t addr, riscv_byte_t data) {
+  memory_t *mem = (memory_t*)rv_userdata(rv);
+  mem->write(addr, (uint8_t*)&data, sizeof(data));
+}
+
+// the program is never run so these are never called
+void imp_on_ecall(struct riscv_t *, riscv_word_t, uint32_t) {
+}
+
+void imp_on_ebreak(struct riscv_t *, riscv_word_t, uint32_t) {
+}
+
+// find the addresses that blocks may be entered at other than the targets of
+// direct jumps and branches, which the translator follows itself
+void find_roots(const elf_t &elf, memory_t &mem, std::vector<uint32_t> &out) {
+  out.push_back(elf.get_entry());
+  elf.get_function_addrs(out);
+  // calls return to the instruction after them through an indirect jump
+  const ELF::Elf32_Shdr *text = elf.get_section_header(".text");
+  if (!text) {
+    return;
+  }
+  for (uint32_t addr = text->sh_addr; addr + 4 <= text->sh_addr + text->sh_size;
+       addr += 4) {
+    const uint32_t inst = mem.read_w(addr);
+    const uint32_t opcode = inst & 0x7f;
+    const uint32_t rd = (inst >> 7) & 0x1f;
+    // jal or jalr that writes a return address
+    if ((opcode == 0x6f || opcode == 0x67) && rd != 0) {
+      out.push_back(addr + 4);
+    }
+  }
+}
+
+} // namespace {}
+
+int main(int argc, char **args) {
+
+  if (argc != 3) {
+    fprintf(stderr, "Usage: %s program.elf output.cache\n", args[0]);
+    return 1;
+  }
+  const char *program = args[1];
+  const char *output = args[2];
+
+  // load the ELF file from disk
+  elf_t elf;
+  if (!elf.load(program)) {
+    fprintf(stderr, "Unable to load ELF file '%s'\n", program);
+    return 1;
+  }
+
+  const riscv_io_t io = {
+    imp_mem_ifetch,
+    imp_mem_read_w,
+    imp_mem_read_s,
+    imp_mem_read_b,
+    imp_mem_write_w,
+    imp_mem_write_s,
+    imp_mem_write_b,
+    imp_on_ecall,
+    imp_on_ebreak,
+  };
+
+  auto mem = std::make_unique<memory_t>();
+
+  riscv_t *rv = rv_create(&io, mem.get());
+  if (!rv) {
+    fprintf(stderr, "Unable to create riscv emulator\n");
+    return 1;
+  }
+  rv_set_mem_map(rv, mem->chunk_map());
+
+  // place the program in memory just as riscv_vm would
+  if (!elf.upload(rv, *mem)) {
+    fprintf(stderr, "Unable to upload ELF file '%s'\n", program);
+    return 1;
+  }
+
+  // translate everything reachable from the roots
+  std::vector<uint32_t> roots;
+  find_roots(elf, *mem, roots);
+  const uint32_t blocks =
+    rv_translate_jit_blocks(rv, roots.data(), (uint32_t)roots.size());
+
+  // write out the code cache keyed the same way riscv_vm looks it up
+  if (!rv_save_jit_cache(rv, output, elf.hash_segments())) {
+    fprintf(stderr, "Unable to write '%s'\n", output);
+    return 1;
+  }
+
+  riscv_jit_stats_t stats;
+  rv_get_jit_stats(rv, &stats);
+  printf("%u blocks from %u roots, %u / %u bytes of code cache\n", blocks,
+         (uint32_t)roots.size(), stats.code_used, stats.code_size);
+
+  rv_delete(rv);
+  return 0;
+}
@@ -125,7 +125,22 @@ static bool op_load(struct riscv_t *rv, uint32_t inst) {
 
 #if RISCV_VM_SUPPORT_Zifencei
 static bool op_misc_mem(struct riscv_t *rv, uint32_t inst) {
-  // TODO
+  // i-type decode
+  const uint32_t funct3 = dec_funct3(inst);
+  switch (funct3) {
+  case 0b000: // FENCE
+    // note: there is only one hart so memory ordering is already sequential
+    break;
+  case 0b001: // FENCE.I
+#if RISCV_VM_X64_JIT
+    // translated code may be stale if the guest has written to it
+    rv_jit_fence_i(rv);
+#endif
+    break;
+  default:
+    assert(!"unreachable");
+    break;
+  }
   rv->PC += 4;
   return true;
 }
@@ -637,46 +652,6 @@ static bool op_amo(struct riscv_t *rv, uint32_t inst) {
 #endif  // RISCV_VM_SUPPORT_RV32A
 
 #if RISCV_VM_SUPPORT_RV32F
-enum {
-  //             ....xxxx....xxxx....xxxx....xxxx
-  FMASK_SIGN = 0b10000000000000000000000000000000,
-  FMASK_EXPN = 0b01111111100000000000000000000000,
-  FMASK_FRAC = 0b00000000011111111111111111111111,
-  //             ........xxxxxxxx........xxxxxxxx
-};
-
-static uint32_t calc_fclass(uint32_t f) {
-  const uint32_t sign = f & FMASK_SIGN;
-  const uint32_t expn = f & FMASK_EXPN;
-  const uint32_t frac = f & FMASK_FRAC;
-
-  // note: this could be turned into a binary decision tree for speed
-
-  uint32_t out = 0;
-  // 0x001    rs1 is -INF
-  out |= (f == 0xff800000)                               ? 0x001 : 0;
-  // 0x002    rs1 is negative normal
-  out |= (expn && expn < 0x78000000 && sign)             ? 0x002 : 0;
-  // 0x004    rs1 is negative subnormal
-  out |= (!expn && frac && sign)                         ? 0x004 : 0;
-  // 0x008    rs1 is -0
-  out |= (f == 0x80000000)                               ? 0x008 : 0;
-  // 0x010    rs1 is +0
-  out |= (f == 0x00000000)                               ? 0x010 : 0;
-  // 0x020    rs1 is positive subnormal
-  out |= (!expn && frac && !sign)                        ? 0x020 : 0;
-  // 0x040    rs1 is positive normal
-  out |= (expn && expn < 0x78000000 && !sign)            ? 0x040 : 0;
-  // 0x080    rs1 is +INF
-  out |= (f == 0x7f800000)                               ? 0x080 : 0;
-  // 0x100    rs1 is a signaling NaN
-  out |= (expn == FMASK_EXPN && (frac <= 0x7ff) && frac) ? 0x100 : 0;
-  // 0x200    rs1 is a quiet NaN
-  out |= (expn == FMASK_EXPN && (frac >= 0x800))         ? 0x200 : 0;
-
-  return out;
-}
-
 bool op_load_fp(struct riscv_t *rv, uint32_t inst) {
   const uint32_t rd  = dec_rd(inst);
   const uint32_t rs1 = dec_rs1(inst);
@@ -948,11 +923,13 @@ void rv_step(struct riscv_t *rv, int32_t cycles) {
       // dispatch this opcode
       const opcode_t op = opcodes[index];
       assert(op);
-      if (!op(rv, inst)) {
-        break;
-      }
+      const bool more = op(rv, inst);
       // increment the cycles csr
+      // note: the branch is counted too, as it would be by translated code
       rv->csr_cycle++;
+      if (!more) {
+        break;
+      }
     }
   }
 }
@@ -982,6 +959,9 @@ void rv_step(struct riscv_t *rv, int32_t cycles) {
 
 void rv_delete(struct riscv_t *rv) {
   assert(rv);
+#if RISCV_VM_X64_JIT
+  rv_free_jit(rv);
+#endif
   free(rv);
   return;
 }
@@ -90,6 +90,75 @@ struct riscv_io_t {
   riscv_on_ebreak on_ebreak;
 };
 
+// guest memory is mapped in chunks of this many address bits
+#define RV_MEM_CHUNK_BITS 16
+
+// optimization passes the JIT can run over a block before translating it
+enum {
+  // fold instructions whose operands are known, i.e. lui/addi/auipc chains,
+  // and turn jalr with a known target into a direct jump
+  rv_jit_pass_const_prop = 1,
+  // read the original register in place of a copy made by mv
+  rv_jit_pass_copy_prop = 2,
+  // skip instructions whose result is overwritten before it is read
+  rv_jit_pass_dead_write = 4,
+  // keep the guest registers needed soonest in host registers, rather than
+  // the most recently used, to reload fewer of them
+  rv_jit_pass_load_elim = 8,
+
+  rv_jit_pass_all = 15
+};
+
+// statistics about the JIT code cache
+struct riscv_jit_stats_t {
+  // number of blocks translated
+  uint64_t translations;
+  // number of blocks translated again after a flush discarded them
+  uint64_t retranslations;
+  // number of times the code cache was flushed
+  uint64_t flushes;
+  // number of blocks discarded because the guest wrote to their code
+  uint64_t invalidations;
+  // number of blocks run by the interpreter because they were not hot enough
+  // to translate yet
+  uint64_t interpreted;
+  // number of blocks the background translator translated before the guest
+  // reached them
+  uint64_t speculative;
+  // inline cache hits and misses at indirect jumps, summed over the blocks
+  // currently in the code cache
+  uint64_t ic_hits;
+  uint64_t ic_misses;
+  // returns whose target the return address stack did and did not predict,
+  // summed over the blocks currently in the code cache
+  uint64_t ras_hits;
+  uint64_t ras_misses;
+  // guest instructions covered by the blocks in the code cache, which gives
+  // the code generated per guest instruction along with code_used
+  uint64_t code_instructions;
+  // bytes of the code cache in use and its total size
+  uint32_t code_used;
+  uint32_t code_size;
+  // true if the code cache is backed by explicit huge pages.  otherwise
+  // transparent huge pages are asked for, which the os may not provide.
+  bool code_huge_pages;
+};
+
+// how often a translated block ran, as gathered by rv_set_jit_profile
+struct riscv_jit_profile_t {
+  // guest address the block starts at and the address its trace reached
+  uint32_t pc_start;
+  uint32_t pc_end;
+  // guest instructions in the block and bytes of code they were translated to
+  uint32_t instructions;
+  uint32_t code_size;
+  // times translated code entered the block, or went round it for a loop
+  uint64_t executions;
+  // times the dispatcher reached the block but interpreted it instead, i.e.
+  // for instructions that are never translated
+  uint64_t fallbacks;
+};
+
 // create a riscv emulator
 struct riscv_t *rv_create(const struct riscv_io_t *io, riscv_user_t user_data);
 
@@ -126,6 +195,102 @@ void rv_set_exception(struct riscv_t *, uint32_t except);
 // return the cycle counter
 uint64_t rv_get_csr_cycles(struct riscv_t *);
 
+// provide a direct map of guest memory so that memory can be accessed without
+// calling the io handlers.  guest address 'addr' is found on the host at
+// 'chunks[addr >> RV_MEM_CHUNK_BITS] + (addr & 0xffff)'.  NULL entries (i.e.
+// unmapped or mmio ranges) fall back to the io handlers.
+// note: the table is read live so chunks may be added while running but it
+//       must remain valid for the lifetime of the emulator.
+void rv_set_mem_map(struct riscv_t *, uint8_t *const *chunks);
+
+// set how many times a block is interpreted before the JIT translates it
+// note: 0 translates every block the first time it runs
+void rv_set_jit_threshold(struct riscv_t *, uint32_t count);
+
+// choose the optimization passes run over blocks before they are translated
+// as a mask of rv_jit_pass_* values.  they are all enabled by default.
+// note: blocks that have already been translated are not affected
+void rv_set_jit_passes(struct riscv_t *, uint32_t passes);
+
+// stop rv_step after exactly the number of cycles asked for, as the
+// interpreter does, rather than at the end of the block that reaches them
+// note: translated code runs until the last few blocks before the target,
+//       which are interpreted instead.  this suits tracing and sampling.
+void rv_set_jit_exact(struct riscv_t *, bool enable);
+
+// translate for baseline x86-64 even if the host supports extensions such as
+// bmi2 and avx, i.e. so that a JIT cache can be used on other machines
+// note: blocks that have already been translated are not affected
+void rv_set_jit_baseline(struct riscv_t *, bool enable);
+
+// translate blocks on a background thread while the guest keeps running in
+// the interpreter, or translate them in place if 'enable' is false
+// note: the io ifetch handler is then called from the background thread
+void rv_set_jit_async(struct riscv_t *, bool enable);
+
+// return the name of the guest symbol containing 'addr' and set 'base' to its
+// address, or return NULL if there is none
+typedef const char *(*riscv_jit_symbolize)(struct riscv_t *rv,
+                                            riscv_word_t addr,
+                                            riscv_word_t *base);
+
+// ways of describing translated code to the linux perf profiler
+enum {
+  // /tmp/perf-<pid>.map, which perf report reads directly
+  rv_jit_perf_map = 1,
+  // /tmp/jit-<pid>.dump, which 'perf inject --jit' merges into a recording.
+  // it also holds the code so that perf annotate can show it.
+  rv_jit_perf_dump = 2,
+};
+
+// describe blocks to the perf profiler as they are translated, labelled with
+// the guest code they came from as 'rv:symbol+0x10' or 'rv:80001230' if
+// 'symbolize' is NULL or finds nothing.  'formats' is a mask of rv_jit_perf_*
+// values, or 0 to close the files.  returns false if a file can't be created.
+// note: this is only supported on linux.  blocks translated earlier are not
+//       described, so enable it before running or loading a JIT cache.
+bool rv_set_jit_perf(struct riscv_t *, uint32_t formats,
+                     riscv_jit_symbolize symbolize);
+
+// count how often each translated block runs so that rv_get_jit_profile can
+// report where time is spent
+// note: blocks translated earlier are not counted, so enable it before
+//       running or loading a JIT cache
+void rv_set_jit_profile(struct riscv_t *, bool enable);
+
+// copy the profile of up to 'max' blocks to 'out', those that ran the most
+// guest instructions (executions * instructions) first, and return the number
+// of blocks profiled, which may be more than 'max'.  blocks translated more
+// than once from the same address are reported together, including those
+// discarded by flushes.
+uint32_t rv_get_jit_profile(struct riscv_t *, struct riscv_jit_profile_t *out,
+                            uint32_t max);
+
+// translate the blocks at the given guest addresses, and every block they
+// reach through direct jumps and branches, without running them.  returns the
+// number of blocks translated.
+// note: translation stops once three quarters of the code cache is used so
+//       that there is room left for the blocks that were missed.  if a memory
+//       map has been set then addresses it does not cover are skipped.
+uint32_t rv_translate_jit_blocks(struct riscv_t *, const uint32_t *addrs,
+                                 uint32_t count);
+
+// write the translated code to a file so that a later run can start with it
+// note: 'key' should identify the guest program, e.g. a hash of its loaded
+//       segments.  the file is only valid for the same build of the emulator.
+bool rv_save_jit_cache(struct riscv_t *, const char *path, uint64_t key);
+
+// load translated code written by rv_save_jit_cache with the same key
+// note: call this once the guest program is in memory.  blocks whose guest
+//       code has changed since the file was written are discarded.  the file
+//       is rejected unless the memory map, exact mode, passes, baseline and
+//       profile settings match those it was written with, so set them first.
+bool rv_load_jit_cache(struct riscv_t *, const char *path, uint64_t key);
+
+// return statistics about the JIT code cache
+// note: these are all zero when the JIT is not in use
+void rv_get_jit_stats(struct riscv_t *, struct riscv_jit_stats_t *out);
+
 #ifdef __cplusplus
 };  // ifdef __cplusplus
 #endif
@@ -50,3 +50,8 @@ void rv_set_exception(struct riscv_t *rv, uint32_t except) {
 uint64_t rv_get_csr_cycles(struct riscv_t *rv) {
   return rv->csr_cycle;
 }
+
+void rv_set_mem_map(struct riscv_t *rv, uint8_t *const *chunks) {
+  assert(rv);
+  rv->mem_map = chunks;
+}
@@ -24,6 +24,16 @@
 #ifndef RISCV_VM_X64_JIT
 #define RISCV_VM_X64_JIT           0
 #endif
+// size of the x64 JIT code cache in bytes
+// note: when full the cache is flushed and blocks are translated again
+#ifndef RISCV_VM_JIT_CODE_SIZE
+#define RISCV_VM_JIT_CODE_SIZE     (4 * 1024 * 1024)
+#endif
+// number of times the interpreter runs a block before the x64 JIT translates
+// it.  0 translates every block the first time it runs.
+#ifndef RISCV_VM_JIT_THRESHOLD
+#define RISCV_VM_JIT_THRESHOLD     64
+#endif
 // enable machine mode support
 #ifndef RISCV_SUPPORT_MACHINE
 #define RISCV_SUPPORT_MACHINE      0
@@ -3,14 +3,18 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <math.h>
 
 #ifdef _WIN32
 #include <Windows.h>
 #endif
 
-#if __linux__
-//#include <asm/cachectl.h>
+#ifdef __linux__
 #include <sys/mman.h>
+#include <sys/syscall.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
 #endif
 
 #include "riscv.h"
@@ -38,13 +42,129 @@
 //    windows - caller must allocate 32bytes of shadow space.
 //    windows - stack must be 16 byte aligned.
 //    linux   - no shadow space needed.
+//    linux   - stack must be 16 byte aligned.
+
+// host ABI description
+//
+// the rv struct pointer is held in a callee save register so that it survives
+// any calls made to the io handlers.  it is the base of every rv struct access,
+// which rbx and rsi keep short: neither needs a rex prefix for 32 bit accesses,
+// nor the sib byte or forced displacement that rsp, rbp, r12 and r13 need as a
+// base.
+#ifdef _WIN32
+enum {
+  abi_arg1 = cg_rcx,
+  abi_arg2 = cg_rdx,
+  abi_arg3 = cg_r8,
+  abi_arg4 = cg_r9,
+  // register holding the rv struct pointer
+  abi_rv   = cg_rsi,
+};
+// space the caller must reserve for the callee to spill its register args
+static const int32_t abi_shadow_space = 32;
+// callee save registers that translated code may modify
+static const cg_r64_t abi_saved_regs[] = {
+  cg_rsi, cg_rbx, cg_rdi, cg_r12, cg_r13, cg_r14, cg_r15,
+};
+// registers available to hold guest registers in order of preference
+// note: argument registers are excluded so that call setup never clobbers them
+static const cg_r64_t abi_alloc_regs[] = {
+  cg_rbx, cg_rdi, cg_r12, cg_r13, cg_r14, cg_r15, cg_r10, cg_r11,
+};
+// xmm registers from this one upwards are callee save
+static const cg_xmm_t abi_saved_xmm = cg_xmm6;
+// xmm registers available to hold guest float registers
+// note: xmm0 and xmm1 are kept as scratch and for helper arguments
+static const cg_xmm_t abi_alloc_xmms[] = {
+  cg_xmm6,  cg_xmm7,  cg_xmm8,  cg_xmm9,  cg_xmm10, cg_xmm11, cg_xmm12,
+  cg_xmm13, cg_xmm14, cg_xmm15, cg_xmm2,  cg_xmm3,  cg_xmm4,  cg_xmm5,
+};
+#else
+enum {
+  abi_arg1 = cg_rdi,
+  abi_arg2 = cg_rsi,
+  abi_arg3 = cg_rdx,
+  abi_arg4 = cg_rcx,
+  // register holding the rv struct pointer
+  abi_rv   = cg_rbx,
+};
+// space the caller must reserve for the callee to spill its register args
+static const int32_t abi_shadow_space = 0;
+// callee save registers that translated code may modify
+static const cg_r64_t abi_saved_regs[] = {
+  cg_rbx, cg_r12, cg_r13, cg_r14, cg_r15,
+};
+// registers available to hold guest registers in order of preference
+// note: argument registers are excluded so that call setup never clobbers them
+static const cg_r64_t abi_alloc_regs[] = {
+  cg_r12, cg_r13, cg_r14, cg_r15, cg_r8, cg_r9, cg_r10, cg_r11,
+};
+// xmm registers from this one upwards are callee save (none)
+static const cg_xmm_t abi_saved_xmm = cg_xmm15 + 1;
+// xmm registers available to hold guest float registers
+// note: xmm0 and xmm1 are kept as scratch and for helper arguments
+static const cg_xmm_t abi_alloc_xmms[] = {
+  cg_xmm2,  cg_xmm3,  cg_xmm4,  cg_xmm5,  cg_xmm6,  cg_xmm7,  cg_xmm8,
+  cg_xmm9,  cg_xmm10, cg_xmm11, cg_xmm12, cg_xmm13, cg_xmm14, cg_xmm15,
+};
+#endif
+
+#define countof(X) (sizeof(X) / sizeof(X[0]))
+
+// translated code stack frame layout (relative to rsp after the prologue)
+//
+//  [rsp + 0]                   shadow space (if required by the ABI)
+//  [rsp + abi_shadow_space]    saved abi_saved_regs
+//  [rsp + frame_xmm_offset()]  saved callee save xmm registers
+//
+// note: the frame size keeps rsp 16 byte aligned for any calls we make.
+// note: the frame is setup once by the enter trampoline and shared by all
+//       blocks that are chained together before returning to the dispatcher.
+static int32_t frame_xmm_offset(void) {
+  const int32_t size = abi_shadow_space + 8 * (int32_t)countof(abi_saved_regs);
+  return (size + 15) & ~15;
+}
+
+static int32_t frame_size(void) {
+  return frame_xmm_offset() + 16 * (cg_xmm15 + 1 - abi_saved_xmm);
+}
 
+// return true if the host ABI preserves a register across calls
+static bool abi_is_saved(cg_r64_t reg) {
+  for (uint32_t i = 0; i < countof(abi_saved_regs); ++i) {
+    if (abi_saved_regs[i] == reg) {
+      return true;
+    }
+  }
+  return false;
+}
 
 // total size of the code block
-static const uint32_t code_size = 1024 * 1024 * 4;
+static const uint32_t code_size = RISCV_VM_JIT_CODE_SIZE;
 
-// total number of block map entries
-static const uint32_t map_size = 1024 * 64;
+// size of the counter area after the code buffer
+static const uint32_t counters_size =
+  ((RISCV_VM_JIT_CODE_SIZE / 16) + 4095) & ~4095u;
+
+// number of block headers that follow the counters.  blocks average well over
+// a kilobyte of code so the code buffer is almost always full first.
+static const uint32_t blocks_count = RISCV_VM_JIT_CODE_SIZE / 256;
+
+// size of a host huge page
+static const size_t huge_page_size = 2 * 1024 * 1024;
+
+// maximum number of instructions a block may grow to by following jumps and
+// continuing past branches
+static const uint32_t trace_max_instructions = 256;
+
+// code buffer space that must remain before translating another instruction.
+// this covers the largest translated instruction plus the code that ends the
+// block.
+static const uint32_t code_headroom = 2048;
+
+// target of an empty inline cache or return address stack entry, which no
+// jalr can produce as it clears the low bit of the address
+static const uint32_t empty_target = 1;
 
 
 // flush the instruction cache for a region
@@ -55,21 +175,88 @@ static void sys_flush_icache(const void *start, size_t size) {
   }
 #endif
 #ifdef __linux__
-//  if (cacheflush(start, size, ICACHE) == -1) {
-//    // failed
-//  }
+  // note: x64 keeps the instruction cache coherent so this is a no-op there
+  __builtin___clear_cache((char *)start, (char *)start + size);
 #endif
 }
 
-// allocate system executable memory
-static void *sys_alloc_exec_mem(uint32_t size) {
+// allocate system executable memory for 'code' bytes of code followed by
+// 'rest' bytes of other data.  the code is placed on huge pages where the host
+// allows it, to take fewer itlb misses, and 'huge' is set if they are
+// explicit huge pages rather than transparent ones the os may not provide.
+static void *sys_alloc_exec_mem(size_t code, size_t rest, bool *huge) {
+  *huge = false;
 #ifdef _WIN32
-  return VirtualAlloc(NULL, size, MEM_COMMIT, PAGE_EXECUTE_READWRITE);
+  // note: large pages need a privilege users rarely hold
+  return VirtualAlloc(NULL, code + rest, MEM_COMMIT, PAGE_EXECUTE_READWRITE);
 #endif
 #ifdef __linux__
   const int prot = PROT_READ | PROT_WRITE | PROT_EXEC;
-  // mmap(addr, length, prot, flags, fd, offset)
-  return mmap(NULL, size, prot, MAP_ANONYMOUS | MAP_PRIVATE, 0, 0);
+  const int flags = MAP_ANONYMOUS | MAP_PRIVATE;
+  if (code % huge_page_size) {
+    // mmap(addr, length, prot, flags, fd, offset)
+    void *ptr = mmap(NULL, code + rest, prot, flags, -1, 0);
+    return (ptr == MAP_FAILED) ? NULL : ptr;
+  }
+  // map enough to align the code to a huge page and trim the ends
+  const size_t size = code + rest + huge_page_size;
+  uint8_t *base = mmap(NULL, size, prot, flags, -1, 0);
+  if (base == MAP_FAILED) {
+    return NULL;
+  }
+  uint8_t *start = (uint8_t *)(((uintptr_t)base + huge_page_size - 1) &
+                               ~(uintptr_t)(huge_page_size - 1));
+  if (start != base) {
+    munmap(base, start - base);
+  }
+  munmap(start + code + rest, (base + size) - (start + code + rest));
+#ifdef MAP_HUGETLB
+  // explicit huge pages must have been reserved so this usually fails
+  if (mmap(start, code, prot, flags | MAP_FIXED | MAP_HUGETLB, -1, 0) ==
+      start) {
+    *huge = true;
+    return start;
+  }
+  // note: the range is still ours so make sure it is mapped
+  mmap(start, code, prot, flags | MAP_FIXED, -1, 0);
+#endif
+#ifdef MADV_HUGEPAGE
+  // ask for transparent huge pages, which may be disabled
+  madvise(start, code, MADV_HUGEPAGE);
+#endif
+  return start;
+#endif
+}
+
+// release memory returned by sys_alloc_exec_mem for the same sizes
+static void sys_free_exec_mem(void *ptr, size_t code, size_t rest) {
+#ifdef _WIN32
+  (void)code;
+  (void)rest;
+  VirtualFree(ptr, 0, MEM_RELEASE);
+#endif
+#ifdef __linux__
+  // note: the ends trimmed for alignment are already unmapped
+  munmap(ptr, code + rest);
+#endif
+}
+
+// read a value written by another thread, ordering later reads after it
+static uint32_t sys_load_acquire(const volatile uint32_t *ptr) {
+#ifdef _MSC_VER
+  // note: msvc gives volatile accesses acquire and release semantics on x64
+  return *ptr;
+#else
+  return __atomic_load_n(ptr, __ATOMIC_ACQUIRE);
+#endif
+}
+
+// publish a value to another thread, ordering earlier writes before it
+static void sys_store_release(volatile uint32_t *ptr, uint32_t value) {
+#ifdef _MSC_VER
+  *ptr = value;
+#else
+  __atomic_store_n(ptr, value, __ATOMIC_RELEASE);
 #endif
 }
 
@@ -81,7 +268,7 @@ static void set_pc(struct block_t *block, struct riscv_t *rv, cg_r32_t reg) {
   struct cg_state_t *cg = &block->cg;
 
   const int32_t offset = rv_offset(rv, PC);
-  cg_mov_r64disp_r32(cg, cg_rsi, offset, reg);
+  cg_mov_r64disp_r32(cg, abi_rv, offset, reg);
 }
 
 static void get_pc(struct block_t *block, struct riscv_t *rv, cg_r32_t reg) {
@@ -89,7 +276,207 @@ static void get_pc(struct block_t *block, struct riscv_t *rv, cg_r32_t reg) {
   struct cg_state_t *cg = &block->cg;
 
   const int32_t offset = rv_offset(rv, PC);
-  cg_mov_r32_r64disp(cg, reg, cg_rsi, offset);
+  cg_mov_r32_r64disp(cg, reg, abi_rv, offset);
+}
+
+// setup a register allocator for one class of host registers
+static void regs_init(struct jit_regs_t *regs, const int *pool,
+                      uint32_t pool_size, bool fp) {
+  assert(pool_size <= RV_JIT_HOST_REGS);
+  regs->pool = pool;
+  regs->pool_size = pool_size;
+  regs->fp = fp;
+}
+
+// forget all guest registers held by one class of host registers
+static void regs_clear(struct jit_regs_t *regs) {
+  memset(regs->host, -1, sizeof(regs->host));
+  memset(regs->guest, -1, sizeof(regs->guest));
+  memset(regs->last_use, 0, sizeof(regs->last_use));
+  regs->dirty = 0;
+  regs->time = 0;
+}
+
+// reset the register allocators at the start of a block
+static void regs_reset(struct riscv_jit_t *jit) {
+  regs_clear(&jit->regs);
+  regs_clear(&jit->fregs);
+}
+
+// return true if a host register will survive any calls we make
+static bool regs_is_saved(const struct jit_regs_t *regs, int host) {
+  return regs->fp ? (host >= abi_saved_xmm) : abi_is_saved(host);
+}
+
+// load a guest register from the rv struct into a host register
+static void regs_load(struct block_t *block, struct riscv_t *rv,
+                      const struct jit_regs_t *regs, int host, int guest) {
+  struct cg_state_t *cg = &block->cg;
+#if RISCV_VM_SUPPORT_RV32F
+  if (regs->fp) {
+    cg_movss_xmm_r64disp(cg, host, abi_rv, rv_offset(rv, F[guest]));
+    return;
+  }
+#endif
+  cg_mov_r32_r64disp(cg, host, abi_rv, rv_offset(rv, X[guest]));
+}
+
+// store a host register to its guest register in the rv struct
+static void regs_store(struct block_t *block, struct riscv_t *rv,
+                       const struct jit_regs_t *regs, int host, int guest) {
+  struct cg_state_t *cg = &block->cg;
+#if RISCV_VM_SUPPORT_RV32F
+  if (regs->fp) {
+    cg_movss_r64disp_xmm(cg, abi_rv, rv_offset(rv, F[guest]), host);
+    return;
+  }
+#endif
+  cg_mov_r64disp_r32(cg, abi_rv, rv_offset(rv, X[guest]), host);
+}
+
+// write a host register back to the rv struct if it holds a modified value
+static void regs_writeback(struct block_t *block, struct riscv_t *rv,
+                           struct jit_regs_t *regs, int host) {
+  if (regs->dirty & (1u << host)) {
+    regs_store(block, rv, regs, host, regs->guest[host]);
+    regs->dirty &= ~(1u << host);
+  }
+}
+
+// release a host register, writing back its value if needed
+static void regs_release(struct block_t *block, struct riscv_t *rv,
+                         struct jit_regs_t *regs, int host) {
+  regs_writeback(block, rv, regs, host);
+  if (regs->guest[host] >= 0) {
+    regs->host[regs->guest[host]] = -1;
+    regs->guest[host] = -1;
+  }
+}
+
+static uint32_t ir_next_use(const struct riscv_jit_t *jit, uint32_t guest);
+
+// assign a host register to a guest register.  if none are free this evicts
+// the guest register that will be used furthest ahead, or the least recently
+// used one when the block is translated without looking ahead.
+static int regs_alloc(struct block_t *block, struct riscv_t *rv,
+                      struct jit_regs_t *regs, uint32_t guest) {
+  assert(regs->host[guest] < 0);
+  const bool ahead = !regs->fp && (rv->jit.passes & rv_jit_pass_load_elim);
+  int host = regs->pool[0];
+  uint32_t host_next = 0;
+  for (uint32_t i = 0; i < regs->pool_size; ++i) {
+    const int r = regs->pool[i];
+    if (regs->guest[r] < 0) {
+      host = r;
+      break;
+    }
+    const uint32_t next = ahead ? ir_next_use(&rv->jit, regs->guest[r]) : 0;
+    if (i == 0 || next > host_next ||
+        (next == host_next && regs->last_use[r] < regs->last_use[host])) {
+      host = r;
+      host_next = next;
+    }
+  }
+  regs_release(block, rv, regs, host);
+  regs->guest[host] = (int8_t)guest;
+  regs->host[guest] = (int8_t)host;
+  return host;
+}
+
+// return a host register holding the value of a guest register
+static int regs_read(struct block_t *block, struct riscv_t *rv,
+                     struct jit_regs_t *regs, uint32_t guest) {
+  int host = regs->host[guest];
+  if (host < 0) {
+    host = regs_alloc(block, rv, regs, guest);
+    regs_load(block, rv, regs, host, guest);
+  }
+  regs->last_use[host] = ++regs->time;
+  return host;
+}
+
+// return a host register that will hold a new value for a guest register
+static int regs_write(struct block_t *block, struct riscv_t *rv,
+                      struct jit_regs_t *regs, uint32_t guest) {
+  int host = regs->host[guest];
+  if (host < 0) {
+    host = regs_alloc(block, rv, regs, guest);
+  }
+  regs->last_use[host] = ++regs->time;
+  regs->dirty |= 1u << host;
+  return host;
+}
+
+// return a host register holding rs1 that will receive a new value for rd
+// note: this suits two operand host instructions computing 'rd = rs1 op x'
+static cg_r32_t regs_read_write(struct block_t *block, struct riscv_t *rv,
+                                uint32_t rd, uint32_t rs1) {
+  struct cg_state_t *cg = &block->cg;
+  struct jit_regs_t *regs = &rv->jit.regs;
+  if (rs1 == rv_reg_zero) {
+    const cg_r32_t dst = regs_write(block, rv, regs, rd);
+    cg_xor_r32_r32(cg, dst, dst);
+    return dst;
+  }
+  const cg_r32_t src = regs_read(block, rv, regs, rs1);
+  const cg_r32_t dst = regs_write(block, rv, regs, rd);
+  if (dst != src) {
+    cg_mov_r32_r32(cg, dst, src);
+  }
+  return dst;
+}
+
+// write back all modified guest registers
+// note: mappings are kept so registers can still be read afterwards
+static void regs_flush(struct block_t *block, struct riscv_t *rv) {
+  struct jit_regs_t *all[] = {&rv->jit.regs, &rv->jit.fregs};
+  for (uint32_t c = 0; c < countof(all); ++c) {
+    for (uint32_t i = 0; i < all[c]->pool_size; ++i) {
+      regs_writeback(block, rv, all[c], all[c]->pool[i]);
+    }
+  }
+}
+
+// release any host registers that will not survive a call
+static void regs_spill_volatile(struct block_t *block, struct riscv_t *rv) {
+  struct jit_regs_t *all[] = {&rv->jit.regs, &rv->jit.fregs};
+  for (uint32_t c = 0; c < countof(all); ++c) {
+    for (uint32_t i = 0; i < all[c]->pool_size; ++i) {
+      if (!regs_is_saved(all[c], all[c]->pool[i])) {
+        regs_release(block, rv, all[c], all[c]->pool[i]);
+      }
+    }
+  }
+}
+
+// park volatile host registers in the rv struct so their values survive a
+// call
+// note: the allocation state is unchanged so this is suitable for calls on a
+//       conditional path.  storing a clean register is harmless as the rv
+//       struct already holds the same value.
+static void regs_save_volatile(struct block_t *block, struct riscv_t *rv) {
+  struct jit_regs_t *all[] = {&rv->jit.regs, &rv->jit.fregs};
+  for (uint32_t c = 0; c < countof(all); ++c) {
+    for (uint32_t i = 0; i < all[c]->pool_size; ++i) {
+      const int host = all[c]->pool[i];
+      if (!regs_is_saved(all[c], host) && all[c]->guest[host] >= 0) {
+        regs_store(block, rv, all[c], host, all[c]->guest[host]);
+      }
+    }
+  }
+}
+
+// reload volatile host registers parked by regs_save_volatile
+static void regs_restore_volatile(struct block_t *block, struct riscv_t *rv) {
+  struct jit_regs_t *all[] = {&rv->jit.regs, &rv->jit.fregs};
+  for (uint32_t c = 0; c < countof(all); ++c) {
+    for (uint32_t i = 0; i < all[c]->pool_size; ++i) {
+      const int host = all[c]->pool[i];
+      if (!regs_is_saved(all[c], host) && all[c]->guest[host] >= 0) {
+        regs_load(block, rv, all[c], host, all[c]->guest[host]);
+      }
+    }
+  }
 }
 
 static void get_reg(struct block_t *block, struct riscv_t *rv, cg_r32_t dst, uint32_t src) {
@@ -100,8 +487,8 @@ static void get_reg(struct block_t *block, struct riscv_t *rv, cg_r32_t dst, uin
     cg_xor_r32_r32(cg, dst, dst);
   }
   else {
-    const int32_t offset = rv_offset(rv, X[src]);
-    cg_mov_r32_r64disp(cg, dst, cg_rsi, offset);
+    const cg_r32_t host = regs_read(block, rv, &rv->jit.regs, src);
+    cg_mov_r32_r32(cg, dst, host);
   }
 }
 
@@ -110,313 +497,2005 @@ static void set_reg(struct block_t *block, struct riscv_t *rv, uint32_t dst, cg_
   struct cg_state_t *cg = &block->cg;
 
   if (dst != rv_reg_zero) {
-    const int32_t offset = rv_offset(rv, X[dst]);
-    cg_mov_r64disp_r32(cg, cg_rsi, offset, src);
+    const cg_r32_t host = regs_write(block, rv, &rv->jit.regs, dst);
+    cg_mov_r32_r32(cg, host, src);
   }
 }
 
-static void gen_prologue(struct block_t *block, struct riscv_t *rv) {
+// emit an inline lookup of a guest address in a direct memory map
+// note: 'map' is the rv offset of a table with one host pointer for each
+//       range of 'bits' address bits.  on a hit rcx holds the host pointer and
+//       rax the offset within the range.  unmapped ranges and accesses
+//       straddling two ranges jump to 'miss', which must be bound to the slow
+//       path right after the access and the jump over it.
+static void gen_mem_lookup(struct block_t *block, cg_r32_t addr,
+                           uint32_t size, int32_t map, uint32_t bits,
+                           struct cg_label_t *miss) {
   struct cg_state_t *cg = &block->cg;
+  // rcx = map[addr >> bits]
+  cg_mov_r32_r32(cg, cg_eax, addr);
+  cg_shr_r32_i8(cg, cg_eax, bits);
+  cg_mov_r64_r64disp(cg, cg_rcx, abi_rv, map);
+  cg_mov_r64_r64idx(cg, cg_rcx, cg_rcx, cg_rax, 8);
+  cg_test_r64_r64(cg, cg_rcx, cg_rcx);
+  cg_jcc_label_short(cg, cg_cc_eq, miss);
+  // rax = addr & ((1 << bits) - 1)
+  if (bits == 16) {
+    cg_movzx_r32_r16(cg, cg_eax, addr);
+  }
+  else {
+    cg_mov_r32_r32(cg, cg_eax, addr);
+    cg_and_r32_i32(cg, cg_eax, (1u << bits) - 1);
+  }
+  if (size > 1) {
+    cg_cmp_r32_i32(cg, cg_eax, (1u << bits) - size);
+    cg_jcc_label_short(cg, cg_cc_ab, miss);
+  }
+}
+
+// generate the trampolines used to enter and leave translated code
+static void gen_trampolines(struct riscv_jit_t *jit) {
+  struct cg_state_t cg_state;
+  struct cg_state_t *cg = &cg_state;
+  cg_init(cg, jit->head, jit->end);
+
+  // enter(rv, code)
+  jit->enter = (jit_enter_t)cg->head;
   // new stack frame
   cg_push_r64(cg, cg_rbp);
   cg_mov_r64_r64(cg, cg_rbp, cg_rsp);
-  cg_sub_r64_i32(cg, cg_rsp, 64);
-  // save rsi
-  cg_mov_r64disp_r64(cg, cg_rsp, 32, cg_rsi);
-  // move rv struct pointer into rsi
-  cg_mov_r64_r64(cg, cg_rsi, cg_rcx);
-}
+  cg_sub_r64_i32(cg, cg_rsp, frame_size());
+  // save the callee save registers we are about to use
+  for (uint32_t i = 0; i < countof(abi_saved_regs); ++i) {
+    const int32_t offset = abi_shadow_space + i * 8;
+    cg_mov_r64disp_r64(cg, cg_rsp, offset, abi_saved_regs[i]);
+  }
+  for (cg_xmm_t x = abi_saved_xmm; x <= cg_xmm15; ++x) {
+    const int32_t offset = frame_xmm_offset() + (x - abi_saved_xmm) * 16;
+    cg_movups_r64disp_xmm(cg, cg_rsp, offset, x);
+  }
+  // move rv struct pointer into its register
+  cg_mov_r64_r64(cg, abi_rv, abi_arg1);
+  // jump into the block
+  cg_jmp_r64(cg, abi_arg2);
 
-static void gen_epilogue(struct block_t *block, struct riscv_t *rv) {
-  struct cg_state_t *cg = &block->cg;
-  // restore rsi
-  cg_mov_r64_r64disp(cg, cg_rsi, cg_rsp, 32);
+  // exit
+  jit->exit = cg->head;
+  // restore the callee save registers
+  for (uint32_t i = 0; i < countof(abi_saved_regs); ++i) {
+    const int32_t offset = abi_shadow_space + i * 8;
+    cg_mov_r64_r64disp(cg, abi_saved_regs[i], cg_rsp, offset);
+  }
+  for (cg_xmm_t x = abi_saved_xmm; x <= cg_xmm15; ++x) {
+    const int32_t offset = frame_xmm_offset() + (x - abi_saved_xmm) * 16;
+    cg_movups_xmm_r64disp(cg, x, cg_rsp, offset);
+  }
   // leave stack frame
   cg_mov_r64_r64(cg, cg_rsp, cg_rbp);
   cg_pop_r64(cg, cg_rbp);
+  cg_ret(cg);
+
+  jit->head = cg->head;
+  sys_flush_icache(cg->start, cg_size(cg));
 }
 
-// a hash function is used when mapping addresses to indexes in the block map
-static uint32_t wang_hash(uint32_t a) {
-  a = (a ^ 61) ^ (a >> 16);
-  a = a + (a << 3);
-  a = a ^ (a >> 4);
-  a = a * 0x27d4eb2d;
-  a = a ^ (a >> 15);
-  return a;
+// retire the instructions in a block so far from the cycle counter
+// note: this also writes back any modified guest registers
+// note: leaves the updated cycle count in rdx for gen_exit_link
+// note: only instructions not retired on the way to an earlier side exit are
+//       counted
+static void gen_cycles(struct block_t *block, struct riscv_t *rv) {
+  struct cg_state_t *cg = &block->cg;
+  regs_flush(block, rv);
+  const int32_t offset = rv_offset(rv, csr_cycle);
+  cg_mov_r64_r64disp(cg, cg_rdx, abi_rv, offset);
+  cg_add_r64_i32(cg, cg_rdx, block->instructions - rv->jit.retired);
+  cg_mov_r64disp_r64(cg, abi_rv, offset, cg_rdx);
+  rv->jit.retired = block->instructions;
 }
 
-// allocate a new code block
-static struct block_t *block_alloc(struct riscv_jit_t *jit) {
-  // place a new block
-  struct block_t *block = (struct block_t *)jit->head;
+// add an exit to a block for a statically known guest address
+static struct block_link_t *link_alloc(struct block_t *block,
+                                       uint32_t target) {
+  assert(block->num_links < RV_JIT_MAX_LINKS);
+  struct block_link_t *link = &block->links[block->num_links++];
+  link->block = block;
+  link->target = target;
+  link->patch = NULL;
+  link->unlinked = 0;
+  link->succ = NULL;
+  link->next = NULL;
+  link->guard = NULL;
+  return link;
+}
+
+// return to the dispatcher through an exit that is not linked yet
+// note: the dispatcher then links the exit to its successor
+static void gen_exit_stub(struct block_t *block, struct riscv_t *rv,
+                          struct block_link_t *link) {
   struct cg_state_t *cg = &block->cg;
-  // set the initial codegen write head
-  cg_init(cg, block->code, jit->end);
-  block->predict = NULL;
-  return block;
+  // set the PC and let the dispatcher know which exit we took
+  cg_mov_r64disp_i32(cg, abi_rv, rv_offset(rv, PC), link->target);
+  cg_lea_r64_rip(cg, cg_rax, link);
+  cg_mov_r64disp_r64(cg, abi_rv, rv_offset(rv, jit.exit_link), cg_rax);
+  cg_jmp_rel32(cg, rv->jit.exit);
 }
 
-// dump the code from a block
-static void block_dump(struct block_t *block, FILE *fd) {
-  fprintf(fd, "// %08x\n", block->pc_start);
-  const uint8_t *ptr = block->cg.start;
-  for (int i = 0; ptr + i < block->cg.head; ++i) {
-    fprintf(fd, (i && i % 16 == 0) ? "\n%02x " : "%02x ", (int)ptr[i]);
-  }
-  fprintf(fd, "\n");
+// leave the block for a statically known guest address
+//
+// while unlinked the exit returns to the dispatcher with the PC set.  once
+// the successor block is known the dispatcher will patch the jump so that
+// control flows directly into the successor, unless the cycle target has been
+// reached.
+static void gen_exit_link(struct block_t *block, struct riscv_t *rv,
+                          uint32_t target) {
+  struct cg_state_t *cg = &block->cg;
+  struct block_link_t *link = link_alloc(block, target);
+  // return to the dispatcher if we have reached the cycle target
+  cg_cmp_r64_r64disp(cg, cg_rdx, abi_rv, rv_offset(rv, jit.cycles_target));
+  struct cg_label_t skip;
+  cg_label_init(&skip);
+  cg_jcc_label_short(cg, cg_cc_ae, &skip);
+  // jump to the successor (falls through while unlinked)
+  link->patch = cg_jmp_rel32(cg, NULL);
+  cg_bind(cg, &skip);
+  gen_exit_stub(block, rv, link);
 }
 
-// finialize a code block and insert into the block map
-static void block_finish(struct riscv_jit_t *jit, struct block_t *block) {
-  assert(jit && block && jit->head && jit->block_map);
+// leave the block for an address computed at runtime
+// note: the PC must already have been set
+static void gen_exit_indirect(struct block_t *block, struct riscv_t *rv) {
   struct cg_state_t *cg = &block->cg;
-  // advance the block head ready for the next alloc
-  jit->head = block->code + cg_size(cg);
-  // insert into the block map
-  uint32_t index = wang_hash(block->pc_start);
-  const uint32_t mask = jit->block_map_size - 1;
-  for (;; ++index) {
-    if (jit->block_map[index & mask] == NULL) {
-      jit->block_map[index & mask] = block;
-      break;
-    }
+  // let the dispatcher know which block we left
+  cg_lea_r64_rip(cg, cg_rax, block);
+  cg_mov_r64disp_r64(cg, abi_rv, rv_offset(rv, jit.exit_block), cg_rax);
+  cg_jmp_rel32(cg, rv->jit.exit);
+}
+
+// allocate counters for translated code to update, or return NULL if there
+// is no room left for them
+static uint32_t *counters_alloc(struct riscv_jit_t *jit, uint32_t count) {
+  const size_t size = count * sizeof(uint32_t);
+  if ((size_t)(jit->counters_end - jit->counters_head) < size) {
+    return NULL;
   }
-#if RISCV_DUMP_JIT_TRACE
-  block_dump(block, stdout);
-#endif
-  // flush the instructon cache for this block
-  sys_flush_icache(block->code, cg_size(cg));
+  uint32_t *ptr = (uint32_t *)jit->counters_head;
+  jit->counters_head += size;
+  return ptr;
 }
 
-// try to locate an already translated block in the block map
-static struct block_t *block_find(struct riscv_jit_t *jit, uint32_t addr) {
-  assert(jit && jit->block_map);
-  uint32_t index = wang_hash(addr);
-  const uint32_t mask = jit->block_map_size - 1;
-  for (;; ++index) {
-    struct block_t *block = jit->block_map[index & mask];
-    if (block == NULL) {
-      return NULL;
-    }
-    if (block->pc_start == addr) {
-      return block;
+// count each entry into the block for rv_get_jit_profile
+// note: counters are only ever allocated in pairs so this one is 8 byte
+//       aligned
+static void gen_exec_count(struct block_t *block, struct riscv_t *rv) {
+  block->exec_count = (uint64_t *)counters_alloc(&rv->jit, 2);
+  if (block->exec_count) {
+    cg_inc_rip64(&block->cg, block->exec_count);
+  }
+}
+
+// leave the block for an address computed at runtime through an inline cache
+//
+// each entry compares the PC with a guest address and jumps straight to the
+// native code of that block.  entries start empty and are filled in by the
+// dispatcher when the cache misses.
+// note: the PC must already have been set
+static void gen_exit_ic(struct block_t *block, struct riscv_t *rv) {
+  struct cg_state_t *cg = &block->cg;
+  // return to the dispatcher if we have reached the cycle target
+  cg_cmp_r64_r64disp(cg, cg_rdx, abi_rv, rv_offset(rv, jit.cycles_target));
+  struct cg_label_t done;
+  cg_label_init(&done);
+  cg_jcc_label(cg, cg_cc_ae, &done);
+  cg_mov_r32_r64disp(cg, cg_eax, abi_rv, rv_offset(rv, PC));
+  block->ic_size = RV_JIT_IC_SIZE;
+  block->ic_count = counters_alloc(&rv->jit, 2);
+  for (uint32_t i = 0; i < block->ic_size; ++i) {
+    struct block_link_t *link = &block->ic[i];
+    link->block = block;
+    link->target = empty_target;
+    link->succ = NULL;
+    link->next = NULL;
+    link->unlinked = 0;
+    link->guard = cg_cmp_r32_imm32(cg, cg_eax, link->target);
+    struct cg_label_t skip;
+    cg_label_init(&skip);
+    cg_jcc_label_short(cg, cg_cc_ne, &skip);
+    if (block->ic_count) {
+      cg_inc_rip32(cg, &block->ic_count[0]);
     }
+    // jump to the successor (falls through to the next entry while unlinked)
+    link->patch = cg_jmp_rel32(cg, NULL);
+    cg_bind(cg, &skip);
+  }
+  if (block->ic_count) {
+    cg_inc_rip32(cg, &block->ic_count[1]);
   }
+  cg_bind(cg, &done);
+  gen_exit_indirect(block, rv);
 }
 
-static bool op_load(struct riscv_t *rv, uint32_t inst, struct block_t *block) {
+// return true if a guest register holds a return address by convention
+static bool is_link_reg(uint32_t reg) {
+  return reg == rv_reg_ra || reg == rv_reg_t0;
+}
 
+// push the address a call returns to onto the return address stack along with
+// the native code to carry on from.  the location of that code is not known
+// yet so the returned displacement is filled in by gen_ras_continue.
+static uint8_t *gen_ras_push(struct block_t *block, struct riscv_t *rv,
+                             uint32_t ret) {
   struct cg_state_t *cg = &block->cg;
+  const int32_t top = rv_offset(rv, jit.ras_top);
+  cg_mov_r32_r64disp(cg, cg_ecx, abi_rv, top);
+  cg_add_r32_i32(cg, cg_ecx, sizeof(struct jit_ras_entry_t));
+  cg_and_r32_i32(cg, cg_ecx, sizeof(rv->jit.ras) - 1);
+  cg_mov_r64disp_r32(cg, abi_rv, top, cg_ecx);
+  cg_add_r64_r64(cg, cg_rcx, abi_rv);
+  cg_mov_r64disp_i32(cg, cg_rcx, rv_offset(rv, jit.ras[0].pc), ret);
+  uint8_t *code = cg_lea_r64_rip(cg, cg_rax, cg->head);
+  cg_mov_r64disp_r64(cg, cg_rcx, rv_offset(rv, jit.ras[0].code), cg_rax);
+  return code;
+}
 
-  // itype format
-  const int32_t  imm    = dec_itype_imm(inst);
-  const uint32_t rs1    = dec_rs1(inst);
-  const uint32_t funct3 = dec_funct3(inst);
-  const uint32_t rd     = dec_rd(inst);
+// emit the code a return predicted by the return address stack jumps to,
+// which leaves the block for the address after the call
+// note: like any exit this expects the cycle count in rdx
+static void gen_ras_continue(struct block_t *block, struct riscv_t *rv,
+                             uint8_t *code, uint32_t ret) {
+  cg_patch_rel32(code, block->cg.head);
+  gen_exit_link(block, rv, ret);
+}
 
-  // skip writes to the zero register
-  if (rd == rv_reg_zero) {
-    // step over instruction
-    block->pc_end += 4;
-    block->instructions += 1;
-    return true;
+// pop the return address stack, leaving the offset of the entry in ecx
+static void gen_ras_drop(struct block_t *block, struct riscv_t *rv) {
+  struct cg_state_t *cg = &block->cg;
+  const int32_t top = rv_offset(rv, jit.ras_top);
+  cg_mov_r32_r64disp(cg, cg_ecx, abi_rv, top);
+  cg_mov_r32_r32(cg, cg_eax, cg_ecx);
+  cg_sub_r32_i32(cg, cg_eax, sizeof(struct jit_ras_entry_t));
+  cg_and_r32_i32(cg, cg_eax, sizeof(rv->jit.ras) - 1);
+  cg_mov_r64disp_r32(cg, abi_rv, top, cg_eax);
+}
+
+// pop the return address stack and jump to the code it holds if the entry was
+// pushed for the address being returned to
+// note: the PC must already have been set
+static void gen_ras_pop(struct block_t *block, struct riscv_t *rv) {
+  struct cg_state_t *cg = &block->cg;
+  block->ras_count = counters_alloc(&rv->jit, 2);
+  gen_ras_drop(block, rv);
+  cg_add_r64_r64(cg, cg_rcx, abi_rv);
+  cg_mov_r32_r64disp(cg, cg_eax, cg_rcx, rv_offset(rv, jit.ras[0].pc));
+  cg_cmp_r32_r64disp(cg, cg_eax, abi_rv, rv_offset(rv, PC));
+  struct cg_label_t miss;
+  cg_label_init(&miss);
+  cg_jcc_label_short(cg, cg_cc_ne, &miss);
+  if (block->ras_count) {
+    cg_inc_rip32(cg, &block->ras_count[0]);
+  }
+  cg_jmp_r64disp(cg, cg_rcx, rv_offset(rv, jit.ras[0].code));
+  cg_bind(cg, &miss);
+  if (block->ras_count) {
+    cg_inc_rip32(cg, &block->ras_count[1]);
   }
+}
 
-  // arg1 - rv
-  cg_mov_r64_r64(cg, cg_rcx, cg_rsi);
-  // arg2 - address
-  get_reg(block, rv, cg_edx, rs1);
-  cg_add_r32_i32(cg, cg_edx, imm);
+// forget all return addresses so that no return jumps into stale code
+static void ras_clear(struct riscv_jit_t *jit) {
+  for (uint32_t i = 0; i < RV_JIT_RAS_SIZE; ++i) {
+    jit->ras[i].pc = empty_target;
+    jit->ras[i].code = NULL;
+  }
+}
 
-  int32_t offset;
+// end the block before the current instruction so that it gets emulated
+static void gen_fallback(struct block_t *block, struct riscv_t *rv) {
+  gen_cycles(block, rv);
+  gen_exit_link(block, rv, block->pc_end);
+}
 
-  // dispatch by read size
-  switch (funct3) {
-  case 0: // LB
-    offset = rv_offset(rv, io.mem_read_b);
-    cg_call_r64disp(cg, cg_rsi, offset);
-    cg_movsx_r32_r8(cg, cg_eax, cg_al);
-    break;
-  case 1: // LH
-    offset = rv_offset(rv, io.mem_read_s);
-    cg_call_r64disp(cg, cg_rsi, offset);
-    cg_movsx_r32_r16(cg, cg_eax, cg_ax);
-    break;
-  case 2: // LW
-    offset = rv_offset(rv, io.mem_read_w);
-    cg_call_r64disp(cg, cg_rsi, offset);
-    break;
-  case 4: // LBU
-    offset = rv_offset(rv, io.mem_read_b);
-    cg_call_r64disp(cg, cg_rsi, offset);
-    break;
-  case 5: // LHU
-    offset = rv_offset(rv, io.mem_read_s);
-    cg_call_r64disp(cg, cg_rsi, offset);
-    break;
-  default:
-    assert(!"unreachable");
-    break;
+// jump back to the start of a looping block unless the cycle target has been
+// reached, with the guest registers the loop keeps in host registers put back
+// where it expects them
+//
+// the jump is an exit chained to the block itself, so that it returns to the
+// dispatcher instead once the block is invalidated, i.e. when the loop writes
+// to its own code.
+// note: gen_cycles must have written back all registers first
+static void gen_loop_back(struct block_t *block, struct riscv_t *rv) {
+  struct cg_state_t *cg = &block->cg;
+  struct riscv_jit_t *jit = &rv->jit;
+  const struct jit_regs_t *regs = &jit->regs;
+  for (uint32_t i = 0; i < regs->pool_size; ++i) {
+    const int host = regs->pool[i];
+    const int guest = jit->loop_regs[host];
+    if (guest >= 0 && regs->guest[host] != guest) {
+      regs_load(block, rv, regs, host, guest);
+    }
+  }
+  struct block_link_t *link = link_alloc(block, block->pc_start);
+  cg_cmp_r64_r64disp(cg, cg_rdx, abi_rv, rv_offset(rv, jit.cycles_target));
+  link->patch = cg_jcc_rel32(cg, cg_cc_c, NULL);
+  cg_patch_rel32(link->patch, cg->head);
+  memcpy(&link->unlinked, link->patch, sizeof(link->unlinked));
+  gen_exit_stub(block, rv, link);
+  cg_patch_rel32(link->patch, jit->loop_head);
+  link->succ = block;
+  link->next = block->incoming;
+  block->incoming = link;
+}
+
+// return true if the trace can take a side exit and carry on decoding
+static bool trace_can_continue(const struct riscv_jit_t *jit) {
+  // keep two links spare for the instruction that finally ends the block
+  return jit->ir_count < trace_max_instructions &&
+         jit->ir_links + 3 <= RV_JIT_MAX_LINKS;
+}
+
+// return true if the trace can carry on decoding at a jump target
+// note: 'end' is the address the current run of instructions has reached
+static bool trace_can_follow(const struct riscv_jit_t *jit, uint32_t end,
+                             uint32_t target) {
+  if (!trace_can_continue(jit) || jit->num_runs >= RV_JIT_MAX_RUNS) {
+    return false;
+  }
+  // the block must stay within one code page
+  if ((target >> RV_JIT_CODE_PAGE_BITS) !=
+      (jit->ir[0].pc >> RV_JIT_CODE_PAGE_BITS)) {
+    return false;
+  }
+  // dont translate the same code twice, which also stops us unrolling loops
+  if (target >= jit->run_start && target < end) {
+    return false;
+  }
+  for (uint32_t i = 0; i < jit->num_runs; ++i) {
+    if (target >= jit->runs[i].start && target < jit->runs[i].end) {
+      return false;
+    }
   }
-  // rv->X[rd] = rax
-  set_reg(block, rv, rd, cg_eax);
-  // step over instruction
-  block->pc_end += 4;
-  block->instructions += 1;
-  // cant branch
   return true;
 }
 
-static bool op_op_imm(struct riscv_t *rv,
-                      uint32_t inst,
-                      struct block_t *block) {
+// carry on decoding the trace at a jump target
+static void trace_follow(struct riscv_jit_t *jit, uint32_t end,
+                         uint32_t target) {
+  jit->runs[jit->num_runs].start = jit->run_start;
+  jit->runs[jit->num_runs].end = end;
+  jit->num_runs += 1;
+  jit->run_start = target;
+}
 
-  struct cg_state_t *cg = &block->cg;
+// return the block directory slot index of a guest address within its page
+static uint32_t block_dir_slot(uint32_t addr) {
+  return (addr & ((1u << RV_JIT_DIR_PAGE_BITS) - 1)) >> 2;
+}
 
-  // i-type decode
-  const int32_t  imm    = dec_itype_imm(inst);
-  const uint32_t rd     = dec_rd(inst);
-  const uint32_t rs1    = dec_rs1(inst);
-  const uint32_t funct3 = dec_funct3(inst);
+// return the block directory page covering a guest address, allocating it if
+// it does not exist yet, or NULL if it can't be allocated
+static struct block_page_t *block_dir_page(struct riscv_jit_t *jit,
+                                           uint32_t addr) {
+  struct block_page_t **page = &jit->block_dir[addr >> RV_JIT_DIR_PAGE_BITS];
+  if (*page == NULL) {
+    *page = calloc(1, sizeof(struct block_page_t));
+  }
+  return *page;
+}
 
-  // skip any writes to the zero register
-  if (rd == rv_reg_zero) {
-    // step over instruction
-    block->pc_end += 4;
-    block->instructions += 1;
+// count an interpreted run of the block at a guest address and return true
+// once it has run often enough to be worth translating
+// note: counts are kept through flushes so hot blocks are retranslated at once
+static bool block_dir_count(struct riscv_jit_t *jit, uint32_t addr) {
+  if (jit->threshold == 0) {
+    return true;
+  }
+  struct block_page_t *page = block_dir_page(jit, addr);
+  // without a page for the block it could never be found once translated
+  if (page == NULL) {
+    return false;
+  }
+  uint16_t *count = &page->count[block_dir_slot(addr)];
+  if (*count + 1u >= jit->threshold) {
     return true;
   }
+  *count += 1;
+  return false;
+}
 
-  // eax = rv->X[rs1]
-  get_reg(block, rv, cg_eax, rs1);
+// return true if a block at this guest address was discarded by a flush
+static bool block_dir_retired(struct riscv_jit_t *jit, uint32_t addr) {
+  const struct block_page_t *page =
+    jit->block_dir[addr >> RV_JIT_DIR_PAGE_BITS];
+  const uint32_t slot = block_dir_slot(addr);
+  return page && (page->retired[slot / 32] & (1u << (slot % 32)));
+}
+
+// number of translation requests that can wait for the background translator
+#define RV_JIT_QUEUE_SIZE 16
+
+// a request for the background translator to translate one block
+struct jit_job_t {
+  // guest address of the block
+  uint32_t pc;
+  // set if the block was queued before the guest reached it
+  bool speculative;
+  // set by the guest thread if the blocks code page was written while queued
+  bool stale;
+  // set by the worker to the translated block, or NULL if the code buffer was
+  // too full to hold it
+  struct block_t *block;
+};
+
+// background translator state
+//
+// the guest thread is the only producer and the worker the only consumer so
+// the queue is a ring where each index is written by one side only.  the lock
+// is used just to sleep and wake the two sides.  the worker places blocks
+// past the code buffer head but only the guest thread installs them, so the
+// block directory, links and code page tracking stay with the guest thread.
+struct jit_worker_t {
+  struct riscv_t *rv;
+#ifdef _WIN32
+  HANDLE thread;
+  CRITICAL_SECTION lock;
+  CONDITION_VARIABLE wake;
+#endif
+#ifdef __linux__
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+#endif
+  // number of jobs queued by the guest thread
+  volatile uint32_t queued;
+  // number of jobs finished by the worker
+  volatile uint32_t done;
+  // number of finished jobs taken back by the guest thread
+  uint32_t installed;
+  // where the worker will place its next block and its code
+  struct block_t *blocks_head;
+  uint8_t *head;
+  // set under the lock to ask the worker to exit
+  bool quit;
+  struct jit_job_t jobs[RV_JIT_QUEUE_SIZE];
+};
+
+static void worker_lock(struct jit_worker_t *w) {
+#ifdef _WIN32
+  EnterCriticalSection(&w->lock);
+#endif
+#ifdef __linux__
+  pthread_mutex_lock(&w->lock);
+#endif
+}
+
+static void worker_unlock(struct jit_worker_t *w) {
+#ifdef _WIN32
+  LeaveCriticalSection(&w->lock);
+#endif
+#ifdef __linux__
+  pthread_mutex_unlock(&w->lock);
+#endif
+}
+
+// sleep until the other side signals, the lock must be held
+static void worker_wait(struct jit_worker_t *w) {
+#ifdef _WIN32
+  SleepConditionVariableCS(&w->wake, &w->lock, INFINITE);
+#endif
+#ifdef __linux__
+  pthread_cond_wait(&w->wake, &w->lock);
+#endif
+}
+
+// wake the other side, the lock must be held
+static void worker_signal(struct jit_worker_t *w) {
+#ifdef _WIN32
+  WakeAllConditionVariable(&w->wake);
+#endif
+#ifdef __linux__
+  pthread_cond_broadcast(&w->wake);
+#endif
+}
+
+// wait for the background translator to finish its queue and throw away the
+// results
+static void worker_drain(struct riscv_jit_t *jit) {
+  struct jit_worker_t *w = jit->worker;
+  if (!w) {
+    return;
+  }
+  worker_lock(w);
+  while (sys_load_acquire(&w->done) != w->queued) {
+    worker_wait(w);
+  }
+  worker_unlock(w);
+  w->installed = w->queued;
+  // claim the discarded blocks so that a flush clears them
+  jit->blocks_head = w->blocks_head;
+  jit->head = w->head;
+}
+
+// mark queued translations of a code page as stale as they may have read the
+// code before it was written
+static void worker_invalidate(struct riscv_jit_t *jit, uint32_t page) {
+  struct jit_worker_t *w = jit->worker;
+  if (!w) {
+    return;
+  }
+  for (uint32_t i = w->installed; i != w->queued; ++i) {
+    struct jit_job_t *job = &w->jobs[i % RV_JIT_QUEUE_SIZE];
+    if ((job->pc >> RV_JIT_CODE_PAGE_BITS) == page) {
+      job->stale = true;
+    }
+  }
+}
+
+static int profile_cmp_pc(const void *a, const void *b) {
+  const struct riscv_jit_profile_t *x = a, *y = b;
+  return (x->pc_start > y->pc_start) - (x->pc_start < y->pc_start);
+}
+
+// order by guest instructions run, most first, then by address
+static int profile_cmp_weight(const void *a, const void *b) {
+  const struct riscv_jit_profile_t *x = a, *y = b;
+  const uint64_t wx = x->executions * x->instructions;
+  const uint64_t wy = y->executions * y->instructions;
+  if (wx != wy) {
+    return wx < wy ? 1 : -1;
+  }
+  return profile_cmp_pc(a, b);
+}
+
+// merge the entries of a list sorted by address that share a start address,
+// describing the block by the translation of it that ran most.  returns the
+// new length of the list.
+static uint32_t profile_merge(struct riscv_jit_profile_t *list,
+                              uint32_t count) {
+  uint32_t n = 0;
+  for (uint32_t i = 0; i < count; ++i) {
+    struct riscv_jit_profile_t *prev = n ? &list[n - 1] : NULL;
+    const struct riscv_jit_profile_t *entry = &list[i];
+    if (!prev || prev->pc_start != entry->pc_start) {
+      list[n++] = *entry;
+      continue;
+    }
+    const uint64_t executions = prev->executions + entry->executions;
+    const uint64_t fallbacks = prev->fallbacks + entry->fallbacks;
+    if (entry->executions > prev->executions) {
+      *prev = *entry;
+    }
+    prev->executions = executions;
+    prev->fallbacks = fallbacks;
+  }
+  return n;
+}
+
+// gather the profile of the blocks in the code cache along with those saved
+// from before flushes, sorted by address.  the caller frees the list.
+static struct riscv_jit_profile_t *profile_collect(struct riscv_jit_t *jit,
+                                                   uint32_t *count) {
+  const uint32_t max =
+      jit->profile_saved_count + (uint32_t)(jit->blocks_head - jit->blocks);
+  struct riscv_jit_profile_t *list =
+      malloc((max ? max : 1) * sizeof(struct riscv_jit_profile_t));
+  if (!list) {
+    *count = 0;
+    return NULL;
+  }
+  uint32_t n = jit->profile_saved_count;
+  if (n) {
+    memcpy(list, jit->profile_saved, n * sizeof(struct riscv_jit_profile_t));
+  }
+  for (struct block_t *block = jit->blocks; block < jit->blocks_head;
+       ++block) {
+    const uint64_t executions = block->exec_count ? *block->exec_count : 0;
+    if (!executions && !block->fallbacks) {
+      continue;
+    }
+    struct riscv_jit_profile_t *entry = &list[n++];
+    entry->pc_start = block->pc_start;
+    entry->pc_end = block->pc_end;
+    entry->instructions = block->instructions;
+    entry->code_size = cg_size(&block->cg);
+    entry->executions = executions;
+    entry->fallbacks = block->fallbacks;
+  }
+  qsort(list, n, sizeof(struct riscv_jit_profile_t), profile_cmp_pc);
+  *count = profile_merge(list, n);
+  return list;
+}
+
+// keep the profile of the blocks about to be flushed
+static void profile_save(struct riscv_jit_t *jit) {
+  uint32_t count = 0;
+  struct riscv_jit_profile_t *list = profile_collect(jit, &count);
+  if (!list) {
+    return;
+  }
+  free(jit->profile_saved);
+  jit->profile_saved = list;
+  jit->profile_saved_count = count;
+}
+
+// discard all translated blocks
+//
+// chains and predictions only ever point at other blocks in the code buffer
+// so they are discarded along with the blocks themselves.  the epoch is
+// bumped so that the dispatcher drops any block pointers it is holding.
+static void code_cache_flush(struct riscv_jit_t *jit) {
+  // the worker may be writing into the code buffer
+  worker_drain(jit);
+  for (uint32_t i = 0; i < RV_JIT_DIR_PAGES; ++i) {
+    struct block_page_t *page = jit->block_dir[i];
+    if (!page) {
+      continue;
+    }
+    // remember which blocks we had so that retranslations can be counted
+    for (uint32_t j = 0; j < RV_JIT_DIR_SLOTS; ++j) {
+      if (page->slot[j]) {
+        page->retired[j / 32] |= 1u << (j % 32);
+      }
+    }
+    memset(page->slot, 0, sizeof(page->slot));
+  }
+  // no pages hold translated code now.  their store map entries will be
+  // filled in again by the next store to each of them.
+  memset(jit->code_pages, 0, RV_JIT_CODE_PAGES / 8);
+  // keep the counts of the blocks before their counters are cleared
+  if (jit->profile) {
+    profile_save(jit);
+  }
+  // fill with int3 so any stale jump into the buffer traps
+  memset(jit->block_start, 0xcc, jit->head - jit->block_start);
+  jit->head = jit->block_start;
+  jit->blocks_head = jit->blocks;
+  jit->max_instructions = 0;
+  memset(jit->counters, 0, jit->counters_head - jit->counters);
+  jit->counters_head = jit->counters;
+  if (jit->worker) {
+    jit->worker->blocks_head = jit->blocks_head;
+    jit->worker->head = jit->head;
+  }
+  jit->exit_link = NULL;
+  jit->exit_block = NULL;
+  ras_clear(jit);
+  jit->epoch += 1;
+  jit->stats.flushes += 1;
+}
+
+// place a new block with its code at 'code', or return NULL if the blocks or
+// the code buffer are full
+static struct block_t *block_place(struct riscv_jit_t *jit,
+                                   struct block_t *block, uint8_t *code) {
+  const size_t space = jit->end - code;
+  if (block == jit->blocks_end || space < code_headroom * 4) {
+    return NULL;
+  }
+  struct cg_state_t *cg = &block->cg;
+  // set the initial codegen write head
+  block->code = code;
+  cg_init(cg, block->code, jit->end);
+  block->predict = NULL;
+  block->num_links = 0;
+  block->incoming = NULL;
+  block->ic_size = 0;
+  block->ic_next = 0;
+  block->ic_count = NULL;
+  block->ras_count = NULL;
+  block->exec_count = NULL;
+  block->fallbacks = 0;
+  return block;
+}
+
+// allocate a new code block
+static struct block_t *block_alloc(struct riscv_jit_t *jit) {
+  struct block_t *block = block_place(jit, jit->blocks_head, jit->head);
+  if (!block) {
+    // make room if the code buffer is full
+    code_cache_flush(jit);
+    block = block_place(jit, jit->blocks_head, jit->head);
+  }
+  return block;
+}
+
+// dump the code from a block
+static void block_dump(struct block_t *block, FILE *fd) {
+  fprintf(fd, "// %08x\n", block->pc_start);
+  const uint8_t *ptr = block->cg.start;
+  for (int i = 0; ptr + i < block->cg.head; ++i) {
+    fprintf(fd, (i && i % 16 == 0) ? "\n%02x " : "%02x ", (int)ptr[i]);
+  }
+  fprintf(fd, "\n");
+}
+
+// send stores to the code page holding a guest address down the slow path so
+// that writes to translated code are noticed
+static void code_page_mark(struct riscv_jit_t *jit, uint32_t addr) {
+  const uint32_t code_page = addr >> RV_JIT_CODE_PAGE_BITS;
+  jit->code_pages[code_page / 32] |= 1u << (code_page % 32);
+  jit->store_map[code_page] = NULL;
+}
+
+// perf profiler support
+//
+// perf names code with no symbols of its own using /tmp/perf-<pid>.map, a
+// text file with a 'start size name' line for each region.  the jitdump
+// format also carries a copy of the code and timestamps, so that code placed
+// where flushed code used to be is told apart.  perf notices the dump file
+// when it is mapped executable and 'perf inject --jit' merges it into the
+// recording.  see tools/perf/Documentation/jitdump-specification.txt in the
+// linux source.
+struct jit_perf_t {
+  struct riscv_t *rv;
+  riscv_jit_symbolize symbolize;
+  FILE *map;
+  FILE *dump;
+  // the mapping of the dump file that perf looks for
+  void *marker;
+  size_t marker_size;
+  // incremented for each region written to the dump
+  uint64_t code_index;
+};
+
+#ifdef __linux__
+enum {
+  jitdump_magic     = 0x4a695444,
+  jitdump_version   = 1,
+  jitdump_code_load = 0,
+  // EM_X86_64
+  jitdump_elf_mach  = 62,
+};
+
+struct jitdump_header_t {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t total_size;
+  uint32_t elf_mach;
+  uint32_t pad1;
+  uint32_t pid;
+  uint64_t timestamp;
+  uint64_t flags;
+};
+
+// a JIT_CODE_LOAD record, which is followed by the name and then the code
+struct jitdump_code_load_t {
+  uint32_t id;
+  uint32_t total_size;
+  uint64_t timestamp;
+  uint32_t pid;
+  uint32_t tid;
+  uint64_t vma;
+  uint64_t code_addr;
+  uint64_t code_size;
+  uint64_t code_index;
+};
+
+// timestamps must come from the clock 'perf record -k mono' uses
+static uint64_t perf_timestamp(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+#endif
+
+// describe a region of translated code to perf
+static void perf_code(struct jit_perf_t *perf, const uint8_t *code,
+                      size_t size, const char *name) {
+  if (perf->map) {
+    fprintf(perf->map, "%llx %llx %s\n", (unsigned long long)(uintptr_t)code,
+            (unsigned long long)size, name);
+  }
+#ifdef __linux__
+  if (perf->dump) {
+    const size_t name_size = strlen(name) + 1;
+    struct jitdump_code_load_t rec;
+    rec.id = jitdump_code_load;
+    rec.total_size = (uint32_t)(sizeof(rec) + name_size + size);
+    rec.timestamp = perf_timestamp();
+    rec.pid = (uint32_t)getpid();
+    rec.tid = (uint32_t)syscall(SYS_gettid);
+    rec.vma = (uintptr_t)code;
+    rec.code_addr = (uintptr_t)code;
+    rec.code_size = size;
+    rec.code_index = perf->code_index++;
+    fwrite(&rec, sizeof(rec), 1, perf->dump);
+    fwrite(name, name_size, 1, perf->dump);
+    fwrite(code, size, 1, perf->dump);
+  }
+#endif
+}
+
+// describe a block to perf, naming it after the guest code it came from
+static void perf_block(struct jit_perf_t *perf, struct block_t *block) {
+  const uint32_t pc = block->pc_start;
+  riscv_word_t base = pc;
+  const char *sym =
+    perf->symbolize ? perf->symbolize(perf->rv, pc, &base) : NULL;
+  char name[256];
+  if (sym) {
+    snprintf(name, sizeof(name), "rv:%s+0x%x", sym, pc - base);
+  }
+  else {
+    snprintf(name, sizeof(name), "rv:%08x", pc);
+  }
+  perf_code(perf, block->code, cg_size(&block->cg), name);
+}
+
+#ifdef __linux__
+// create the jitdump file and map it so that perf records where it is
+static bool perf_dump_open(struct jit_perf_t *perf) {
+  char path[64];
+  snprintf(path, sizeof(path), "/tmp/jit-%d.dump", (int)getpid());
+  perf->dump = fopen(path, "w+");
+  if (!perf->dump) {
+    return false;
+  }
+  perf->marker_size = (size_t)sysconf(_SC_PAGESIZE);
+  perf->marker = mmap(NULL, perf->marker_size, PROT_READ | PROT_EXEC,
+                      MAP_PRIVATE, fileno(perf->dump), 0);
+  if (perf->marker == MAP_FAILED) {
+    perf->marker = NULL;
+    return false;
+  }
+  struct jitdump_header_t header;
+  memset(&header, 0, sizeof(header));
+  header.magic = jitdump_magic;
+  header.version = jitdump_version;
+  header.total_size = sizeof(header);
+  header.elf_mach = jitdump_elf_mach;
+  header.pid = (uint32_t)getpid();
+  header.timestamp = perf_timestamp();
+  return fwrite(&header, sizeof(header), 1, perf->dump) == 1;
+}
+#endif
+
+// close the perf files and stop describing blocks
+static void perf_close(struct riscv_jit_t *jit) {
+  struct jit_perf_t *perf = jit->perf;
+  if (!perf) {
+    return;
+  }
+  if (perf->map) {
+    fclose(perf->map);
+  }
+#ifdef __linux__
+  if (perf->marker) {
+    munmap(perf->marker, perf->marker_size);
+  }
+#endif
+  if (perf->dump) {
+    fclose(perf->dump);
+  }
+  free(perf);
+  jit->perf = NULL;
+}
+
+// finialize a code block and insert into the block directory, returning false
+// if there is no room in the directory.  the code is then left unused until the
+// next flush.
+static bool block_finish(struct riscv_jit_t *jit, struct block_t *block) {
+  assert(jit && block && jit->head && jit->block_dir);
+  struct cg_state_t *cg = &block->cg;
+  // advance the block head ready for the next alloc
+  jit->blocks_head = block + 1;
+  jit->head = block->code + cg_size(cg);
+  assert(jit->head <= jit->end);
+  // insert into the block directory
+  struct block_page_t *page = block_dir_page(jit, block->pc_start);
+  if (page == NULL) {
+    return false;
+  }
+  if (block->instructions > jit->max_instructions) {
+    jit->max_instructions = block->instructions;
+  }
+  page->slot[block_dir_slot(block->pc_start)] = block;
+  // note: blocks never cross a code page boundary
+  code_page_mark(jit, block->pc_start);
+  if (jit->perf) {
+    perf_block(jit->perf, block);
+  }
+#if RISCV_DUMP_JIT_TRACE
+  block_dump(block, stdout);
+#endif
+  // flush the instructon cache for this block
+  sys_flush_icache(block->code, cg_size(cg));
+  return true;
+}
+
+// try to locate an already translated block in the block directory
+static struct block_t *block_find(struct riscv_jit_t *jit, uint32_t addr) {
+  assert(jit && jit->block_dir);
+  const struct block_page_t *page =
+    jit->block_dir[addr >> RV_JIT_DIR_PAGE_BITS];
+  if (page == NULL) {
+    return NULL;
+  }
+  struct block_t *block = page->slot[block_dir_slot(addr)];
+  // note: a misaligned address shares a slot with the word it lies in
+  return (block && block->pc_start == addr) ? block : NULL;
+}
+
+// chain a block exit directly to its successor
+static void block_link(struct block_link_t *link, struct block_t *succ) {
+  assert(link && succ && link->target == succ->pc_start);
+  if (link->succ) {
+    // already chained
+    return;
+  }
+  cg_patch_rel32(link->patch, succ->code);
+  sys_flush_icache(link->patch, 4);
+  link->succ = succ;
+  // add to the successors incoming list so we can unlink it later
+  link->next = succ->incoming;
+  succ->incoming = link;
+}
+
+// restore a chained exit so that it leads back to the dispatcher
+static void link_restore(struct block_link_t *link) {
+  memcpy(link->patch, &link->unlinked, sizeof(link->unlinked));
+  sys_flush_icache(link->patch, 4);
+  link->succ = NULL;
+  // an empty inline cache entry must not match any target
+  if (link->guard) {
+    link->target = empty_target;
+    memcpy(link->guard, &link->target, sizeof(link->target));
+    sys_flush_icache(link->guard, 4);
+  }
+}
+
+// unchain an exit from its successor
+static void link_remove(struct block_link_t *link) {
+  if (!link->succ) {
+    return;
+  }
+  struct block_link_t **prev = &link->succ->incoming;
+  for (; *prev; prev = &(*prev)->next) {
+    if (*prev == link) {
+      *prev = link->next;
+      break;
+    }
+  }
+  link_restore(link);
+}
+
+// remove all of the chains into and out of a block
+static void block_unlink(struct block_t *block) {
+  // restore any exits from other blocks that jump into this one
+  for (struct block_link_t *link = block->incoming; link; link = link->next) {
+    link_restore(link);
+  }
+  block->incoming = NULL;
+  // remove our exits from the incoming lists of our successors
+  for (uint32_t i = 0; i < block->num_links; ++i) {
+    link_remove(&block->links[i]);
+  }
+  for (uint32_t i = 0; i < block->ic_size; ++i) {
+    link_remove(&block->ic[i]);
+  }
+}
+
+// add a successor to the inline cache of a block, replacing the entries in
+// turn once they are all in use
+static void block_ic_fill(struct block_t *block, struct block_t *succ) {
+  struct block_link_t *link = NULL;
+  for (uint32_t i = 0; i < block->ic_size; ++i) {
+    if (block->ic[i].succ == succ) {
+      // already cached, we must have left for the cycle target
+      return;
+    }
+    if (!link && !block->ic[i].succ) {
+      link = &block->ic[i];
+    }
+  }
+  if (!link) {
+    link = &block->ic[block->ic_next];
+    block->ic_next = (block->ic_next + 1) % block->ic_size;
+    link_remove(link);
+  }
+  link->target = succ->pc_start;
+  memcpy(link->guard, &link->target, sizeof(link->target));
+  sys_flush_icache(link->guard, 4);
+  block_link(link, succ);
+}
+
+// return true if a guest code page holds translated code
+static bool code_page_test(const struct riscv_jit_t *jit, uint32_t page) {
+  return (jit->code_pages[page / 32] & (1u << (page % 32))) != 0;
+}
+
+// discard all of the blocks in a guest code page
+//
+// the blocks are unlinked and removed from the block directory so nothing
+// can reach them again.  their code is left in place as the guest may be
+// executing it right now, which is allowed as RISC-V only requires a store to
+// be visible to instruction fetch after a FENCE.I.
+static void code_page_invalidate(struct riscv_jit_t *jit, uint32_t page) {
+  jit->code_pages[page / 32] &= ~(1u << (page % 32));
+  worker_invalidate(jit, page);
+  struct block_page_t *dir =
+    jit->block_dir[page >> (RV_JIT_DIR_PAGE_BITS - RV_JIT_CODE_PAGE_BITS)];
+  if (!dir) {
+    return;
+  }
+  const uint32_t first = block_dir_slot(page << RV_JIT_CODE_PAGE_BITS);
+  const uint32_t count = 1u << (RV_JIT_CODE_PAGE_BITS - 2);
+  for (uint32_t i = first; i < first + count; ++i) {
+    struct block_t *block = dir->slot[i];
+    if (!block) {
+      continue;
+    }
+    block_unlink(block);
+    // no guest PC can match this so any stale prediction will be ignored
+    block->pc_start = ~0u;
+    dir->slot[i] = NULL;
+    dir->retired[i / 32] |= 1u << (i % 32);
+    jit->stats.invalidations += 1;
+  }
+}
+
+// called after every guest store to check if it wrote to translated code
+// note: this is only reached by stores that miss the store map
+static void jit_store_check(struct riscv_t *rv, uint32_t addr, uint32_t size) {
+  struct riscv_jit_t *jit = &rv->jit;
+  const uint32_t last = (addr + size - 1) >> RV_JIT_CODE_PAGE_BITS;
+  for (uint32_t page = addr >> RV_JIT_CODE_PAGE_BITS;;
+       page = (page + 1) % RV_JIT_CODE_PAGES) {
+    if (code_page_test(jit, page)) {
+      code_page_invalidate(jit, page);
+    }
+    else if (rv->mem_map) {
+      // let future stores to this page go direct
+      const uint32_t shift = RV_MEM_CHUNK_BITS - RV_JIT_CODE_PAGE_BITS;
+      uint8_t *chunk = rv->mem_map[page >> shift];
+      const uint32_t offset =
+        (page & ((1u << shift) - 1)) << RV_JIT_CODE_PAGE_BITS;
+      jit->store_map[page] = chunk ? chunk + offset : NULL;
+    }
+    if (page == last) {
+      break;
+    }
+  }
+}
+
+// wrappers for the users memory write handlers that watch for stores into
+// translated code
+static void jit_mem_write_w(struct riscv_t *rv, riscv_word_t addr,
+                            riscv_word_t data) {
+  rv->jit.mem_write_w(rv, addr, data);
+  jit_store_check(rv, addr, sizeof(data));
+}
+
+static void jit_mem_write_s(struct riscv_t *rv, riscv_word_t addr,
+                            riscv_half_t data) {
+  rv->jit.mem_write_s(rv, addr, data);
+  jit_store_check(rv, addr, sizeof(data));
+}
+
+static void jit_mem_write_b(struct riscv_t *rv, riscv_word_t addr,
+                            riscv_byte_t data) {
+  rv->jit.mem_write_b(rv, addr, data);
+  jit_store_check(rv, addr, sizeof(data));
+}
+
+// emit a guest memory load of the width given by funct3 from rs1 + imm
+// note: leaves the loaded value extended to 32 bits in eax
+static void gen_load(struct block_t *block, struct riscv_t *rv,
+                     uint32_t funct3, uint32_t rs1, int32_t imm) {
+
+  struct cg_state_t *cg = &block->cg;
+
+  // arg2 - address
+  get_reg(block, rv, abi_arg2, rs1);
+  cg_add_r32_i32(cg, abi_arg2, imm);
+
+  // access memory directly if we can
+  struct cg_label_t miss, done;
+  cg_label_init(&miss);
+  cg_label_init(&done);
+  if (rv->mem_map) {
+    gen_mem_lookup(block, abi_arg2, 1u << (funct3 & 3),
+                   rv_offset(rv, mem_map), RV_MEM_CHUNK_BITS, &miss);
+    switch (funct3) {
+    case 0: // LB
+      cg_movsx_r32_r64idx8(cg, cg_eax, cg_rcx, cg_rax, 1);
+      break;
+    case 1: // LH
+      cg_movsx_r32_r64idx16(cg, cg_eax, cg_rcx, cg_rax, 1);
+      break;
+    case 2: // LW
+      cg_mov_r32_r64idx(cg, cg_eax, cg_rcx, cg_rax, 1);
+      break;
+    case 4: // LBU
+      cg_movzx_r32_r64idx8(cg, cg_eax, cg_rcx, cg_rax, 1);
+      break;
+    case 5: // LHU
+      cg_movzx_r32_r64idx16(cg, cg_eax, cg_rcx, cg_rax, 1);
+      break;
+    default:
+      assert(!"unreachable");
+      break;
+    }
+    cg_jmp_label(cg, &done);
+    cg_bind(cg, &miss);
+  }
+
+  // arg1 - rv
+  cg_mov_r64_r64(cg, abi_arg1, abi_rv);
+  // the memory handlers may clobber any volatile registers
+  regs_save_volatile(block, rv);
+
+  int32_t offset;
+
+  // dispatch by read size
+  switch (funct3) {
+  case 0: // LB
+    offset = rv_offset(rv, io.mem_read_b);
+    cg_call_r64disp(cg, abi_rv, offset);
+    cg_movsx_r32_r8(cg, cg_eax, cg_al);
+    break;
+  case 1: // LH
+    offset = rv_offset(rv, io.mem_read_s);
+    cg_call_r64disp(cg, abi_rv, offset);
+    cg_movsx_r32_r16(cg, cg_eax, cg_ax);
+    break;
+  case 2: // LW
+    offset = rv_offset(rv, io.mem_read_w);
+    cg_call_r64disp(cg, abi_rv, offset);
+    break;
+  case 4: // LBU
+    offset = rv_offset(rv, io.mem_read_b);
+    cg_call_r64disp(cg, abi_rv, offset);
+    cg_movzx_r32_r8(cg, cg_eax, cg_al);
+    break;
+  case 5: // LHU
+    offset = rv_offset(rv, io.mem_read_s);
+    cg_call_r64disp(cg, abi_rv, offset);
+    cg_movzx_r32_r16(cg, cg_eax, cg_ax);
+    break;
+  default:
+    assert(!"unreachable");
+    break;
+  }
+  regs_restore_volatile(block, rv);
+  cg_bind(cg, &done);
+}
+
+static bool op_load(struct riscv_t *rv, uint32_t inst, struct block_t *block) {
+
+  // itype format
+  const int32_t  imm    = dec_itype_imm(inst);
+  const uint32_t rs1    = dec_rs1(inst);
+  const uint32_t funct3 = dec_funct3(inst);
+  const uint32_t rd     = dec_rd(inst);
+
+  // skip writes to the zero register
+  if (rd == rv_reg_zero) {
+    // step over instruction
+    block->pc_end += 4;
+    block->instructions += 1;
+    return true;
+  }
+
+  // eax = load(rv->X[rs1] + imm)
+  gen_load(block, rv, funct3, rs1, imm);
+  // rv->X[rd] = rax
+  set_reg(block, rv, rd, cg_eax);
+  // step over instruction
+  block->pc_end += 4;
+  block->instructions += 1;
+  // cant branch
+  return true;
+}
+
+static bool op_op_imm(struct riscv_t *rv,
+                      uint32_t inst,
+                      struct block_t *block) {
+
+  struct cg_state_t *cg = &block->cg;
+
+  // i-type decode
+  const int32_t  imm    = dec_itype_imm(inst);
+  const uint32_t rd     = dec_rd(inst);
+  const uint32_t rs1    = dec_rs1(inst);
+  const uint32_t funct3 = dec_funct3(inst);
+
+  // skip any writes to the zero register
+  if (rd == rv_reg_zero) {
+    // step over instruction
+    block->pc_end += 4;
+    block->instructions += 1;
+    return true;
+  }
+
+  // rd = rv->X[rs1]
+  const cg_r32_t dst = regs_read_write(block, rv, rd, rs1);
+
+  // dispatch operation type
+  switch (funct3) {
+  case 0: // ADDI
+    cg_add_r32_i32(cg, dst, imm);
+    break;
+  case 1: // SLLI
+    cg_shl_r32_i8(cg, dst, imm & 0x1f);
+    break;
+  case 2: // SLTI
+    cg_cmp_r32_i32(cg, dst, imm);
+    cg_setcc_r8(cg, cg_cc_lt, cg_dl);
+    cg_movzx_r32_r8(cg, dst, cg_dl);
+    break;
+  case 3: // SLTIU
+    cg_cmp_r32_i32(cg, dst, imm);
+    cg_setcc_r8(cg, cg_cc_c, cg_dl);
+    cg_movzx_r32_r8(cg, dst, cg_dl);
+    break;
+  case 4: // XORI
+    cg_xor_r32_i32(cg, dst, imm);
+    break;
+  case 5:
+    if (imm & ~0x1f) {
+      // SRAI
+      cg_sar_r32_i8(cg, dst, imm & 0x1f);
+    }
+    else {
+      // SRLI
+      cg_shr_r32_i8(cg, dst, imm & 0x1f);
+    }
+    break;
+  case 6: // ORI
+    cg_or_r32_i32(cg, dst, imm);
+    break;
+  case 7: // ANDI
+    cg_and_r32_i32(cg, dst, imm);
+    break;
+  default:
+    assert(!"unreachable");
+    break;
+  }
+  // step over instruction
+  block->pc_end += 4;
+  block->instructions += 1;
+  // cant branch
+  return true;
+}
+
+// add upper immediate to pc
+static bool op_auipc(struct riscv_t *rv,
+                     uint32_t inst,
+                     struct block_t *block) {
+
+  struct cg_state_t *cg = &block->cg;
+
+  // the effective current PC
+  const uint32_t pc = block->pc_end;
+  // u-type decode
+  const uint32_t rd  = dec_rd(inst);
+  const uint32_t imm = dec_utype_imm(inst);
+
+  // skip any writes to the zero register
+  if (rd == rv_reg_zero) {
+    // step over instruction
+    block->pc_end += 4;
+    block->instructions += 1;
+    return true;
+  }
+
+  // rv->X[rd] = imm + rv->PC;
+  cg_mov_r32_i32(cg, regs_write(block, rv, &rv->jit.regs, rd), pc + imm);
+
+  // step over instruction
+  block->pc_end += 4;
+  block->instructions += 1;
+  // cant branch
+  return true;
+}
+
+// emit a guest memory store of the width given by funct3 to rs1 + imm
+// note: the data to store must already be in abi_arg3
+static void gen_store(struct block_t *block, struct riscv_t *rv,
+                      uint32_t funct3, uint32_t rs1, int32_t imm) {
+
+  struct cg_state_t *cg = &block->cg;
+
+  // arg2 - addr
+  get_reg(block, rv, abi_arg2, rs1);
+  cg_add_r32_i32(cg, abi_arg2, imm);
+
+  // access memory directly if we can
+  // note: stores use the store map so that stores to translated code reach the
+  //       slow path
+  struct cg_label_t miss, done;
+  cg_label_init(&miss);
+  cg_label_init(&done);
+  if (rv->mem_map) {
+    gen_mem_lookup(block, abi_arg2, 1u << (funct3 & 3),
+                   rv_offset(rv, jit.store_map), RV_JIT_CODE_PAGE_BITS, &miss);
+    switch (funct3) {
+    case 0: // SB
+      cg_mov_r64idx_r8(cg, cg_rcx, cg_rax, 1, abi_arg3);
+      break;
+    case 1: // SH
+      cg_mov_r64idx_r16(cg, cg_rcx, cg_rax, 1, abi_arg3);
+      break;
+    case 2: // SW
+      cg_mov_r64idx_r32(cg, cg_rcx, cg_rax, 1, abi_arg3);
+      break;
+    default:
+      assert(!"unreachable");
+      break;
+    }
+    cg_jmp_label(cg, &done);
+    cg_bind(cg, &miss);
+  }
+
+  // arg1 - rv
+  cg_mov_r64_r64(cg, abi_arg1, abi_rv);
+  // the memory handlers may clobber any volatile registers
+  regs_save_volatile(block, rv);
+
+  int32_t offset;
+
+  // dispatch by write size
+  switch (funct3) {
+  case 0: // SB
+    // rv->io.mem_write_b(rv, addr, data);
+    offset = rv_offset(rv, io.mem_write_b);
+    cg_call_r64disp(cg, abi_rv, offset);
+    break;
+  case 1: // SH
+    // rv->io.mem_write_s(rv, addr, data);
+    offset = rv_offset(rv, io.mem_write_s);
+    cg_call_r64disp(cg, abi_rv, offset);
+    break;
+  case 2: // SW
+    // rv->io.mem_write_w(rv, addr, data);
+    offset = rv_offset(rv, io.mem_write_w);
+    cg_call_r64disp(cg, abi_rv, offset);
+    break;
+  default:
+    assert(!"unreachable");
+    break;
+  }
+  regs_restore_volatile(block, rv);
+  cg_bind(cg, &done);
+}
+
+static bool op_store(struct riscv_t *rv,
+                     uint32_t inst,
+                     struct block_t *block) {
+
+  // s-type format
+  const int32_t  imm    = dec_stype_imm(inst);
+  const uint32_t rs1    = dec_rs1(inst);
+  const uint32_t rs2    = dec_rs2(inst);
+  const uint32_t funct3 = dec_funct3(inst);
+
+  // arg3 - data
+  get_reg(block, rv, abi_arg3, rs2);
+  // store(rv->X[rs1] + imm, data)
+  gen_store(block, rv, funct3, rs1, imm);
+  // step over instruction
+  block->pc_end += 4;
+  block->instructions += 1;
+  // cant branch
+  return true;
+}
+
+#if RISCV_VM_SUPPORT_RV32M
+// emit a divide or remainder of dst by ecx leaving the result in dst
+// note: the host faults on a zero divisor and on INT_MIN / -1 so these are
+//       given the results RV32M specifies before reaching idiv and div.
+static void gen_divide(struct cg_state_t *cg, uint32_t funct3, cg_r32_t dst) {
+  const bool is_signed = !(funct3 & 1);
+  const bool is_rem = funct3 & 2;
+  struct cg_label_t done;
+  cg_label_init(&done);
+
+  cg_mov_r32_r32(cg, cg_eax, dst);
+  // a zero divisor gives all ones for a divide and the dividend for a
+  // remainder, which is already in dst
+  cg_test_r32_r32(cg, cg_ecx, cg_ecx);
+  if (is_rem) {
+    cg_jcc_label_short(cg, cg_cc_eq, &done);
+  }
+  else {
+    struct cg_label_t nonzero;
+    cg_label_init(&nonzero);
+    cg_jcc_label_short(cg, cg_cc_ne, &nonzero);
+    cg_mov_r32_i32(cg, dst, ~0u);
+    cg_jmp_label_short(cg, &done);
+    cg_bind(cg, &nonzero);
+  }
+  if (is_signed) {
+    // dividing by -1 is a negate, which wraps INT_MIN to itself as RV32M
+    // requires, and always leaves no remainder
+    cg_cmp_r32_i32(cg, cg_ecx, ~0u);
+    struct cg_label_t general;
+    cg_label_init(&general);
+    cg_jcc_label_short(cg, cg_cc_ne, &general);
+    if (is_rem) {
+      cg_xor_r32_r32(cg, dst, dst);
+    }
+    else {
+      cg_neg_r32(cg, dst);
+    }
+    cg_jmp_label_short(cg, &done);
+    cg_bind(cg, &general);
+    cg_cdq(cg);
+    cg_idiv_r32(cg, cg_ecx);
+  }
+  else {
+    cg_xor_r32_r32(cg, cg_edx, cg_edx);
+    cg_div_r32(cg, cg_ecx);
+  }
+  cg_mov_r32_r32(cg, dst, is_rem ? cg_edx : cg_eax);
+  cg_bind(cg, &done);
+}
+#endif  // RISCV_VM_SUPPORT_RV32M
+
+// emit sll, srl or sra with the shlx family, which takes its count from any
+// register and masks it to 5 bits just like RV32I
+static void gen_shift_bmi2(struct block_t *block, struct riscv_t *rv,
+                           uint32_t inst) {
+  struct cg_state_t *cg = &block->cg;
+  struct jit_regs_t *regs = &rv->jit.regs;
+  const uint32_t rd  = dec_rd(inst);
+  const uint32_t rs1 = dec_rs1(inst);
+  const uint32_t rs2 = dec_rs2(inst);
+  cg_r32_t src = cg_eax;
+  if (rs1 == rv_reg_zero) {
+    cg_xor_r32_r32(cg, cg_eax, cg_eax);
+  }
+  else {
+    src = regs_read(block, rv, regs, rs1);
+  }
+  cg_r32_t count = cg_ecx;
+  if (rs2 == rv_reg_zero) {
+    cg_xor_r32_r32(cg, cg_ecx, cg_ecx);
+  }
+  else {
+    count = regs_read(block, rv, regs, rs2);
+  }
+  const cg_r32_t dst = regs_write(block, rv, regs, rd);
+  if (dec_funct3(inst) == 0b001) {  // SLL
+    cg_shlx_r32_r32_r32(cg, dst, src, count);
+  }
+  else if (dec_funct7(inst) == 0b0000000) {  // SRL
+    cg_shrx_r32_r32_r32(cg, dst, src, count);
+  }
+  else {  // SRA
+    cg_sarx_r32_r32_r32(cg, dst, src, count);
+  }
+}
+
+static bool op_op(struct riscv_t *rv, uint32_t inst, struct block_t *block) {
+
+  struct cg_state_t *cg = &block->cg;
+
+  // r-type decode
+  const uint32_t rd     = dec_rd(inst);
+  const uint32_t funct3 = dec_funct3(inst);
+  const uint32_t rs1    = dec_rs1(inst);
+  const uint32_t rs2    = dec_rs2(inst);
+  const uint32_t funct7 = dec_funct7(inst);
+
+  // skip any writes to the zero register
+  if (rd == rv_reg_zero) {
+    // step over instruction
+    block->pc_end += 4;
+    block->instructions += 1;
+    return true;
+  }
+
+  // bmi2 shifts can take both operands where they are
+  const bool shift = (funct3 == 0b001 && funct7 == 0b0000000) ||
+                     (funct3 == 0b101 && (funct7 & ~0b0100000) == 0);
+  if (shift && (rv->jit.features & cg_feature_bmi2)) {
+    gen_shift_bmi2(block, rv, inst);
+    // step over instruction
+    block->pc_end += 4;
+    block->instructions += 1;
+    return true;
+  }
+
+  // get operands
+  // note: rs2 is read first as rd may alias it
+  // note: x86 masks shift counts in cl to 5 bits just like RV32I
+  get_reg(block, rv, cg_ecx, rs2);
+  const cg_r32_t dst = regs_read_write(block, rv, rd, rs1);
+
+  switch (funct7) {
+  case 0b0000000:
+    switch (funct3) {
+    case 0b000: // ADD
+      cg_add_r32_r32(cg, dst, cg_ecx);
+      break;
+    case 0b001: // SLL
+      cg_shl_r32_cl(cg, dst);
+      break;
+    case 0b010: // SLT
+      cg_cmp_r32_r32(cg, dst, cg_ecx);
+      cg_setcc_r8(cg, cg_cc_lt, cg_dl);
+      cg_movzx_r32_r8(cg, dst, cg_dl);
+      break;
+    case 0b011: // SLTU
+      cg_cmp_r32_r32(cg, dst, cg_ecx);
+      cg_setcc_r8(cg, cg_cc_c, cg_dl);
+      cg_movzx_r32_r8(cg, dst, cg_dl);
+      break;
+    case 0b100: // XOR
+      cg_xor_r32_r32(cg, dst, cg_ecx);
+      break;
+    case 0b101: // SRL
+      cg_shr_r32_cl(cg, dst);
+      break;
+    case 0b110: // OR
+      cg_or_r32_r32(cg, dst, cg_ecx);
+      break;
+    case 0b111: // AND
+      cg_and_r32_r32(cg, dst, cg_ecx);
+      break;
+    default:
+      assert(!"unreachable");
+      break;
+    }
+    break;
+  case 0b0100000:
+    switch (funct3) {
+    case 0b000: // SUB
+      cg_sub_r32_r32(cg, dst, cg_ecx);
+      break;
+    case 0b101: // SRA
+      cg_sar_r32_cl(cg, dst);
+      break;
+    default:
+      assert(!"unreachable");
+      break;
+    }
+    break;
+
+#if RISCV_VM_SUPPORT_RV32M
+  case 0b0000001:
+    // RV32M instructions
+    switch (funct3) {
+    case 0b000: // MUL
+      cg_mov_r32_r32(cg, cg_eax, dst);
+      cg_imul_r32(cg, cg_ecx);
+      cg_mov_r32_r32(cg, dst, cg_eax);
+      break;
+    case 0b001: // MULH
+      cg_mov_r32_r32(cg, cg_eax, dst);
+      cg_imul_r32(cg, cg_ecx);
+      cg_mov_r32_r32(cg, dst, cg_edx);
+      break;
+    case 0b010: // MULHSU
+      // take the unsigned high half and correct it when rs1 is negative
+      cg_mov_r32_r32(cg, cg_eax, dst);
+      cg_mul_r32(cg, cg_ecx);
+      cg_sar_r32_i8(cg, dst, 31);
+      cg_and_r32_r32(cg, dst, cg_ecx);
+      cg_sub_r32_r32(cg, cg_edx, dst);
+      cg_mov_r32_r32(cg, dst, cg_edx);
+      break;
+    case 0b011: // MULHU
+      cg_mov_r32_r32(cg, cg_eax, dst);
+      cg_mul_r32(cg, cg_ecx);
+      cg_mov_r32_r32(cg, dst, cg_edx);
+      break;
+    case 0b100: // DIV
+    case 0b101: // DIVU
+    case 0b110: // REM
+    case 0b111: // REMU
+      gen_divide(cg, funct3, dst);
+      break;
+    default:
+      assert(!"unreachable");
+      break;
+    }
+    break;
+#endif  // RISCV_VM_SUPPORT_RV32M
+  default:
+    assert(!"unreachable");
+    break;
+  }
+
+  // step over instruction
+  block->instructions += 1;
+  block->pc_end += 4;
+  // cant branch
+  return true;
+}
+
+static bool op_lui(struct riscv_t *rv, uint32_t inst, struct block_t *block) {
+
+  struct cg_state_t *cg = &block->cg;
+
+  // u-type decode
+  const uint32_t rd  = dec_rd(inst);
+  const uint32_t val = dec_utype_imm(inst);
+  // rv->X[rd] = val;
+  if (rd != rv_reg_zero) {
+    cg_mov_r32_i32(cg, regs_write(block, rv, &rv->jit.regs, rd), val);
+  }
+  // step over instruction
+  block->instructions += 1;
+  block->pc_end += 4;
+  // cant branch
+  return true;
+}
+
+// the operands of a guest branch as held in host registers
+struct branch_cmp_t {
+  cg_r32_t lhs;
+  // or -1 to compare lhs against zero
+  int rhs;
+  cg_cc_t cc;
+};
+
+// find host registers holding the operands of a branch, without moving them
+// note: comparisons with x0 become a test so the zero is never materialized.
+//       when x0 is the first operand the operands and condition are swapped.
+static struct branch_cmp_t branch_operands(struct block_t *block,
+                                           struct riscv_t *rv, uint32_t inst) {
+  struct cg_state_t *cg = &block->cg;
+  struct jit_regs_t *regs = &rv->jit.regs;
+  // condition codes for beq, bne, -, -, blt, bge, bltu, bgeu
+  static const cg_cc_t cc_of[] = {
+    cg_cc_eq, cg_cc_ne, cg_cc_eq, cg_cc_eq,
+    cg_cc_lt, cg_cc_ge, cg_cc_c,  cg_cc_ae,
+  };
+  // the same conditions with their operands swapped
+  static const cg_cc_t cc_swap[] = {
+    cg_cc_eq, cg_cc_ne, cg_cc_eq, cg_cc_eq,
+    cg_cc_gt, cg_cc_le, cg_cc_ab, cg_cc_be,
+  };
+  const uint32_t func3 = dec_funct3(inst);
+  const uint32_t rs1   = dec_rs1(inst);
+  const uint32_t rs2   = dec_rs2(inst);
+  assert(func3 != 2 && func3 != 3);
+  struct branch_cmp_t out;
+  out.cc = cc_of[func3];
+  out.rhs = -1;
+  if (rs1 == rv_reg_zero && rs2 == rv_reg_zero) {
+    cg_xor_r32_r32(cg, cg_eax, cg_eax);
+    out.lhs = cg_eax;
+  }
+  else if (rs1 == rv_reg_zero) {
+    out.lhs = regs_read(block, rv, regs, rs2);
+    out.cc = cc_swap[func3];
+  }
+  else {
+    out.lhs = regs_read(block, rv, regs, rs1);
+    if (rs2 != rv_reg_zero) {
+      out.rhs = regs_read(block, rv, regs, rs2);
+    }
+  }
+  return out;
+}
+
+// set the flags for a branch found by branch_operands
+static void gen_branch_cmp(struct block_t *block,
+                           const struct branch_cmp_t *cmp) {
+  struct cg_state_t *cg = &block->cg;
+  if (cmp->rhs < 0) {
+    cg_test_r32_r32(cg, cmp->lhs, cmp->lhs);
+  }
+  else {
+    cg_cmp_r32_r32(cg, cmp->lhs, cmp->rhs);
+  }
+}
+
+static bool op_branch(struct riscv_t *rv,
+                      uint32_t inst,
+                      struct block_t *block) {
+
+  struct cg_state_t *cg = &block->cg;
+
+  // the effective current PC
+  const uint32_t pc = block->pc_end;
+  // b-type decode
+  const int32_t imm = dec_btype_imm(inst);
+  // step over instruction
+  block->instructions += 1;
+  block->pc_end += 4;
+  // find the operands and retire the block
+  // note: the host registers stay mapped when gen_cycles writes them back
+  const struct branch_cmp_t cmp = branch_operands(block, rv, inst);
+  gen_cycles(block, rv);
+
+  // continue the block along the side of the branch the trace follows,
+  // taking a side exit for the other
+  // note: a side exit is well within the reach of a short jump
+  const uint32_t flags = rv->jit.ir[rv->jit.ir_pos].flags;
+  struct cg_label_t follow;
+  cg_label_init(&follow);
+  if (flags & IR_LOOP) {
+    // stay in the loop while the branch is taken, leaving when it is not
+    gen_branch_cmp(block, &cmp);
+    cg_jcc_label_short(cg, cmp.cc ^ 1, &follow);
+    gen_loop_back(block, rv);
+    cg_bind(cg, &follow);
+    gen_exit_link(block, rv, pc + 4);
+    return false;
+  }
+  if (flags & IR_FOLLOW) {
+    gen_branch_cmp(block, &cmp);
+    cg_jcc_label_short(cg, cmp.cc, &follow);
+    gen_exit_link(block, rv, pc + 4);
+    cg_bind(cg, &follow);
+    return true;
+  }
+  if (!(flags & IR_END)) {
+    gen_branch_cmp(block, &cmp);
+    cg_jcc_label_short(cg, cmp.cc ^ 1, &follow);
+    gen_exit_link(block, rv, pc + imm);
+    cg_bind(cg, &follow);
+    return true;
+  }
+
+  // the block ends here, so check the cycle target once up front and let
+  // the branch itself jump into whichever successor it picks
+  struct block_link_t *taken = link_alloc(block, pc + imm);
+  struct block_link_t *not_taken = link_alloc(block, pc + 4);
+  cg_cmp_r64_r64disp(cg, cg_rdx, abi_rv, rv_offset(rv, jit.cycles_target));
+  struct cg_label_t done, not_taken_stub;
+  cg_label_init(&done);
+  cg_label_init(&not_taken_stub);
+  cg_jcc_label_short(cg, cg_cc_ae, &done);
+  gen_branch_cmp(block, &cmp);
+  // both jumps lead to their stubs below while unlinked
+  taken->patch = cg_jcc_rel32(cg, cmp.cc, NULL);
+  not_taken->patch = cg_jmp_rel32(cg, NULL);
+  cg_bind(cg, &not_taken_stub);
+  gen_exit_stub(block, rv, not_taken);
+  // having reached the cycle target, still pick the exit that sets the PC
+  cg_bind(cg, &done);
+  gen_branch_cmp(block, &cmp);
+  cg_jcc_label(cg, cmp.cc ^ 1, &not_taken_stub);
+  cg_patch_rel32(taken->patch, cg->head);
+  memcpy(&taken->unlinked, taken->patch, sizeof(taken->unlinked));
+  gen_exit_stub(block, rv, taken);
+  // could branch
+  return false;
+}
+
+static bool op_jalr(struct riscv_t *rv, uint32_t inst, struct block_t *block) {
+
+  struct cg_state_t *cg = &block->cg;
+
+  // the effective current PC
+  const uint32_t pc = block->pc_end;
+  // i-type decode
+  const uint32_t rd  = dec_rd(inst);
+  const uint32_t rs1 = dec_rs1(inst);
+  const int32_t  imm = dec_itype_imm(inst);
+  // constant propagation may have found the target already
+  const struct jit_insn_t *insn = &rv->jit.ir[rv->jit.ir_pos];
+  const bool known = (insn->flags & IR_TARGET) != 0;
+
+  // jump
+  // note: we also clear the least significant bit of pc
+  if (!known) {
+    get_reg(block, rv, cg_eax, rs1);
+    cg_add_r32_i32(cg, cg_eax, imm);
+    cg_and_r32_i32(cg, cg_eax, 0xfffffffe);
+    set_pc(block, rv, cg_eax);
+  }
+
+  // link
+  if (rd != rv_reg_zero) {
+    cg_mov_r32_i32(cg, cg_eax, pc + 4);
+    set_reg(block, rv, rd, cg_eax);
+  }
+
+#if RISCV_SUPPORT_MACHINE
+  // check for exception
+  // if (rv->PC & 0x3) {
+  //   raise_exception(rv, rv_except_inst_misaligned);
+  // }
+#endif
+
+  // calls push their return address and returns pop it, following the
+  // register usage hints of the spec
+  uint8_t *ret = NULL;
+  if (is_link_reg(rd)) {
+    ret = gen_ras_push(block, rv, pc + 4);
+  }
+  const bool pop = is_link_reg(rs1) && !is_link_reg(rd);
 
-  // dispatch operation type
-  switch (funct3) {
-  case 0: // ADDI
-    cg_add_r32_i32(cg, cg_eax, imm);
-    break;
-  case 1: // SLLI
-    cg_shl_r32_i8(cg, cg_eax, imm & 0x1f);
-    break;
-  case 2: // SLTI
-    cg_cmp_r32_i32(cg, cg_eax, imm);
-    cg_setcc_r8(cg, cg_cc_lt, cg_dl);
-    cg_movzx_r32_r8(cg, cg_eax, cg_dl);
-    break;
-  case 3: // SLTIU
-    cg_cmp_r32_i32(cg, cg_eax, imm);
-    cg_setcc_r8(cg, cg_cc_c, cg_dl);
-    cg_movzx_r32_r8(cg, cg_eax, cg_dl);
-    break;
-  case 4: // XORI
-    cg_xor_r32_i32(cg, cg_eax, imm);
-    break;
-  case 5:
-    if (imm & ~0x1f) {
-      // SRAI
-      cg_sar_r32_i8(cg, cg_eax, imm & 0x1f);
+  // step over instruction
+  block->instructions += 1;
+  block->pc_end += 4;
+  gen_cycles(block, rv);
+  if (known) {
+    // leave by a chainable exit, keeping the return address stack balanced
+    if (pop) {
+      gen_ras_drop(block, rv);
     }
-    else {
-      // SRLI
-      cg_shr_r32_i8(cg, cg_eax, imm & 0x1f);
+    gen_exit_link(block, rv, insn->value);
+  }
+  else {
+    // target is only known at runtime so try the return address stack and
+    // then an inline cache
+    if (pop) {
+      gen_ras_pop(block, rv);
     }
-    break;
-  case 6: // ORI
-    cg_or_r32_i32(cg, cg_eax, imm);
-    break;
-  case 7: // ANDI
-    cg_and_r32_i32(cg, cg_eax, imm);
-    break;
-  default:
-    assert(!"unreachable");
-    break;
+    gen_exit_ic(block, rv);
   }
-  // rv->X[rd] = eax
-  set_reg(block, rv, rd, cg_eax);
-  // step over instruction
-  block->pc_end += 4;
-  block->instructions += 1;
-  // cant branch
-  return true;
+  if (ret) {
+    gen_ras_continue(block, rv, ret, pc + 4);
+  }
+  // could branch
+  return false;
 }
 
-// add upper immediate to pc
-static bool op_auipc(struct riscv_t *rv,
-                     uint32_t inst,
-                     struct block_t *block) {
+static bool op_jal(struct riscv_t *rv, uint32_t inst, struct block_t *block) {
 
   struct cg_state_t *cg = &block->cg;
 
   // the effective current PC
   const uint32_t pc = block->pc_end;
-  // u-type decode
+  // j-type decode
   const uint32_t rd  = dec_rd(inst);
-  const uint32_t imm = dec_utype_imm(inst);
+  const int32_t rel = dec_jtype_imm(inst);
 
-  // skip any writes to the zero register
-  if (rd == rv_reg_zero) {
-    // step over instruction
-    block->pc_end += 4;
-    block->instructions += 1;
-    return true;
+  // link
+  if (rd != rv_reg_zero) {
+    cg_mov_r32_i32(cg, cg_eax, pc + 4);
+    set_reg(block, rv, rd, cg_eax);
   }
 
-  // rv->X[rd] = imm + rv->PC;
-  cg_mov_r32_i32(cg, cg_eax, pc + imm);
-  set_reg(block, rv, rd, cg_eax);
+#if RISCV_SUPPORT_MACHINE
+  // check alignment of PC
+  // if (rv->PC & 0x3) {
+  //   raise_exception(rv, rv_except_inst_misaligned);
+  // }
+#endif
+
+  // calls push their return address
+  uint8_t *ret = NULL;
+  if (is_link_reg(rd)) {
+    ret = gen_ras_push(block, rv, pc + 4);
+  }
 
   // step over instruction
-  block->pc_end += 4;
   block->instructions += 1;
-  // cant branch
-  return true;
+  block->pc_end += 4;
+  // carry on translating at the target if the trace does
+  if (rv->jit.ir[rv->jit.ir_pos].flags & IR_FOLLOW) {
+    if (ret) {
+      // the return continues out of line
+      struct cg_label_t skip;
+      cg_label_init(&skip);
+      cg_jmp_label_short(cg, &skip);
+      gen_ras_continue(block, rv, ret, pc + 4);
+      cg_bind(cg, &skip);
+    }
+    return true;
+  }
+  // jump
+  // note: rel is aligned to a two byte boundary so we dont needs to do any
+  //       masking here.
+  gen_cycles(block, rv);
+  if (rv->jit.ir[rv->jit.ir_pos].flags & IR_LOOP) {
+    gen_loop_back(block, rv);
+    return false;
+  }
+  gen_exit_link(block, rv, pc + rel);
+  if (ret) {
+    gen_ras_continue(block, rv, ret, pc + 4);
+  }
+  // could branch
+  return false;
 }
 
-static bool op_store(struct riscv_t *rv,
-                     uint32_t inst,
-                     struct block_t *block) {
+static bool op_system(struct riscv_t *rv,
+                      uint32_t inst,
+                      struct block_t *block) {
 
   struct cg_state_t *cg = &block->cg;
 
-  // s-type format
-  const int32_t  imm    = dec_stype_imm(inst);
-  const uint32_t rs1    = dec_rs1(inst);
-  const uint32_t rs2    = dec_rs2(inst);
+  // the effective current PC
+  const uint32_t pc = block->pc_end;
+  // i-type decode
+  const int32_t  imm    = dec_itype_imm(inst);
   const uint32_t funct3 = dec_funct3(inst);
 
-  // arg1 - rv
-  cg_mov_r64_r64(cg, cg_rcx, cg_rsi);
-  // arg2 - addr
-  get_reg(block, rv, cg_edx, rs1);
-  cg_add_r32_i32(cg, cg_edx, imm);
-  // arg3 - data
-  get_reg(block, rv, cg_eax, rs2);
-  cg_mov_r64_r64(cg, cg_r8, cg_rax);
-
   int32_t offset;
 
-  // dispatch by write size
+  // dispatch by func3 field
   switch (funct3) {
-  case 0: // SB
-    // rv->io.mem_write_b(rv, addr, data);
-    offset = rv_offset(rv, io.mem_write_b);
-    cg_call_r64disp(cg, cg_rsi, offset);
-    break;
-  case 1: // SH
-    // rv->io.mem_write_s(rv, addr, data);
-    offset = rv_offset(rv, io.mem_write_s);
-    cg_call_r64disp(cg, cg_rsi, offset);
-    break;
-  case 2: // SW
-    // rv->io.mem_write_w(rv, addr, data);
-    offset = rv_offset(rv, io.mem_write_w);
-    cg_call_r64disp(cg, cg_rsi, offset);
+  case 0:
+    // arg1 - rv
+    cg_mov_r64_r64(cg, abi_arg1, abi_rv);
+    // arg2 - pc
+    cg_mov_r32_i32(cg, abi_arg2, pc);
+    // arg3 - instruction
+    cg_mov_r32_i32(cg, abi_arg3, inst);
+    // the handler can read and write any guest register
+    regs_flush(block, rv);
+    regs_spill_volatile(block, rv);
+    // dispatch from imm field
+    switch (imm) {
+    case 0: // ECALL
+      offset = rv_offset(rv, io.on_ecall);
+      cg_call_r64disp(cg, abi_rv, offset);
+      break;
+    case 1: // EBREAK
+      offset = rv_offset(rv, io.on_ebreak);
+      cg_call_r64disp(cg, abi_rv, offset);
+      break;
+    default:
+      assert(!"unreachable");
+    }
+    // any cached guest registers may now be stale
+    regs_reset(&rv->jit);
     break;
   default:
-    assert(!"unreachable");
-    break;
+    // cant translate this instruction (CSRs) - terminate block
+    gen_fallback(block, rv);
+    return false;
   }
+
+  // step over instruction
+  block->instructions += 1;
+  block->pc_end += 4;
+
+  // the handler may have raised an exception so return to the dispatcher
+  cg_mov_r64disp_i32(cg, abi_rv, rv_offset(rv, PC), block->pc_end);
+  gen_cycles(block, rv);
+  gen_exit_indirect(block, rv);
+  return false;
+}
+
+#if RISCV_VM_SUPPORT_RV32F
+// helpers for float operations that are not translated inline
+// note: these use the same libm functions as the interpreter so that results
+//       match exactly, including for NaNs and signed zeros.
+static float jit_fminf(float a, float b) {
+  return fminf(a, b);
+}
+
+static float jit_fmaxf(float a, float b) {
+  return fmaxf(a, b);
+}
+
+// return an xmm register holding the value of a guest float register
+static cg_xmm_t get_freg(struct block_t *block, struct riscv_t *rv,
+                         uint32_t src) {
+  return regs_read(block, rv, &rv->jit.fregs, src);
+}
+
+// return an xmm register that will receive a new guest float register value
+static cg_xmm_t set_freg(struct block_t *block, struct riscv_t *rv,
+                         uint32_t dst) {
+  return regs_write(block, rv, &rv->jit.fregs, dst);
+}
+
+// call a helper through its pointer in the rv struct
+// note: arguments must already be in xmm0/xmm1 or abi_arg1 and the result is
+//       returned in xmm0 or eax.
+static void gen_call_helper(struct block_t *block, struct riscv_t *rv,
+                            int32_t offset) {
+  regs_save_volatile(block, rv);
+  cg_call_r64disp(&block->cg, abi_rv, offset);
+  regs_restore_volatile(block, rv);
+}
+
+static bool op_load_fp(struct riscv_t *rv,
+                       uint32_t inst,
+                       struct block_t *block) {
+
+  struct cg_state_t *cg = &block->cg;
+
+  // itype format
+  const uint32_t rd  = dec_rd(inst);
+  const uint32_t rs1 = dec_rs1(inst);
+  const int32_t  imm = dec_itype_imm(inst);
+
+  // eax = load_w(rv->X[rs1] + imm)
+  gen_load(block, rv, 2, rs1, imm);
+  // rv->F[rd] = eax
+  cg_movd_xmm_r32(cg, set_freg(block, rv, rd), cg_eax);
   // step over instruction
   block->pc_end += 4;
   block->instructions += 1;
@@ -424,476 +2503,1062 @@ static bool op_store(struct riscv_t *rv,
   return true;
 }
 
-static bool op_op(struct riscv_t *rv, uint32_t inst, struct block_t *block) {
+static bool op_store_fp(struct riscv_t *rv,
+                        uint32_t inst,
+                        struct block_t *block) {
+
+  struct cg_state_t *cg = &block->cg;
+
+  // s-type format
+  const uint32_t rs1 = dec_rs1(inst);
+  const uint32_t rs2 = dec_rs2(inst);
+  const int32_t  imm = dec_stype_imm(inst);
+
+  // arg3 - data
+  cg_movd_r32_xmm(cg, abi_arg3, get_freg(block, rv, rs2));
+  // store_w(rv->X[rs1] + imm, data)
+  gen_store(block, rv, 2, rs1, imm);
+  // step over instruction
+  block->pc_end += 4;
+  block->instructions += 1;
+  // cant branch
+  return true;
+}
+
+// emit fadd, fsub, fmul or fdiv with a three operand avx instruction, which
+// needs no copy of rs1 into rd first
+static void gen_fp_arith_avx(struct block_t *block, struct riscv_t *rv,
+                             uint32_t inst) {
+  struct cg_state_t *cg = &block->cg;
+  const cg_xmm_t src2 = get_freg(block, rv, dec_rs2(inst));
+  const cg_xmm_t src1 = get_freg(block, rv, dec_rs1(inst));
+  const cg_xmm_t dst = set_freg(block, rv, dec_rd(inst));
+  switch (dec_funct7(inst)) {
+  case 0b0000000:  // FADD
+    cg_vaddss_xmm_xmm_xmm(cg, dst, src1, src2);
+    break;
+  case 0b0000100:  // FSUB
+    cg_vsubss_xmm_xmm_xmm(cg, dst, src1, src2);
+    break;
+  case 0b0001000:  // FMUL
+    cg_vmulss_xmm_xmm_xmm(cg, dst, src1, src2);
+    break;
+  default:         // FDIV
+    cg_vdivss_xmm_xmm_xmm(cg, dst, src1, src2);
+    break;
+  }
+}
+
+static bool op_fp(struct riscv_t *rv, uint32_t inst, struct block_t *block) {
 
   struct cg_state_t *cg = &block->cg;
 
-  // effective pc
-  const uint32_t pc = block->pc_end;
   // r-type decode
   const uint32_t rd     = dec_rd(inst);
-  const uint32_t funct3 = dec_funct3(inst);
   const uint32_t rs1    = dec_rs1(inst);
   const uint32_t rs2    = dec_rs2(inst);
+  const uint32_t rm     = dec_funct3(inst);
   const uint32_t funct7 = dec_funct7(inst);
 
-  // skip any writes to the zero register
-  if (rd == rv_reg_zero) {
-    // step over instruction
-    block->pc_end += 4;
-    block->instructions += 1;
-    return true;
-  }
-
-  // get operands
-  get_reg(block, rv, cg_eax, rs1);
-  get_reg(block, rv, cg_ecx, rs2);
-
+  // dispatch based on func7 (low 2 bits are width)
   switch (funct7) {
-  case 0b0000000:
-    switch (funct3) {
-    case 0b000: // ADD
-      cg_add_r32_r32(cg, cg_eax, cg_ecx);
-      break;
-    case 0b001: // SLL
-      cg_and_r8_i8(cg, cg_cl, 0x1f);
-      cg_shl_r32_cl(cg, cg_eax);
-      break;
-    case 0b010: // SLT
-      cg_cmp_r32_r32(cg, cg_eax, cg_ecx);
-      cg_setcc_r8(cg, cg_cc_lt, cg_dl);
-      cg_movzx_r32_r8(cg, cg_eax, cg_dl);
-      break;
-    case 0b011: // SLTU
-      cg_cmp_r32_r32(cg, cg_eax, cg_ecx);
-      cg_setcc_r8(cg, cg_cc_c, cg_dl);
-      cg_movzx_r32_r8(cg, cg_eax, cg_dl);
-      break;
-    case 0b100: // XOR
-      cg_xor_r32_r32(cg, cg_eax, cg_ecx);
+  case 0b0000000:  // FADD
+  case 0b0000100:  // FSUB
+  case 0b0001000:  // FMUL
+  case 0b0001100:  // FDIV
+  {
+    if (rv->jit.features & cg_feature_avx) {
+      gen_fp_arith_avx(block, rv, inst);
       break;
-    case 0b101: // SRL
-      cg_and_r8_i8(cg, cg_cl, 0x1f);
-      cg_shr_r32_cl(cg, cg_eax);
+    }
+    // the operation is done in place on rd so make sure it wont clobber rs2
+    cg_xmm_t src2 = get_freg(block, rv, rs2);
+    if (rd == rs2 && rs1 != rs2) {
+      cg_movaps_xmm_xmm(cg, cg_xmm1, src2);
+      src2 = cg_xmm1;
+    }
+    const cg_xmm_t src1 = get_freg(block, rv, rs1);
+    const cg_xmm_t dst = set_freg(block, rv, rd);
+    if (dst != src1) {
+      cg_movaps_xmm_xmm(cg, dst, src1);
+    }
+    switch (funct7) {
+    case 0b0000000:
+      cg_addss_xmm_xmm(cg, dst, src2);
       break;
-    case 0b110: // OR
-      cg_or_r32_r32(cg, cg_eax, cg_ecx);
+    case 0b0000100:
+      cg_subss_xmm_xmm(cg, dst, src2);
       break;
-    case 0b111: // AND
-      cg_and_r32_r32(cg, cg_eax, cg_ecx);
+    case 0b0001000:
+      cg_mulss_xmm_xmm(cg, dst, src2);
       break;
-    default:
-      assert(!"unreachable");
+    case 0b0001100:
+      cg_divss_xmm_xmm(cg, dst, src2);
       break;
     }
     break;
-  case 0b0100000:
-    switch (funct3) {
-    case 0b000: // SUB
-      cg_sub_r32_r32(cg, cg_eax, cg_ecx);
+  }
+  case 0b0101100:  // FSQRT
+  {
+    const cg_xmm_t src = get_freg(block, rv, rs1);
+    cg_sqrtss_xmm_xmm(cg, set_freg(block, rv, rd), src);
+    break;
+  }
+  case 0b0010000:
+    // sign injection is done on the raw bits
+    cg_movd_r32_xmm(cg, cg_eax, get_freg(block, rv, rs1));
+    cg_movd_r32_xmm(cg, cg_ecx, get_freg(block, rv, rs2));
+    switch (rm) {
+    case 0b000:  // FSGNJ.S
+      cg_and_r32_i32(cg, cg_eax, ~FMASK_SIGN);
+      cg_and_r32_i32(cg, cg_ecx, FMASK_SIGN);
+      cg_or_r32_r32(cg, cg_eax, cg_ecx);
       break;
-    case 0b101: // SRA
-      cg_and_r8_i8(cg, cg_cl, 0x1f);
-      cg_sar_r32_cl(cg, cg_eax);
+    case 0b001:  // FSGNJN.S
+      cg_and_r32_i32(cg, cg_eax, ~FMASK_SIGN);
+      cg_xor_r32_i32(cg, cg_ecx, FMASK_SIGN);
+      cg_and_r32_i32(cg, cg_ecx, FMASK_SIGN);
+      cg_or_r32_r32(cg, cg_eax, cg_ecx);
+      break;
+    case 0b010:  // FSGNJX.S
+      cg_and_r32_i32(cg, cg_ecx, FMASK_SIGN);
+      cg_xor_r32_r32(cg, cg_eax, cg_ecx);
       break;
     default:
       assert(!"unreachable");
-      break;
     }
+    cg_movd_xmm_r32(cg, set_freg(block, rv, rd), cg_eax);
     break;
-
-#if RISCV_VM_SUPPORT_RV32M
-  case 0b0000001:
-    // RV32M instructions
-    switch (funct3) {
-    case 0b000: // MUL
-      cg_imul_r32(cg, cg_ecx);
-      break;
-    case 0b001: // MULH
-      cg_imul_r32(cg, cg_ecx);
-      cg_mov_r32_r32(cg, cg_eax, cg_edx);
-      break;
-    case 0b010: // MULHSU
-      // const int64_t a = (int32_t)rv->X[rs1];
-      // const uint64_t b = rv->X[rs2];
-      // rv->X[rd] = ((uint64_t)(a * b)) >> 32;
-
-      // cant translate this instruction - terminate block
-      cg_mov_r32_i32(cg, cg_eax, pc);
-      set_pc(block, rv, cg_eax);
-      return false;
-
+  case 0b0010100:
+    cg_movaps_xmm_xmm(cg, cg_xmm0, get_freg(block, rv, rs1));
+    cg_movaps_xmm_xmm(cg, cg_xmm1, get_freg(block, rv, rs2));
+    switch (rm) {
+    case 0b000:  // FMIN
+      gen_call_helper(block, rv, rv_offset(rv, jit.helper_fmin));
       break;
-    case 0b011: // MULHU
-      cg_imul_r32(cg, cg_ecx);
-      cg_mov_r32_r32(cg, cg_eax, cg_edx);
+    case 0b001:  // FMAX
+      gen_call_helper(block, rv, rv_offset(rv, jit.helper_fmax));
       break;
-    case 0b100: // DIV
-    {
-      // const int32_t dividend = (int32_t)rv->X[rs1];
-      // const int32_t divisor = (int32_t)rv->X[rs2];
-      // if (divisor == 0) {
-      //   rv->X[rd] = ~0u;
-      // }
-      // else if (divisor == -1 && rv->X[rs1] == 0x80000000u) {
-      //   rv->X[rd] = rv->X[rs1];
-      // }
-      // else {
-      //   rv->X[rd] = dividend / divisor;
-      // }
-
-      // cant translate this instruction - terminate block
-      cg_mov_r32_i32(cg, cg_eax, pc);
-      set_pc(block, rv, cg_eax);
-      return false;
-
-    }
-    break;
-    case 0b101: // DIVU
-    {
-      // const uint32_t dividend = rv->X[rs1];
-      // const uint32_t divisor = rv->X[rs2];
-      // if (divisor == 0) {
-      //   rv->X[rd] = ~0u;
-      // }
-      // else {
-      //   rv->X[rd] = dividend / divisor;
-      // }
-
-      // cant translate this instruction - terminate block
-      cg_mov_r32_i32(cg, cg_eax, pc);
-      set_pc(block, rv, cg_eax);
-      return false;
-
+    default:
+      assert(!"unreachable");
     }
+    cg_movaps_xmm_xmm(cg, set_freg(block, rv, rd), cg_xmm0);
     break;
-    case 0b110: // REM
-    {
-      // const int32_t dividend = rv->X[rs1];
-      // const int32_t divisor = rv->X[rs2];
-      // if (divisor == 0) {
-      //   rv->X[rd] = dividend;
-      // }
-      // else if (divisor == -1 && rv->X[rs1] == 0x80000000u) {
-      //   rv->X[rd] = 0;
-      // }
-      // else {
-      //   rv->X[rd] = dividend % divisor;
-      // }
-
-      // cant translate this instruction - terminate block
-      cg_mov_r32_i32(cg, cg_eax, pc);
-      set_pc(block, rv, cg_eax);
-      return false;
-
+  case 0b1100000:
+    switch (rs2) {
+    case 0b00000:  // FCVT.W.S
+      cg_cvttss2si_r32_xmm(cg, cg_eax, get_freg(block, rv, rs1));
+      break;
+    case 0b00001:  // FCVT.WU.S
+      // convert to 64 bits and keep the low half like the interpreter does
+      cg_cvttss2si_r64_xmm(cg, cg_rax, get_freg(block, rv, rs1));
+      break;
+    default:
+      assert(!"unreachable");
     }
+    set_reg(block, rv, rd, cg_eax);
     break;
-    case 0b111: // REMU
-    {
-      // const uint32_t dividend = rv->X[rs1];
-      // const uint32_t divisor = rv->X[rs2];
-      // if (divisor == 0) {
-      //   rv->X[rd] = dividend;
-      // }
-      // else {
-      //   rv->X[rd] = dividend % divisor;
-      // }
-
-      // cant translate this instruction - terminate block
-      cg_mov_r32_i32(cg, cg_eax, pc);
-      set_pc(block, rv, cg_eax);
-      return false;
-
+  case 0b1110000:
+    switch (rm) {
+    case 0b000:  // FMV.X.W
+      // bit exact copy between register files
+      cg_movd_r32_xmm(cg, cg_eax, get_freg(block, rv, rs1));
+      break;
+    case 0b001:  // FCLASS.S
+      cg_movd_r32_xmm(cg, abi_arg1, get_freg(block, rv, rs1));
+      gen_call_helper(block, rv, rv_offset(rv, jit.helper_fclass));
+      break;
+    default:
+      assert(!"unreachable");
     }
+    set_reg(block, rv, rd, cg_eax);
     break;
+  case 0b1010000:
+  {
+    const cg_xmm_t src1 = get_freg(block, rv, rs1);
+    const cg_xmm_t src2 = get_freg(block, rv, rs2);
+    // note: all comparisons are false if either operand is a NaN
+    cg_xor_r32_r32(cg, cg_eax, cg_eax);
+    switch (rm) {
+    case 0b010:  // FEQ.S
+      cg_ucomiss_xmm_xmm(cg, src1, src2);
+      cg_setcc_r8(cg, cg_cc_eq, cg_al);
+      cg_mov_r32_i32(cg, cg_edx, 0);
+      cg_cmov_r32_r32(cg, cg_cc_p, cg_eax, cg_edx);
+      break;
+    case 0b001:  // FLT.S
+      cg_ucomiss_xmm_xmm(cg, src2, src1);
+      cg_setcc_r8(cg, cg_cc_ab, cg_al);
+      break;
+    case 0b000:  // FLE.S
+      cg_ucomiss_xmm_xmm(cg, src2, src1);
+      cg_setcc_r8(cg, cg_cc_ae, cg_al);
+      break;
     default:
       assert(!"unreachable");
+    }
+    set_reg(block, rv, rd, cg_eax);
+    break;
+  }
+  case 0b1101000:
+    get_reg(block, rv, cg_eax, rs1);
+    switch (rs2) {
+    case 0b00000:  // FCVT.S.W
+      cg_cvtsi2ss_xmm_r32(cg, set_freg(block, rv, rd), cg_eax);
+      break;
+    case 0b00001:  // FCVT.S.WU
+      // eax was zero extended into rax so convert it as a 64 bit value
+      cg_cvtsi2ss_xmm_r64(cg, set_freg(block, rv, rd), cg_rax);
       break;
+    default:
+      assert(!"unreachable");
     }
     break;
-#endif  // RISCV_VM_SUPPORT_RV32M
+  case 0b1111000:  // FMV.W.X
+    // bit exact copy between register files
+    get_reg(block, rv, cg_eax, rs1);
+    cg_movd_xmm_r32(cg, set_freg(block, rv, rd), cg_eax);
+    break;
   default:
     assert(!"unreachable");
-    break;
   }
-
-  // rv->X[rd] = rax
-  set_reg(block, rv, rd, cg_eax);
   // step over instruction
-  block->instructions += 1;
   block->pc_end += 4;
+  block->instructions += 1;
   // cant branch
   return true;
 }
 
-static bool op_lui(struct riscv_t *rv, uint32_t inst, struct block_t *block) {
+// emit rd = +/-(rs1 * rs2) +/- rs3
+// note: like the interpreter this rounds after both the multiply and the add
+static void gen_fmadd(struct riscv_t *rv, uint32_t inst, struct block_t *block,
+                      bool negate, bool subtract) {
 
   struct cg_state_t *cg = &block->cg;
 
-  // u-type decode
+  // r4-type decode
   const uint32_t rd  = dec_rd(inst);
-  const uint32_t val = dec_utype_imm(inst);
-  // rv->X[rd] = val;
-  if (rd != rv_reg_zero) {
-    cg_mov_r32_i32(cg, cg_eax, val);
-    set_reg(block, rv, rd, cg_eax);
+  const uint32_t rs1 = dec_rs1(inst);
+  const uint32_t rs2 = dec_rs2(inst);
+  const uint32_t rs3 = dec_r4type_rs3(inst);
+
+  const bool avx = (rv->jit.features & cg_feature_avx) != 0;
+  if (avx) {
+    cg_vmulss_xmm_xmm_xmm(cg, cg_xmm0, get_freg(block, rv, rs1),
+                          get_freg(block, rv, rs2));
+  }
+  else {
+    cg_movaps_xmm_xmm(cg, cg_xmm0, get_freg(block, rv, rs1));
+    cg_mulss_xmm_xmm(cg, cg_xmm0, get_freg(block, rv, rs2));
+  }
+  if (negate) {
+    cg_movd_r32_xmm(cg, cg_eax, cg_xmm0);
+    cg_xor_r32_i32(cg, cg_eax, FMASK_SIGN);
+    cg_movd_xmm_r32(cg, cg_xmm0, cg_eax);
+  }
+  const cg_xmm_t src3 = get_freg(block, rv, rs3);
+  if (avx) {
+    const cg_xmm_t dst = set_freg(block, rv, rd);
+    if (subtract) {
+      cg_vsubss_xmm_xmm_xmm(cg, dst, cg_xmm0, src3);
+    }
+    else {
+      cg_vaddss_xmm_xmm_xmm(cg, dst, cg_xmm0, src3);
+    }
+  }
+  else {
+    if (subtract) {
+      cg_subss_xmm_xmm(cg, cg_xmm0, src3);
+    }
+    else {
+      cg_addss_xmm_xmm(cg, cg_xmm0, src3);
+    }
+    cg_movaps_xmm_xmm(cg, set_freg(block, rv, rd), cg_xmm0);
   }
   // step over instruction
-  block->instructions += 1;
   block->pc_end += 4;
-  // cant branch
-  return true;
+  block->instructions += 1;
 }
 
-static bool op_branch(struct riscv_t *rv,
-                      uint32_t inst,
-                      struct block_t *block) {
+static bool op_madd(struct riscv_t *rv, uint32_t inst, struct block_t *block) {
+  // rv->F[rd] = rv->F[rs1] * rv->F[rs2] + rv->F[rs3]
+  gen_fmadd(rv, inst, block, false, false);
+  return true;
+}
 
-  struct cg_state_t *cg = &block->cg;
+static bool op_msub(struct riscv_t *rv, uint32_t inst, struct block_t *block) {
+  // rv->F[rd] = rv->F[rs1] * rv->F[rs2] - rv->F[rs3]
+  gen_fmadd(rv, inst, block, false, true);
+  return true;
+}
 
-  // the effective current PC
-  const uint32_t pc = block->pc_end;
-  // b-type decode
-  const uint32_t func3 = dec_funct3(inst);
-  const int32_t  imm   = dec_btype_imm(inst);
-  const uint32_t rs1   = dec_rs1(inst);
-  const uint32_t rs2   = dec_rs2(inst);
-  // perform the compare
-  get_reg(block, rv, cg_eax, rs1);
-  get_reg(block, rv, cg_ecx, rs2);
-  cg_cmp_r32_r32(cg, cg_eax, cg_ecx);
-  // load both targets
-  cg_mov_r32_i32(cg, cg_eax, pc + 4);
-  cg_mov_r32_i32(cg, cg_edx, pc + imm);
+static bool op_nmsub(struct riscv_t *rv, uint32_t inst, struct block_t *block) {
+  // rv->F[rd] = -(rv->F[rs1] * rv->F[rs2]) + rv->F[rs3]
+  gen_fmadd(rv, inst, block, true, false);
+  return true;
+}
 
-  // dispatch by branch type
-  switch (func3) {
-  case 0: // BEQ
-    cg_cmov_r32_r32(cg, cg_cc_eq, cg_eax, cg_edx);
-    break;
-  case 1: // BNE
-    cg_cmov_r32_r32(cg, cg_cc_ne, cg_eax, cg_edx);
-    break;
-  case 4: // BLT
-    cg_cmov_r32_r32(cg, cg_cc_lt, cg_eax, cg_edx);
-    break;
-  case 5: // BGE
-    cg_cmov_r32_r32(cg, cg_cc_ge, cg_eax, cg_edx);
-    break;
-  case 6: // BLTU
-    cg_cmov_r32_r32(cg, cg_cc_c, cg_eax, cg_edx);
-    break;
-  case 7: // BGEU
-    cg_cmov_r32_r32(cg, cg_cc_ae, cg_eax, cg_edx);
-    break;
-  default:
-    assert(!"unreachable");
-  }
-  // load PC with the target
-  set_pc(block, rv, cg_eax);
-  // step over instruction
-  block->instructions += 1;
-  block->pc_end += 4;
-  // could branch
-  return false;
+static bool op_nmadd(struct riscv_t *rv, uint32_t inst, struct block_t *block) {
+  // rv->F[rd] = -(rv->F[rs1] * rv->F[rs2]) - rv->F[rs3]
+  gen_fmadd(rv, inst, block, true, true);
+  return true;
 }
+#else
+#define op_load_fp  NULL
+#define op_store_fp NULL
+#define op_fp       NULL
+#define op_madd     NULL
+#define op_msub     NULL
+#define op_nmsub    NULL
+#define op_nmadd    NULL
+#endif  // RISCV_VM_SUPPORT_RV32F
 
-static bool op_jalr(struct riscv_t *rv, uint32_t inst, struct block_t *block) {
+// opcode handler type
+typedef bool(*opcode_t)(struct riscv_t *rv,
+                        uint32_t inst,
+                        struct block_t *block);
 
-  struct cg_state_t *cg = &block->cg;
+// opcode dispatch table
+static const opcode_t opcodes[] = {
+//  000        001          010       011          100        101       110   111
+    op_load,   op_load_fp,  NULL,     NULL,        op_op_imm, op_auipc, NULL, NULL, // 00
+    op_store,  op_store_fp, NULL,     NULL,        op_op,     op_lui,   NULL, NULL, // 01
+    op_madd,   op_msub,     op_nmsub, op_nmadd,    op_fp,     NULL,     NULL, NULL, // 10
+    op_branch, op_jalr,     NULL,     op_jal,      op_system, NULL,     NULL, NULL, // 11
+};
 
-  // the effective current PC
-  const uint32_t pc = block->pc_end;
-  // i-type decode
-  const uint32_t rd  = dec_rd(inst);
-  const uint32_t rs1 = dec_rs1(inst);
-  const int32_t  imm = dec_itype_imm(inst);
+// opcode table indices, i.e. bits [6:2] of an instruction
+enum {
+  opc_load     = 0x00,
+  opc_load_fp  = 0x01,
+  opc_op_imm   = 0x04,
+  opc_auipc    = 0x05,
+  opc_store    = 0x08,
+  opc_store_fp = 0x09,
+  opc_op       = 0x0c,
+  opc_lui      = 0x0d,
+  opc_op_fp    = 0x14,
+  opc_branch   = 0x18,
+  opc_jalr     = 0x19,
+  opc_jal      = 0x1b,
+  opc_system   = 0x1c,
+};
 
-  // jump
-  // note: we also clear the least significant bit of pc
-  get_reg(block, rv, cg_eax, rs1);
-  cg_add_r32_i32(cg, cg_eax, imm);
-  cg_and_r32_i32(cg, cg_eax, 0xfffffffe);
-  set_pc(block, rv, cg_eax);
+static uint32_t ir_opcode(uint32_t inst) {
+  return (inst & INST_6_2) >> 2;
+}
 
-  // link
-  if (rd != rv_reg_zero) {
-    cg_mov_r32_i32(cg, cg_eax, pc + 4);
-    set_reg(block, rv, rd, cg_eax);
+// return true if an instruction only computes a value for rd, so that it can
+// be skipped or replaced by its result
+static bool ir_is_pure(uint32_t inst) {
+  switch (ir_opcode(inst)) {
+  case opc_op_imm:
+  case opc_auipc:
+  case opc_op:
+  case opc_lui:
+    return true;
+  default:
+    return false;
   }
-
-#if RISCV_SUPPORT_MACHINE
-  // check for exception
-  // if (rv->PC & 0x3) {
-  //   raise_exception(rv, rv_except_inst_misaligned);
-  // }
-#endif
-
-  // step over instruction
-  block->instructions += 1;
-  block->pc_end += 4;
-  // could branch
-  return false;
 }
 
-static bool op_jal(struct riscv_t *rv, uint32_t inst, struct block_t *block) {
-
-  struct cg_state_t *cg = &block->cg;
-
-  // the effective current PC
-  const uint32_t pc = block->pc_end;
-  // j-type decode
-  const uint32_t rd  = dec_rd(inst);
-  const int32_t rel = dec_jtype_imm(inst);
-
-  // jump
-  // note: rel is aligned to a two byte boundary so we dont needs to do any
-  //       masking here.
-  cg_mov_r32_i32(cg, cg_eax, pc + rel);
-  set_pc(block, rv, cg_eax);
-
-  // link
-  if (rd != rv_reg_zero) {
-    cg_mov_r32_i32(cg, cg_eax, pc + 4);
-    set_reg(block, rv, rd, cg_eax);
+// return the integer register an instruction writes, or zero if it writes
+// none or might not
+static uint32_t ir_writes(uint32_t inst) {
+  switch (ir_opcode(inst)) {
+  case opc_load:
+  case opc_op_imm:
+  case opc_auipc:
+  case opc_op:
+  case opc_lui:
+  case opc_jalr:
+  case opc_jal:
+    return dec_rd(inst);
+  default:
+    return 0;
   }
+}
 
-#if RISCV_SUPPORT_MACHINE
-  // check alignment of PC
-  // if (rv->PC & 0x3) {
-  //   raise_exception(rv, rv_except_inst_misaligned);
-  // }
-#endif
+// return the integer registers an instruction might write as a bit mask
+static uint32_t ir_clobbers(uint32_t inst) {
+  switch (ir_opcode(inst)) {
+  case opc_op_fp:
+    // moves, compares and conversions to integer registers
+    return (1u << dec_rd(inst)) & ~1u;
+  case opc_system:
+    // the handlers can write any register
+    return ~1u;
+  default:
+    return (1u << ir_writes(inst)) & ~1u;
+  }
+}
 
-  // step over instruction
-  block->instructions += 1;
-  block->pc_end += 4;
-  // could branch
-  return false;
+// return the integer registers an instruction reads as a bit mask
+// note: this errs on the side of including registers that are not read
+static uint32_t ir_reads(const struct jit_insn_t *insn) {
+  if (insn->flags & (IR_CONST | IR_TARGET)) {
+    return 0;
+  }
+  const uint32_t rs1 = 1u << dec_rs1(insn->inst);
+  const uint32_t rs2 = 1u << dec_rs2(insn->inst);
+  switch (ir_opcode(insn->inst)) {
+  case opc_load:
+  case opc_load_fp:
+  case opc_op_imm:
+  case opc_store_fp:
+  case opc_op_fp:
+  case opc_jalr:
+    return rs1 & ~1u;
+  case opc_store:
+  case opc_op:
+  case opc_branch:
+    return (rs1 | rs2) & ~1u;
+  case opc_system:
+    // the handlers can read any register
+    return ~1u;
+  default:
+    return 0;
+  }
 }
 
-static bool op_system(struct riscv_t *rv,
-                      uint32_t inst,
-                      struct block_t *block) {
+// decode the guest instructions of a block starting at 'pc', deciding where
+// its trace goes, until it ends or 'limit' instructions have been decoded
+static void ir_decode(struct riscv_t *rv, uint32_t pc, uint32_t limit) {
+  struct riscv_jit_t *jit = &rv->jit;
+  jit->ir_count = 0;
+  jit->ir_links = 0;
+  jit->run_start = pc;
+  jit->num_runs = 0;
+  jit->loop = false;
+  for (; jit->ir_count < limit; ) {
+    // end the block at a code page boundary so that each block can be
+    // invalidated with the page it lies in
+    if (jit->ir_count &&
+        (pc >> RV_JIT_CODE_PAGE_BITS) !=
+          (jit->ir[0].pc >> RV_JIT_CODE_PAGE_BITS)) {
+      break;
+    }
+    const uint32_t inst = rv->io.mem_ifetch(rv, pc);
+    const uint32_t opcode = ir_opcode(inst);
+    // we dont have a handler for this instruction so end basic block
+    if (!opcodes[opcode]) {
+      break;
+    }
+    // CSR accesses are left to the emulator
+    if (opcode == opc_system && dec_funct3(inst) != 0) {
+      break;
+    }
+    struct jit_insn_t *insn = &jit->ir[jit->ir_count++];
+    insn->pc = pc;
+    insn->inst = inst;
+    insn->flags = 0;
+    insn->value = 0;
+    uint32_t next = pc + 4;
+    switch (opcode) {
+    case opc_branch: {
+      // continue the trace along the likely side of the branch, taking a
+      // side exit for the other.  without a profile we assume backward
+      // branches are taken and forward branches are not.
+      const int32_t imm = dec_btype_imm(inst);
+      if (trace_can_continue(jit) && imm >= 0) {
+        jit->ir_links += 1;
+      }
+      else if (imm < 0 && pc + imm == jit->ir[0].pc) {
+        insn->flags |= IR_END | IR_LOOP;
+        jit->loop = true;
+      }
+      else if (imm < 0 && trace_can_follow(jit, next, pc + imm)) {
+        jit->ir_links += 1;
+        trace_follow(jit, next, pc + imm);
+        insn->flags |= IR_FOLLOW;
+        next = pc + imm;
+      }
+      else {
+        insn->flags |= IR_END;
+      }
+      break;
+    }
+    case opc_jal: {
+      const int32_t rel = dec_jtype_imm(inst);
+      if (rel < 0 && pc + rel == jit->ir[0].pc && dec_rd(inst) == 0) {
+        insn->flags |= IR_END | IR_LOOP;
+        jit->loop = true;
+      }
+      else if (trace_can_follow(jit, next, pc + rel)) {
+        // the code a return comes back to is an exit too
+        if (is_link_reg(dec_rd(inst))) {
+          jit->ir_links += 1;
+        }
+        trace_follow(jit, next, pc + rel);
+        insn->flags |= IR_FOLLOW;
+        next = pc + rel;
+      }
+      else {
+        insn->flags |= IR_END;
+      }
+      break;
+    }
+    case opc_jalr:
+    case opc_system:
+      insn->flags |= IR_END;
+      break;
+    }
+    if (insn->flags & IR_END) {
+      break;
+    }
+    pc = next;
+  }
+  jit->ir_next = pc;
+}
 
-  struct cg_state_t *cg = &block->cg;
+// return true if an instruction copies one register to another, i.e. is mv
+static bool ir_is_move(uint32_t inst, uint32_t *src) {
+  const uint32_t rs1 = dec_rs1(inst);
+  const uint32_t rs2 = dec_rs2(inst);
+  switch (ir_opcode(inst)) {
+  case opc_op_imm:
+    // addi rd, rs1, 0
+    *src = rs1;
+    return dec_funct3(inst) == 0 && dec_itype_imm(inst) == 0;
+  case opc_op:
+    // add rd, rs1, x0 or add rd, x0, rs2
+    *src = rs1 | rs2;
+    return dec_funct3(inst) == 0 && dec_funct7(inst) == 0 &&
+           (rs1 == rv_reg_zero || rs2 == rv_reg_zero);
+  default:
+    return false;
+  }
+}
 
-  // the effective current PC
-  const uint32_t pc = block->pc_end;
-  // i-type decode
-  const int32_t  imm    = dec_itype_imm(inst);
-  const int32_t  csr    = dec_csr(inst);
-  const uint32_t funct3 = dec_funct3(inst);
-  const uint32_t rs1    = dec_rs1(inst);
-  const uint32_t rd     = dec_rd(inst);
+// copy propagation
+//
+// reads of a register holding a copy of another are rewritten to read the
+// original, which leaves the copy dead if it is overwritten before the block
+// exits.
+static void ir_copy_prop(struct riscv_jit_t *jit) {
+  // the register each register holds a copy of, or itself
+  uint8_t copy[RV_NUM_REGS];
+  for (uint32_t i = 0; i < RV_NUM_REGS; ++i) {
+    copy[i] = (uint8_t)i;
+  }
+  for (uint32_t i = 0; i < jit->ir_count; ++i) {
+    struct jit_insn_t *insn = &jit->ir[i];
+    const uint32_t rs1 = dec_rs1(insn->inst);
+    const uint32_t rs2 = dec_rs2(insn->inst);
+    switch (ir_opcode(insn->inst)) {
+    case opc_store:
+    case opc_op:
+    case opc_branch:
+      insn->inst = (insn->inst & ~FR_RS2) | ((uint32_t)copy[rs2] << 20);
+      // fall through
+    case opc_load:
+    case opc_load_fp:
+    case opc_op_imm:
+    case opc_store_fp:
+      insn->inst = (insn->inst & ~FR_RS1) | ((uint32_t)copy[rs1] << 15);
+      break;
+    }
+    // note: jalr is left alone as its registers tell calls from returns
+    // nothing is a copy of a register once it is written
+    const uint32_t clobbers = ir_clobbers(insn->inst);
+    for (uint32_t r = 1; r < RV_NUM_REGS; ++r) {
+      if (clobbers & ((1u << r) | (1u << copy[r]))) {
+        copy[r] = (uint8_t)r;
+      }
+    }
+    uint32_t src;
+    const uint32_t rd = dec_rd(insn->inst);
+    if (rd != rv_reg_zero && ir_is_move(insn->inst, &src) && src != rd) {
+      copy[rd] = (uint8_t)src;
+    }
+  }
+}
 
-  // arg1 - rv
-  cg_mov_r64_r64(cg, cg_rcx, cg_rsi);
-  // arg2 - pc
-  cg_mov_r32_i32(cg, cg_edx, pc);
-  // arg3 - instruction
-  cg_mov_r64_i32(cg, cg_r8, inst);
+// compute the result of an instruction from its known operands, returning
+// false if it cannot be known during translation
+static bool ir_eval(const struct jit_insn_t *insn, uint32_t known,
+                    const uint32_t *value, uint32_t *out) {
+  const uint32_t inst = insn->inst;
+  const uint32_t rs1 = dec_rs1(inst);
+  const uint32_t rs2 = dec_rs2(inst);
+  const uint32_t a = value[rs1];
+  const uint32_t b = value[rs2];
+  switch (ir_opcode(inst)) {
+  case opc_lui:
+    *out = dec_utype_imm(inst);
+    return true;
+  case opc_auipc:
+    *out = insn->pc + dec_utype_imm(inst);
+    return true;
+  case opc_jal:
+  case opc_jalr:
+    *out = insn->pc + 4;
+    return true;
+  case opc_op_imm: {
+    if (!(known & (1u << rs1))) {
+      return false;
+    }
+    const int32_t imm = dec_itype_imm(inst);
+    switch (dec_funct3(inst)) {
+    case 0: *out = a + imm; break;
+    case 1: *out = a << (imm & 0x1f); break;
+    case 2: *out = ((int32_t)a < imm) ? 1 : 0; break;
+    case 3: *out = (a < (uint32_t)imm) ? 1 : 0; break;
+    case 4: *out = a ^ imm; break;
+    case 5:
+      *out = (imm & ~0x1f) ? (uint32_t)((int32_t)a >> (imm & 0x1f))
+                           : a >> (imm & 0x1f);
+      break;
+    case 6: *out = a | imm; break;
+    case 7: *out = a & imm; break;
+    }
+    return true;
+  }
+  case opc_op:
+    if ((known & (1u << rs1)) == 0 || (known & (1u << rs2)) == 0) {
+      return false;
+    }
+    switch (dec_funct7(inst)) {
+    case 0b0000000:
+      switch (dec_funct3(inst)) {
+      case 0: *out = a + b; break;
+      case 1: *out = a << (b & 0x1f); break;
+      case 2: *out = ((int32_t)a < (int32_t)b) ? 1 : 0; break;
+      case 3: *out = (a < b) ? 1 : 0; break;
+      case 4: *out = a ^ b; break;
+      case 5: *out = a >> (b & 0x1f); break;
+      case 6: *out = a | b; break;
+      case 7: *out = a & b; break;
+      }
+      return true;
+    case 0b0100000:
+      switch (dec_funct3(inst)) {
+      case 0: *out = a - b; return true;
+      case 5: *out = (uint32_t)((int32_t)a >> (b & 0x1f)); return true;
+      }
+      return false;
+#if RISCV_VM_SUPPORT_RV32M
+    case 0b0000001:
+      switch (dec_funct3(inst)) {
+      case 0: *out = a * b; return true;
+      case 3: *out = (uint32_t)(((uint64_t)a * b) >> 32); return true;
+      }
+      // leave the signed and dividing cases to the translated code
+      return false;
+#endif  // RISCV_VM_SUPPORT_RV32M
+    }
+    return false;
+  default:
+    return false;
+  }
+}
 
-  int32_t offset;
+// constant propagation
+//
+// registers set by lui, auipc and arithmetic on other known registers are
+// tracked along the trace.  pure instructions with a known result become a
+// single move of that result, which also leaves the instructions feeding them
+// dead, and a jalr whose target is known becomes a chainable direct exit.
+static void ir_const_prop(struct riscv_jit_t *jit) {
+  uint32_t known = 1u << rv_reg_zero;
+  uint32_t value[RV_NUM_REGS] = {0};
+  for (uint32_t i = 0; i < jit->ir_count; ++i) {
+    struct jit_insn_t *insn = &jit->ir[i];
+    const uint32_t rs1 = dec_rs1(insn->inst);
+    if (ir_opcode(insn->inst) == opc_jalr && (known & (1u << rs1))) {
+      insn->flags |= IR_TARGET;
+      insn->value = (value[rs1] + dec_itype_imm(insn->inst)) & ~1u;
+    }
+    const uint32_t rd = ir_writes(insn->inst);
+    uint32_t result;
+    if (rd != rv_reg_zero && ir_eval(insn, known, value, &result)) {
+      if (ir_is_pure(insn->inst)) {
+        insn->flags |= IR_CONST;
+        insn->value = result;
+      }
+      known |= 1u << rd;
+      value[rd] = result;
+    }
+    else {
+      known &= ~ir_clobbers(insn->inst);
+    }
+  }
+}
 
-  // dispatch by func3 field
-  switch (funct3) {
-  case 0:
-    // dispatch from imm field
-    switch (imm) {
-    case 0: // ECALL
-      offset = rv_offset(rv, io.on_ecall);
-      cg_call_r64disp(cg, cg_rsi, offset);
-      break;
-    case 1: // EBREAK
-      offset = rv_offset(rv, io.on_ebreak);
-      cg_call_r64disp(cg, cg_rsi, offset);
+// dead write elimination
+//
+// working backwards, a pure instruction whose result is overwritten before
+// anything reads it is skipped.  every register is visible once the block is
+// left so nothing written before a side exit can be skipped.
+static void ir_dead_writes(struct riscv_jit_t *jit) {
+  uint32_t live = ~0u;
+  for (uint32_t i = jit->ir_count; i-- > 0;) {
+    struct jit_insn_t *insn = &jit->ir[i];
+    const uint32_t opcode = ir_opcode(insn->inst);
+    if (opcode == opc_branch || (insn->flags & IR_END)) {
+      live = ~0u;
+    }
+    const uint32_t rd = ir_writes(insn->inst);
+    if (rd != rv_reg_zero && ir_is_pure(insn->inst) &&
+        !(live & (1u << rd))) {
+      insn->flags |= IR_DEAD;
+      continue;
+    }
+    live &= ~(1u << rd);
+    live |= ir_reads(insn);
+  }
+}
+
+// run the enabled optimization passes over the decoded block
+static void ir_optimize(struct riscv_jit_t *jit) {
+  if (jit->passes & rv_jit_pass_copy_prop) {
+    ir_copy_prop(jit);
+  }
+  if (jit->passes & rv_jit_pass_const_prop) {
+    ir_const_prop(jit);
+  }
+  if (jit->passes & rv_jit_pass_dead_write) {
+    ir_dead_writes(jit);
+  }
+}
+
+// return how many instructions ahead of the one being translated a guest
+// register is next used, or UINT32_MAX if its value is not needed again
+static uint32_t ir_next_use(const struct riscv_jit_t *jit, uint32_t guest) {
+  // a loop carries on at its first instruction after its last
+  const uint32_t end = jit->ir_count + (jit->loop ? jit->ir_pos : 0);
+  for (uint32_t n = jit->ir_pos; n < end; ++n) {
+    const struct jit_insn_t *insn = &jit->ir[n % jit->ir_count];
+    if (insn->flags & IR_DEAD) {
+      continue;
+    }
+    // the registers of the current instruction are all in use
+    if ((ir_reads(insn) & (1u << guest)) ||
+        (n == jit->ir_pos && ir_writes(insn->inst) == guest)) {
+      return n - jit->ir_pos;
+    }
+    if (ir_clobbers(insn->inst) & (1u << guest)) {
       break;
-    default:
-      assert(!"unreachable");
     }
-    break;
-  case 1:
-  case 2:
-  case 3:
-    // TODO: CSRRW, CSRRS, CSRRC
-    break;
-  default:
-    // cant translate this instruction - terminate block
-    cg_mov_r32_i32(cg, cg_eax, pc);
-    set_pc(block, rv, cg_eax);
-    return false;
   }
+  return UINT32_MAX;
+}
 
-  // step over instruction
-  block->instructions += 1;
-  block->pc_end += 4;
+// load the guest registers a loop reads before writing them into host
+// registers ahead of its first iteration, so that they stay there across
+// iterations, and mark the start of the loop
+static void gen_loop_head(struct block_t *block, struct riscv_t *rv) {
+  struct riscv_jit_t *jit = &rv->jit;
+  struct jit_regs_t *regs = &jit->regs;
+  uint32_t written = 0;
+  uint32_t loaded = 0;
+  for (uint32_t i = 0; i < jit->ir_count && loaded < regs->pool_size; ++i) {
+    const struct jit_insn_t *insn = &jit->ir[i];
+    if (insn->flags & IR_DEAD) {
+      continue;
+    }
+    const uint32_t inputs = ir_reads(insn) & ~written;
+    for (uint32_t r = 1; r < RV_NUM_REGS && loaded < regs->pool_size; ++r) {
+      if ((inputs & (1u << r)) && regs->host[r] < 0) {
+        regs_read(block, rv, regs, r);
+        loaded += 1;
+      }
+    }
+    written |= ir_clobbers(insn->inst);
+  }
+  memcpy(jit->loop_regs, regs->guest, sizeof(jit->loop_regs));
+  jit->loop_head = block->cg.head;
+}
 
-  // XXX: assume we wont branch for now but will need to be updated later
+// generate code for the decoded instructions of a block, returning false if
+// the code buffer runs out or an instruction can't be encoded first
+static bool ir_emit(struct riscv_t *rv, struct block_t *block) {
+  struct riscv_jit_t *jit = &rv->jit;
+  // no guest registers are held in host registers on entry
+  regs_reset(jit);
+  jit->retired = 0;
+  jit->ir_pos = 0;
+  if (jit->loop) {
+    gen_loop_head(block, rv);
+  }
+  // each iteration of a loop counts as an execution
+  if (jit->profile) {
+    gen_exec_count(block, rv);
+  }
+  for (jit->ir_pos = 0; jit->ir_pos < jit->ir_count; ++jit->ir_pos) {
+    const struct jit_insn_t *insn = &jit->ir[jit->ir_pos];
+    if ((size_t)(block->cg.end - block->cg.head) < code_headroom) {
+      return false;
+    }
+    block->pc_end = insn->pc;
+    if (insn->flags & IR_DEAD) {
+      block->instructions += 1;
+      continue;
+    }
+    if (insn->flags & IR_CONST) {
+      const uint32_t rd = dec_rd(insn->inst);
+      cg_mov_r32_i32(&block->cg, regs_write(block, rv, &jit->regs, rd),
+                     insn->value);
+      block->instructions += 1;
+      continue;
+    }
+    const opcode_t op = opcodes[ir_opcode(insn->inst)];
+    const bool more = op(rv, insn->inst, block);
+    // a label jump didn't reach so leave this instruction out of the block
+    if (block->cg.error) {
+      return false;
+    }
+    if (!more) {
+      return true;
+    }
+  }
+  // the trace was cut short so carry on where it stopped
+  block->pc_end = jit->ir_next;
+  gen_fallback(block, rv);
+  // note: the fallback exit only jumps over a fixed size stub
+  assert(!block->cg.error);
   return true;
 }
 
-// opcode handler type
-typedef bool(*opcode_t)(struct riscv_t *rv,
-                        uint32_t inst,
-                        struct block_t *block);
+static void rv_translate_block(struct riscv_t *rv, struct block_t *block,
+                               uint32_t pc) {
+  assert(rv && block);
+  struct riscv_jit_t *jit = &rv->jit;
+  uint32_t limit = RV_JIT_MAX_INSNS;
+  for (;;) {
+    // setup the basic block
+    block->instructions = 0;
+    block->pc_start = pc;
+    block->pc_end = pc;
+    ir_decode(rv, pc, limit);
+    ir_optimize(jit);
+    if (ir_emit(rv, block)) {
+      break;
+    }
+    // we ran out of code buffer, or couldn't encode an instruction, so start
+    // again with the instructions before it, as the passes must not assume
+    // the rest will run
+    limit = jit->ir_pos;
+    block_place(jit, block, block->code);
+  }
+}
 
-// opcode dispatch table
-static const opcode_t opcodes[] = {
-//  000        001          010       011          100        101       110   111
-    op_load,   NULL,        NULL,     NULL,        op_op_imm, op_auipc, NULL, NULL, // 00
-    op_store,  NULL,        NULL,     NULL,        op_op,     op_lui,   NULL, NULL, // 01
-    NULL,      NULL,        NULL,     NULL,        NULL,      NULL,     NULL, NULL, // 10
-    op_branch, op_jalr,     NULL,     op_jal,      op_system, NULL,     NULL, NULL, // 11
-};
+// background translator thread body
+static void worker_run(struct jit_worker_t *w) {
+  struct riscv_t *rv = w->rv;
+  for (;;) {
+    // sleep until there is a job to do
+    worker_lock(w);
+    while (!w->quit && w->done == sys_load_acquire(&w->queued)) {
+      worker_wait(w);
+    }
+    const bool quit = w->quit;
+    worker_unlock(w);
+    if (quit) {
+      break;
+    }
+    // translate past the end of the previous job
+    struct jit_job_t *job = &w->jobs[w->done % RV_JIT_QUEUE_SIZE];
+    struct block_t *block = block_place(&rv->jit, w->blocks_head, w->head);
+    if (block) {
+      rv_translate_block(rv, block, job->pc);
+      w->blocks_head = block + 1;
+      w->head = block->code + cg_size(&block->cg);
+      sys_flush_icache(block->code, cg_size(&block->cg));
+    }
+    job->block = block;
+    // hand the job back to the guest thread
+    worker_lock(w);
+    sys_store_release(&w->done, w->done + 1);
+    worker_signal(w);
+    worker_unlock(w);
+  }
+}
 
-static void rv_translate_block(struct riscv_t *rv, struct block_t *block) {
-  assert(rv && block);
+#ifdef _WIN32
+static DWORD WINAPI worker_main(LPVOID arg) {
+  worker_run(arg);
+  return 0;
+}
+#endif
+#ifdef __linux__
+static void *worker_main(void *arg) {
+  worker_run(arg);
+  return NULL;
+}
+#endif
 
-  struct cg_state_t *cg = &block->cg;
+// start the background translator
+static struct jit_worker_t *worker_create(struct riscv_t *rv) {
+  struct jit_worker_t *w = malloc(sizeof(struct jit_worker_t));
+  memset(w, 0, sizeof(struct jit_worker_t));
+  w->rv = rv;
+  w->blocks_head = rv->jit.blocks_head;
+  w->head = rv->jit.head;
+#ifdef _WIN32
+  InitializeCriticalSection(&w->lock);
+  InitializeConditionVariable(&w->wake);
+  w->thread = CreateThread(NULL, 0, worker_main, w, 0, NULL);
+  if (w->thread == NULL) {
+    DeleteCriticalSection(&w->lock);
+    free(w);
+    return NULL;
+  }
+#endif
+#ifdef __linux__
+  pthread_mutex_init(&w->lock, NULL);
+  pthread_cond_init(&w->wake, NULL);
+  if (pthread_create(&w->thread, NULL, worker_main, w) != 0) {
+    pthread_cond_destroy(&w->wake);
+    pthread_mutex_destroy(&w->lock);
+    free(w);
+    return NULL;
+  }
+#endif
+  return w;
+}
 
-  // setup the basic block
-  block->instructions = 0;
-  block->pc_start = rv->PC;
-  block->pc_end = rv->PC;
+// stop the background translator and discard any queued jobs
+static void worker_destroy(struct riscv_jit_t *jit) {
+  struct jit_worker_t *w = jit->worker;
+  worker_drain(jit);
+  worker_lock(w);
+  w->quit = true;
+  worker_signal(w);
+  worker_unlock(w);
+#ifdef _WIN32
+  WaitForSingleObject(w->thread, INFINITE);
+  CloseHandle(w->thread);
+  DeleteCriticalSection(&w->lock);
+#endif
+#ifdef __linux__
+  pthread_join(w->thread, NULL);
+  pthread_cond_destroy(&w->wake);
+  pthread_mutex_destroy(&w->lock);
+#endif
+  free(w);
+  jit->worker = NULL;
+}
 
-  // prologue
-  gen_prologue(block, rv);
+// queue a block for the background translator
+// note: returns false if the queue is full or the block is already queued
+static bool worker_queue(struct riscv_jit_t *jit, uint32_t pc,
+                         bool speculative) {
+  struct jit_worker_t *w = jit->worker;
+  if (w->queued - w->installed >= RV_JIT_QUEUE_SIZE) {
+    return false;
+  }
+  for (uint32_t i = w->installed; i != w->queued; ++i) {
+    if (w->jobs[i % RV_JIT_QUEUE_SIZE].pc == pc) {
+      return false;
+    }
+  }
+  struct jit_job_t *job = &w->jobs[w->queued % RV_JIT_QUEUE_SIZE];
+  job->pc = pc;
+  job->speculative = speculative;
+  job->stale = false;
+  job->block = NULL;
+  // stores to this page from now on will mark the job as stale
+  code_page_mark(jit, pc);
+  worker_lock(w);
+  sys_store_release(&w->queued, w->queued + 1);
+  worker_signal(w);
+  worker_unlock(w);
+  return true;
+}
 
-  // translate the basic block
-  for (;;) {
-    // fetch the next instruction
-    const uint32_t inst = rv->io.mem_ifetch(rv, block->pc_end);
-    const uint32_t index = (inst & INST_6_2) >> 2;
-    // find translation function
-    const opcode_t op = opcodes[index];
-    if (!op) {
-      // we dont have a handler for this instruction so end basic block
-      // make sure PC gets updated
-      cg_mov_r32_i32(cg, cg_eax, block->pc_end);
-      set_pc(block, rv, cg_eax);
-      break;
+// queue the successors of a block before the guest reaches them
+static void worker_speculate(struct riscv_t *rv, const struct block_t *block) {
+  struct riscv_jit_t *jit = &rv->jit;
+  struct jit_worker_t *w = jit->worker;
+  // the memory map is needed to know that a target can be fetched
+  if (!rv->mem_map) {
+    return;
+  }
+  for (uint32_t i = 0; i < block->num_links; ++i) {
+    // keep room in the queue for blocks the guest is waiting on
+    if (w->queued - w->installed >= RV_JIT_QUEUE_SIZE / 2) {
+      return;
     }
-    if (!op(rv, inst, block)) {
-      break;
+    const uint32_t target = block->links[i].target;
+    if ((target & 3) || !rv->mem_map[target >> RV_MEM_CHUNK_BITS] ||
+        block_find(jit, target)) {
+      continue;
     }
+    worker_queue(jit, target, true);
   }
+}
 
-  // epilogue
-  gen_epilogue(block, rv);
-  cg_ret(cg);
+// install the blocks the background translator has finished
+static void worker_install(struct riscv_t *rv) {
+  struct riscv_jit_t *jit = &rv->jit;
+  struct jit_worker_t *w = jit->worker;
+  const uint32_t done = sys_load_acquire(&w->done);
+  bool full = false;
+  for (; w->installed != done; ++w->installed) {
+    const struct jit_job_t *job = &w->jobs[w->installed % RV_JIT_QUEUE_SIZE];
+    struct block_t *block = job->block;
+    if (!block) {
+      full = true;
+      continue;
+    }
+    if (job->stale) {
+      // step over the code so it is cleared by the next flush
+      jit->blocks_head = block + 1;
+      jit->head = block->code + cg_size(&block->cg);
+      continue;
+    }
+    if (!block_finish(jit, block)) {
+      continue;
+    }
+    jit->stats.translations += 1;
+    if (block_dir_retired(jit, block->pc_start)) {
+      jit->stats.retranslations += 1;
+    }
+    if (job->speculative) {
+      jit->stats.speculative += 1;
+    }
+    else {
+      worker_speculate(rv, block);
+    }
+  }
+  // the worker ran out of space so flush and let the guest queue its blocks
+  // again when it next reaches them
+  if (full) {
+    code_cache_flush(jit);
+  }
 }
 
 struct block_t *block_find_or_translate(struct riscv_t *rv,
                                         struct block_t *prev) {
   // lookup the next block in the block map
   struct block_t *next = block_find(&rv->jit, rv->PC);
-  // translate if we didnt find one
+  // translate if we didnt find one and it is hot enough
   if (!next) {
-    next = block_alloc(&rv->jit);
+    struct riscv_jit_t *jit = &rv->jit;
+    if (!block_dir_count(jit, rv->PC)) {
+      return NULL;
+    }
+    // let the background translator do the work while we interpret
+    if (jit->worker) {
+      worker_queue(jit, rv->PC, false);
+      return NULL;
+    }
+    const uint32_t epoch = jit->epoch;
+    next = block_alloc(jit);
     assert(next);
-    rv_translate_block(rv, next);
-    block_finish(&rv->jit, next);
+    rv_translate_block(rv, next, rv->PC);
+    if (!block_finish(jit, next)) {
+      return NULL;
+    }
+    jit->stats.translations += 1;
+    if (block_dir_retired(jit, next->pc_start)) {
+      jit->stats.retranslations += 1;
+    }
+    // prev is gone if the code cache was flushed to make room
+    if (jit->epoch != epoch) {
+      prev = NULL;
+    }
     // update the block predictor
     // note: if the block predictor gives us a win when we
     //       translate a new block but gives us a huge penalty when
@@ -902,72 +3567,667 @@ struct block_t *block_find_or_translate(struct riscv_t *rv,
       prev->predict = next;
     }
   }
-  assert(next);
   return next;
 }
 
 bool rv_step_jit(struct riscv_t *rv, const uint64_t cycles_target) {
 
-  // find or translate a block for our starting PC
-  struct block_t *block = block_find_or_translate(rv, NULL);
-  assert(block);
+  struct riscv_jit_t *jit = &rv->jit;
+
+  // translated code will return to us when it reaches the cycle target
+  jit->cycles_target = cycles_target;
+
+  // the block we last returned from
+  struct block_t *prev = NULL;
 
   // loop until we hit out cycle target
-  while (rv->csr_cycle < cycles_target) {
+  while (rv->csr_cycle < cycles_target && !rv->exception) {
+
+    struct block_t *block = NULL;
+
+    // pick up any blocks the background translator has finished
+    struct jit_worker_t *w = jit->worker;
+    if (w && w->installed != sys_load_acquire(&w->done)) {
+      const uint32_t epoch = jit->epoch;
+      worker_install(rv);
+      if (jit->epoch != epoch) {
+        prev = NULL;
+      }
+    }
 
     // try to predict the next block
     // note: block predition gives us ~100 MIPS boost.
-    if (block->predict && block->predict->pc_start == rv->PC) {
-      block = block->predict;
+    if (prev && prev->predict && prev->predict->pc_start == rv->PC) {
+      block = prev->predict;
     }
     else {
       // lookup the next block in the block map or translate a new block
-      struct block_t *next = block_find_or_translate(rv, block);
-      // move onto the next block
-      block = next;
+      block = block_find_or_translate(rv, prev);
     }
 
-    // we should have a block by now
-    assert(block);
-
-    // call the translated block
-    typedef void(*call_block_t)(struct riscv_t *);
-    call_block_t c = (call_block_t)block->code;
-    c(rv);
-
-    // increment the cycles csr
-    rv->csr_cycle += block->instructions;
+    // if the block is not hot enough to translate yet then interpret it
+    if (!block) {
+      jit->exit_link = NULL;
+      jit->stats.interpreted += 1;
+      return false;
+    }
 
     // if this block has no instructions we cant make forward progress so
     // must fallback to instruction emulation
     if (!block->instructions) {
+      jit->exit_link = NULL;
+      block->fallbacks += 1;
       return false;
     }
+
+    // for an exact cycle count, interpret the block if it would overshoot
+    // and otherwise return early enough that no block we chain to can
+    // overshoot either.  the largest block may have changed since last time.
+    if (jit->exact) {
+      if (rv->csr_cycle + block->instructions > cycles_target) {
+        jit->exit_link = NULL;
+        block->fallbacks += 1;
+        return false;
+      }
+      const uint64_t margin = jit->max_instructions;
+      jit->cycles_target = (cycles_target > margin) ? cycles_target - margin : 0;
+    }
+
+    // chain the exit we returned from directly to this block
+    struct block_link_t *link = jit->exit_link;
+    if (link && link->target == block->pc_start) {
+      block_link(link, block);
+    }
+    // or add it to the inline cache of the indirect jump we left by
+    else if (jit->exit_block && jit->exit_block->ic_size) {
+      block_ic_fill(jit->exit_block, block);
+    }
+
+    // execute translated code until we return to the dispatcher
+    jit->exit_link = NULL;
+    jit->exit_block = NULL;
+    jit->enter(rv, block->code);
+
+    // find out which block we returned from
+    prev = jit->exit_link ? jit->exit_link->block : jit->exit_block;
   }
 
   // hit our cycle target
   return true;
 }
 
+// code cache file layout
+//
+//   header
+//   live blocks    uint32_t[num_blocks], as indices of block headers
+//   code pages     struct jit_cache_page_t[num_pages]
+//   block headers  struct block_t[num_headers]
+//   code           the code buffer from block_start to head
+//
+// translated code only refers to the rv struct through abi_rv, to its own
+// block with rip relative addressing and to the trampolines and other blocks
+// with rel32 jumps, so it runs unchanged wherever the code buffer lies as long
+// as it keeps its offset within the buffer and the headers keep theirs.  only
+// the pointers held in the block headers need to be rebased when it is
+// loaded.
+struct jit_cache_header_t {
+  char magic[8];
+  // identifies the build of the translator that wrote the file
+  uint64_t build;
+  // identifies the guest program, as given by the user
+  uint64_t key;
+  // address of the code buffer when the file was written
+  uint64_t base;
+  uint32_t block_start;
+  uint32_t head;
+  // end of the counters in use, as an offset from the code buffer
+  uint32_t counters_head;
+  // block headers in use, including those of dead blocks
+  uint32_t num_headers;
+  // blocks that were in the block directory
+  uint32_t num_blocks;
+  // guest code pages the blocks were translated from
+  uint32_t num_pages;
+};
+
+// a guest code page and a hash of its contents when the file was written
+struct jit_cache_page_t {
+  uint32_t page;
+  uint32_t pad;
+  uint64_t hash;
+};
+
+static const char jit_cache_magic[8] = "rvjit02";
+
+// fnv-1a hash
+static uint64_t hash_bytes(uint64_t hash, const void *data, size_t size) {
+  const uint8_t *ptr = data;
+  for (size_t i = 0; i < size; ++i) {
+    hash = (hash ^ ptr[i]) * 0x100000001b3ull;
+  }
+  return hash;
+}
+
+// return an id for this build of the translator
+// note: the build time is included as any change to code generation will
+//       invalidate old cache files
+static uint64_t jit_cache_build(const struct riscv_t *rv) {
+  const struct riscv_jit_t *jit = &rv->jit;
+  static const char stamp[] = __DATE__ " " __TIME__;
+  const uint32_t sizes[] = {
+    (uint32_t)sizeof(struct riscv_t),
+    (uint32_t)sizeof(struct block_t),
+    (uint32_t)(jit->end - jit->start),
+    (uint32_t)(jit->block_start - jit->start),
+    // code using extensions the host lacks would fault
+    jit->features,
+    // blocks that dont count their executions would be missing from profiles
+    jit->profile,
+    // direct memory accesses would read through a missing memory map
+    rv->mem_map != NULL,
+    // the settings that decide what the translated code looks like
+    jit->exact,
+    jit->passes,
+  };
+  uint64_t hash = hash_bytes(0xcbf29ce484222325ull, stamp, sizeof(stamp));
+  return hash_bytes(hash, sizes, sizeof(sizes));
+}
+
+// hash the current contents of a guest code page
+static uint64_t jit_cache_page_hash(struct riscv_t *rv, uint32_t page) {
+  uint64_t hash = 0xcbf29ce484222325ull;
+  const uint32_t addr = page << RV_JIT_CODE_PAGE_BITS;
+  for (uint32_t i = 0; i < (1u << RV_JIT_CODE_PAGE_BITS); i += 4) {
+    const uint32_t inst = rv->io.mem_ifetch(rv, addr + i);
+    hash = hash_bytes(hash, &inst, sizeof(inst));
+  }
+  return hash;
+}
+
+// move the pointers held by loaded block headers by 'delta' bytes
+#define REBASE(PTR) \
+  if (PTR) { (PTR) = (void *)((uintptr_t)(PTR) + delta); }
+
+static void jit_cache_rebase_link(struct block_link_t *link, intptr_t delta) {
+  REBASE(link->block);
+  REBASE(link->patch);
+  REBASE(link->succ);
+  REBASE(link->next);
+  REBASE(link->guard);
+}
+
+static void jit_cache_rebase(struct block_t *block, intptr_t delta) {
+  REBASE(block->predict);
+  REBASE(block->incoming);
+  REBASE(block->ic_count);
+  REBASE(block->ras_count);
+  REBASE(block->exec_count);
+  for (uint32_t i = 0; i < block->num_links; ++i) {
+    jit_cache_rebase_link(&block->links[i], delta);
+  }
+  for (uint32_t i = 0; i < block->ic_size; ++i) {
+    jit_cache_rebase_link(&block->ic[i], delta);
+  }
+  block->code += delta;
+  block->cg.start += delta;
+  block->cg.end += delta;
+  block->cg.head += delta;
+}
+#undef REBASE
+
+uint32_t rv_translate_jit_blocks(struct riscv_t *rv, const uint32_t *addrs,
+                                 uint32_t count) {
+  assert(rv && (addrs || !count));
+  struct riscv_jit_t *jit = &rv->jit;
+  if (jit->start == NULL) {
+    return 0;
+  }
+  // addresses to visit, breadth first so code near the roots comes first
+  uint32_t size = count + RV_JIT_MAX_LINKS;
+  uint32_t *todo = malloc(size * sizeof(uint32_t));
+  if (!todo) {
+    return 0;
+  }
+  memcpy(todo, addrs, count * sizeof(uint32_t));
+  worker_drain(jit);
+  // leave room for the blocks that can only be found at runtime
+  const uint8_t *limit = jit->start + (jit->end - jit->start) / 4 * 3;
+  uint32_t next = 0;
+  uint32_t translated = 0;
+  while (next < count && jit->head < limit) {
+    const uint32_t pc = todo[next++];
+    // skip anything that cant be fetched or is already translated
+    if ((pc & 3) ||
+        (rv->mem_map && !rv->mem_map[pc >> RV_MEM_CHUNK_BITS]) ||
+        block_find(jit, pc)) {
+      continue;
+    }
+    struct block_t *block = block_place(jit, jit->blocks_head, jit->head);
+    if (!block) {
+      break;
+    }
+    rv_translate_block(rv, block, pc);
+    if (!block_finish(jit, block)) {
+      continue;
+    }
+    jit->stats.translations += 1;
+    translated += 1;
+    // visit the static successors of the block, or stop with the blocks
+    // translated so far if there is no room to queue them
+    if (count + block->num_links > size) {
+      uint32_t *grown = realloc(todo, size * 2 * sizeof(uint32_t));
+      if (!grown) {
+        break;
+      }
+      todo = grown;
+      size *= 2;
+    }
+    for (uint32_t i = 0; i < block->num_links; ++i) {
+      todo[count++] = block->links[i].target;
+    }
+  }
+  // the worker must place its next block after the ones translated here
+  if (jit->worker) {
+    jit->worker->blocks_head = jit->blocks_head;
+    jit->worker->head = jit->head;
+  }
+  free(todo);
+  return translated;
+}
+
+bool rv_save_jit_cache(struct riscv_t *rv, const char *path, uint64_t key) {
+  assert(rv && path);
+  struct riscv_jit_t *jit = &rv->jit;
+  if (jit->start == NULL) {
+    return false;
+  }
+  // let the worker finish so the code buffer is stable
+  worker_drain(jit);
+  struct jit_cache_header_t header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, jit_cache_magic, sizeof(header.magic));
+  header.build = jit_cache_build(rv);
+  header.key = key;
+  header.base = (uint64_t)(uintptr_t)jit->start;
+  header.block_start = (uint32_t)(jit->block_start - jit->start);
+  header.head = (uint32_t)(jit->head - jit->start);
+  header.counters_head = (uint32_t)(jit->counters_head - jit->start);
+  header.num_headers = (uint32_t)(jit->blocks_head - jit->blocks);
+  // find the live blocks, skipping any that were invalidated or never
+  // installed, and the code pages they came from
+  uint32_t *blocks = malloc(header.num_headers * sizeof(uint32_t) + 1);
+  struct jit_cache_page_t *pages =
+    malloc(header.num_headers * sizeof(struct jit_cache_page_t) + 1);
+  if (!blocks || !pages) {
+    free(pages);
+    free(blocks);
+    return false;
+  }
+  for (uint32_t i = 0; i < header.num_headers; ++i) {
+    struct block_t *block = &jit->blocks[i];
+    if (block_find(jit, block->pc_start) != block) {
+      continue;
+    }
+    blocks[header.num_blocks++] = i;
+    const uint32_t page = block->pc_start >> RV_JIT_CODE_PAGE_BITS;
+    bool found = false;
+    for (uint32_t i = 0; i < header.num_pages && !found; ++i) {
+      found = pages[i].page == page;
+    }
+    if (!found) {
+      struct jit_cache_page_t *entry = &pages[header.num_pages++];
+      entry->page = page;
+      entry->pad = 0;
+      entry->hash = jit_cache_page_hash(rv, page);
+    }
+  }
+  bool ok = false;
+  FILE *fd = fopen(path, "wb");
+  if (fd) {
+    const size_t code = jit->head - jit->block_start;
+    ok = fwrite(&header, sizeof(header), 1, fd) == 1 &&
+         fwrite(blocks, sizeof(uint32_t), header.num_blocks, fd) ==
+           header.num_blocks &&
+         fwrite(pages, sizeof(*pages), header.num_pages, fd) ==
+           header.num_pages &&
+         fwrite(jit->blocks, sizeof(struct block_t), header.num_headers,
+                fd) == header.num_headers &&
+         fwrite(jit->block_start, 1, code, fd) == code;
+    fclose(fd);
+  }
+  free(pages);
+  free(blocks);
+  return ok;
+}
+
+bool rv_load_jit_cache(struct riscv_t *rv, const char *path, uint64_t key) {
+  assert(rv && path);
+  struct riscv_jit_t *jit = &rv->jit;
+  if (jit->start == NULL) {
+    return false;
+  }
+  FILE *fd = fopen(path, "rb");
+  if (!fd) {
+    return false;
+  }
+  struct jit_cache_header_t header;
+  if (fread(&header, sizeof(header), 1, fd) != 1 ||
+      memcmp(header.magic, jit_cache_magic, sizeof(header.magic)) ||
+      header.build != jit_cache_build(rv) || header.key != key ||
+      header.block_start != (uint32_t)(jit->block_start - jit->start) ||
+      header.head < header.block_start ||
+      header.head > (uint32_t)(jit->end - jit->start) ||
+      header.counters_head < (uint32_t)(jit->counters - jit->start) ||
+      header.counters_head > (uint32_t)(jit->counters_end - jit->start) ||
+      header.num_headers > (uint32_t)(jit->blocks_end - jit->blocks) ||
+      header.num_blocks > header.num_headers ||
+      // each page holds at least one of the blocks
+      header.num_pages > header.num_blocks) {
+    fclose(fd);
+    return false;
+  }
+  uint32_t *blocks = malloc(header.num_blocks * sizeof(uint32_t) + 1);
+  struct jit_cache_page_t *pages =
+    malloc(header.num_pages * sizeof(struct jit_cache_page_t) + 1);
+  if (!blocks || !pages) {
+    free(pages);
+    free(blocks);
+    fclose(fd);
+    return false;
+  }
+  // start from an empty code cache
+  worker_drain(jit);
+  if (jit->head != jit->block_start) {
+    code_cache_flush(jit);
+  }
+  const size_t code = header.head - header.block_start;
+  bool ok =
+    fread(blocks, sizeof(uint32_t), header.num_blocks, fd) ==
+      header.num_blocks &&
+    fread(pages, sizeof(*pages), header.num_pages, fd) == header.num_pages &&
+    fread(jit->blocks, sizeof(struct block_t), header.num_headers, fd) ==
+      header.num_headers &&
+    fread(jit->block_start, 1, code, fd) == code;
+  fclose(fd);
+  for (uint32_t i = 0; ok && i < header.num_blocks; ++i) {
+    ok = blocks[i] < header.num_headers;
+  }
+  if (ok) {
+    jit->head = jit->start + header.head;
+    jit->blocks_head = jit->blocks + header.num_headers;
+    // the counters start from zero again
+    jit->counters_head = jit->start + header.counters_head;
+    if (jit->worker) {
+      jit->worker->blocks_head = jit->blocks_head;
+      jit->worker->head = jit->head;
+    }
+    // rebase every block, including dead ones, as live blocks may still
+    // predict them
+    const intptr_t delta = (intptr_t)((uintptr_t)jit->start - header.base);
+    for (struct block_t *block = jit->blocks; block < jit->blocks_head;
+         ++block) {
+      jit_cache_rebase(block, delta);
+      block->fallbacks = 0;
+    }
+    // install the blocks that were live
+    for (uint32_t i = 0; i < header.num_blocks; ++i) {
+      struct block_t *block = &jit->blocks[blocks[i]];
+      struct block_page_t *page = block_dir_page(jit, block->pc_start);
+      if (page == NULL) {
+        continue;
+      }
+      page->slot[block_dir_slot(block->pc_start)] = block;
+      code_page_mark(jit, block->pc_start);
+      if (block->instructions > jit->max_instructions) {
+        jit->max_instructions = block->instructions;
+      }
+      if (jit->perf) {
+        perf_block(jit->perf, block);
+      }
+    }
+    // drop the blocks of any guest code that has changed since
+    for (uint32_t i = 0; i < header.num_pages; ++i) {
+      if (jit_cache_page_hash(rv, pages[i].page) != pages[i].hash) {
+        code_page_invalidate(jit, pages[i].page);
+      }
+    }
+    sys_flush_icache(jit->block_start, code);
+  }
+  else {
+    memset(jit->block_start, 0xcc, code);
+  }
+  free(pages);
+  free(blocks);
+  return ok;
+}
+
 bool rv_init_jit(struct riscv_t *rv) {
 
   struct riscv_jit_t *jit = &rv->jit;
 
-  // allocate the block map which maps address to blocks
-  if (jit->block_map == NULL) {
-    jit->block_map_size = map_size;
-    jit->block_map = malloc(map_size * sizeof(struct block_t*));
-    memset(jit->block_map, 0, map_size * sizeof(struct block_t*));
+  jit->threshold = RISCV_VM_JIT_THRESHOLD;
+  jit->passes = rv_jit_pass_all;
+  jit->features = cg_host_features();
+  ras_clear(jit);
+
+  // setup the register allocators
+  regs_init(&jit->regs, abi_alloc_regs, countof(abi_alloc_regs), false);
+  regs_init(&jit->fregs, abi_alloc_xmms, countof(abi_alloc_xmms), true);
+
+#if RISCV_VM_SUPPORT_RV32F
+  // helpers for float operations that are not translated inline
+  jit->helper_fmin = jit_fminf;
+  jit->helper_fmax = jit_fmaxf;
+  jit->helper_fclass = calc_fclass;
+#endif
+
+  // allocate the block directory which maps addresses to blocks
+  if (jit->block_dir == NULL) {
+    const size_t size = RV_JIT_DIR_PAGES * sizeof(struct block_page_t *);
+    jit->block_dir = malloc(size);
+    memset(jit->block_dir, 0, size);
+  }
+
+  // allocate the code page tracking used to detect self modifying code
+  // note: calloc lets the os provide the large store map lazily
+  if (jit->code_pages == NULL) {
+    jit->code_pages = calloc(RV_JIT_CODE_PAGES / 32, sizeof(uint32_t));
+    jit->store_map = calloc(RV_JIT_CODE_PAGES, sizeof(uint8_t *));
+    // route all stores through our checks before they reach the user
+    jit->mem_write_w = rv->io.mem_write_w;
+    jit->mem_write_s = rv->io.mem_write_s;
+    jit->mem_write_b = rv->io.mem_write_b;
+    rv->io.mem_write_w = jit_mem_write_w;
+    rv->io.mem_write_s = jit_mem_write_s;
+    rv->io.mem_write_b = jit_mem_write_b;
   }
 
   // allocate block/code storage space
+  // note: the block headers share the allocation so that translated code can
+  //       address them rip relative
   if (jit->start == NULL) {
-    void *ptr = sys_alloc_exec_mem(code_size);
+    const size_t blocks_size = blocks_count * sizeof(struct block_t);
+    void *ptr = sys_alloc_exec_mem(code_size, counters_size + blocks_size,
+                                   &jit->huge_pages);
     memset(ptr, 0xcc, code_size);
+    memset((uint8_t *)ptr + code_size, 0, counters_size);
     jit->start = ptr;
     jit->head = ptr;
     jit->end = jit->start + code_size;
+    jit->counters = jit->end;
+    jit->counters_head = jit->counters;
+    jit->counters_end = jit->counters + counters_size;
+    jit->blocks = (struct block_t *)jit->counters_end;
+    jit->blocks_head = jit->blocks;
+    jit->blocks_end = jit->blocks + blocks_count;
+    // place the trampolines at the start of the code buffer
+    gen_trampolines(jit);
+    jit->block_start = jit->head;
+  }
+
+  return true;
+}
+
+void rv_free_jit(struct riscv_t *rv) {
+  struct riscv_jit_t *jit = &rv->jit;
+  // stop the background translator before its state goes away
+  rv_set_jit_async(rv, false);
+  rv_set_jit_perf(rv, 0, NULL);
+  rv_set_jit_profile(rv, false);
+  free(jit->store_map);
+  free(jit->code_pages);
+  jit->store_map = NULL;
+  jit->code_pages = NULL;
+  if (jit->block_dir) {
+    for (uint32_t i = 0; i < RV_JIT_DIR_PAGES; ++i) {
+      free(jit->block_dir[i]);
+    }
+    free(jit->block_dir);
+    jit->block_dir = NULL;
+  }
+  if (jit->start) {
+    const size_t blocks_size = blocks_count * sizeof(struct block_t);
+    sys_free_exec_mem(jit->start, code_size, counters_size + blocks_size);
+    jit->start = NULL;
   }
+}
+
+void rv_set_jit_threshold(struct riscv_t *rv, uint32_t count) {
+  assert(rv);
+  // counts are held in 16 bits
+  rv->jit.threshold = (count > UINT16_MAX) ? UINT16_MAX : count;
+}
+
+void rv_set_jit_passes(struct riscv_t *rv, uint32_t passes) {
+  assert(rv);
+  rv->jit.passes = passes & rv_jit_pass_all;
+}
+
+void rv_set_jit_exact(struct riscv_t *rv, bool enable) {
+  assert(rv);
+  rv->jit.exact = enable;
+}
 
+bool rv_set_jit_perf(struct riscv_t *rv, uint32_t formats,
+                     riscv_jit_symbolize symbolize) {
+  assert(rv);
+  struct riscv_jit_t *jit = &rv->jit;
+  perf_close(jit);
+  // the jit is not in use
+  if (formats == 0 || jit->start == NULL) {
+    return formats == 0;
+  }
+#ifdef __linux__
+  struct jit_perf_t *perf = calloc(1, sizeof(struct jit_perf_t));
+  if (!perf) {
+    return false;
+  }
+  perf->rv = rv;
+  perf->symbolize = symbolize;
+  jit->perf = perf;
+  if (formats & rv_jit_perf_map) {
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/perf-%d.map", (int)getpid());
+    perf->map = fopen(path, "w");
+  }
+  const bool ok = ((formats & rv_jit_perf_map) == 0 || perf->map) &&
+                  ((formats & rv_jit_perf_dump) == 0 || perf_dump_open(perf));
+  if (!ok) {
+    perf_close(jit);
+    return false;
+  }
+  perf_code(perf, jit->start, jit->block_start - jit->start,
+            "rv:trampolines");
   return true;
+#else
+  return false;
+#endif
+}
+
+void rv_set_jit_baseline(struct riscv_t *rv, bool enable) {
+  assert(rv);
+  rv->jit.features = enable ? 0 : cg_host_features();
+}
+
+void rv_set_jit_async(struct riscv_t *rv, bool enable) {
+  assert(rv);
+  struct riscv_jit_t *jit = &rv->jit;
+  // the jit is not in use
+  if (jit->start == NULL) {
+    return;
+  }
+  if (enable && !jit->worker) {
+    // note: if the thread cannot be started we keep translating in place
+    jit->worker = worker_create(rv);
+  }
+  if (!enable && jit->worker) {
+    worker_destroy(jit);
+  }
+}
+
+void rv_jit_fence_i(struct riscv_t *rv) {
+  assert(rv);
+  struct riscv_jit_t *jit = &rv->jit;
+  // stores through the io handlers have already invalidated any code they
+  // touched, but the user may have written guest memory directly
+  const struct jit_worker_t *w = jit->worker;
+  if (jit->head != jit->block_start || (w && w->installed != w->queued)) {
+    code_cache_flush(jit);
+  }
+}
+
+void rv_set_jit_profile(struct riscv_t *rv, bool enable) {
+  assert(rv);
+  struct riscv_jit_t *jit = &rv->jit;
+  jit->profile = enable;
+  if (!enable) {
+    free(jit->profile_saved);
+    jit->profile_saved = NULL;
+    jit->profile_saved_count = 0;
+  }
+}
+
+uint32_t rv_get_jit_profile(struct riscv_t *rv, struct riscv_jit_profile_t *out,
+                            uint32_t max) {
+  assert(rv && (out || !max));
+  struct riscv_jit_t *jit = &rv->jit;
+  if (!jit->start) {
+    return 0;
+  }
+  uint32_t count = 0;
+  struct riscv_jit_profile_t *list = profile_collect(jit, &count);
+  if (!list) {
+    return 0;
+  }
+  qsort(list, count, sizeof(struct riscv_jit_profile_t), profile_cmp_weight);
+  if (max) {
+    memcpy(out, list,
+           (count < max ? count : max) * sizeof(struct riscv_jit_profile_t));
+  }
+  free(list);
+  return count;
+}
+
+void rv_get_jit_stats(struct riscv_t *rv, struct riscv_jit_stats_t *out) {
+  assert(rv && out);
+  const struct riscv_jit_t *jit = &rv->jit;
+  *out = jit->stats;
+  // the prediction counters are kept by the blocks themselves
+  if (jit->start) {
+    for (const struct block_t *block = jit->blocks; block < jit->blocks_head;
+         ++block) {
+      if (block->ic_count) {
+        out->ic_hits += block->ic_count[0];
+        out->ic_misses += block->ic_count[1];
+      }
+      if (block->ras_count) {
+        out->ras_hits += block->ras_count[0];
+        out->ras_misses += block->ras_count[1];
+      }
+      out->code_instructions += block->instructions;
+    }
+  }
+  out->code_used = (uint32_t)(jit->head - jit->start);
+  out->code_size = (uint32_t)(jit->end - jit->start);
+  out->code_huge_pages = jit->huge_pages;
 }
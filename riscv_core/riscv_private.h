@@ -60,7 +60,46 @@ enum {
   //               ....xxxx....xxxx....xxxx....xxxx
 };
 
-// a translated basic block
+// maximum number of chainable exits from a block
+#define RV_JIT_MAX_LINKS 8
+
+// maximum number of straight line runs of guest code in a block
+#define RV_JIT_MAX_RUNS 8
+
+// number of entries in the inline cache at an indirect jump
+#define RV_JIT_IC_SIZE 2
+
+// number of entries in the return address stack (a power of two)
+#define RV_JIT_RAS_SIZE 16
+
+struct block_t;
+
+// an exit from a block to a statically known guest address which can be
+// patched to jump directly into the native code of its successor
+struct block_link_t {
+  // the block this exit belongs to
+  struct block_t *block;
+  // guest address of the successor
+  uint32_t target;
+  // displacement the patchable jump has while unlinked (0 falls through)
+  int32_t unlinked;
+  // displacement field of the patchable jump
+  uint8_t *patch;
+  // the block this exit is currently chained to (or NULL)
+  struct block_t *succ;
+  // next link in the successors list of incoming links
+  struct block_link_t *next;
+  // for inline cache entries, the immediate the jump target is compared with
+  // before the patchable jump is taken (otherwise NULL)
+  uint8_t *guard;
+};
+
+// a translated block
+// note: a block is a trace that may follow jumps and continue past branches
+//       so its guest code need not be contiguous.  pc_end is the address the
+//       trace reached.
+// note: blocks are kept in an array apart from their code so that the code
+//       buffer holds nothing but instructions.
 struct block_t {
   // number of instructions encompased
   uint32_t instructions;
@@ -69,21 +108,228 @@ struct block_t {
   uint32_t pc_end;
   // next block prediction
   struct block_t *predict;
+  // chainable exits from this block
+  uint32_t num_links;
+  struct block_link_t links[RV_JIT_MAX_LINKS];
+  // list of links from other blocks chained into this one
+  struct block_link_t *incoming;
+  // inline cache at the indirect jump ending the block, if it has one.  each
+  // entry is a link whose target is chosen by the dispatcher on a miss.
+  uint32_t ic_size;
+  uint32_t ic_next;
+  struct block_link_t ic[RV_JIT_IC_SIZE];
+  // times the inline cache found and missed the jump target, or NULL if
+  // there was no room to count them
+  uint32_t *ic_count;
+  // times the return address stack predicted and mispredicted the return
+  // ending the block, or NULL if it does not end in a return
+  uint32_t *ras_count;
+  // times translated code entered the block, or NULL if it is not counted
+  uint64_t *exec_count;
+  // times the dispatcher interpreted the block rather than run its code
+  uint32_t fallbacks;
   // code gen structure
   struct cg_state_t cg;
   // start of this blocks code
-  uint8_t code[];
+  uint8_t *code;
+};
+
+// an entry of the return address stack
+struct jit_ras_entry_t {
+  // guest address the call will return to
+  uint32_t pc;
+  uint32_t pad;
+  // native code that carries on from there
+  uint8_t *code;
+};
+
+// the block directory maps guest addresses to blocks in two levels.  the
+// upper address bits select a page and the word offset within the page selects
+// a slot.
+#define RV_JIT_DIR_PAGE_BITS 16
+#define RV_JIT_DIR_PAGES (1u << (32 - RV_JIT_DIR_PAGE_BITS))
+#define RV_JIT_DIR_SLOTS (1u << (RV_JIT_DIR_PAGE_BITS - 2))
+
+// translated code is tracked in guest pages of this many address bits so that
+// stores into it can be detected
+#define RV_JIT_CODE_PAGE_BITS 12
+#define RV_JIT_CODE_PAGES (1u << (32 - RV_JIT_CODE_PAGE_BITS))
+
+// most guest instructions a block can hold, as blocks lie within one code page
+#define RV_JIT_MAX_INSNS (1u << (RV_JIT_CODE_PAGE_BITS - 2))
+
+// flags of a decoded guest instruction
+enum {
+  // the trace carries on at the target of this branch or jump
+  IR_FOLLOW = 1,
+  // this branch or jump ends the block
+  IR_END    = 2,
+  // the value written to rd is known during translation
+  IR_CONST  = 4,
+  // the target of this jalr is known during translation
+  IR_TARGET = 8,
+  // nothing reads the value written to rd so the instruction can be skipped
+  IR_DEAD   = 16,
+  // this branch or jump goes back to the start of the block, which then
+  // loops without leaving translated code
+  IR_LOOP   = 32,
+};
+
+// a guest instruction of the block being translated.  a block is decoded in
+// full before any code is generated so that optimization passes can look at
+// all of it.
+struct jit_insn_t {
+  // guest address and instruction word
+  // note: passes may rewrite the source register fields of the instruction
+  uint32_t pc;
+  uint32_t inst;
+  // IR_* flags
+  uint32_t flags;
+  // result for IR_CONST or jump target for IR_TARGET
+  uint32_t value;
 };
 
+// one page of the block directory
+struct block_page_t {
+  // block starting at each word of the page (or NULL)
+  struct block_t *slot[RV_JIT_DIR_SLOTS];
+  // bit set for each slot whose block was discarded by a flush
+  uint32_t retired[RV_JIT_DIR_SLOTS / 32];
+  // number of times the interpreter has run the block at each slot
+  uint16_t count[RV_JIT_DIR_SLOTS];
+};
+
+// number of host registers that can be tracked by the register allocator
+#define RV_JIT_HOST_REGS 16
+
+// host register allocation state used while translating a block
+struct jit_regs_t {
+  // host registers that may be allocated in order of preference
+  const int *pool;
+  uint32_t pool_size;
+  // true if this allocates xmm registers to rv->F
+  bool fp;
+  // host register holding each guest register (or -1)
+  int8_t host[RV_NUM_REGS];
+  // guest register held in each host register (or -1)
+  int8_t guest[RV_JIT_HOST_REGS];
+  // host registers holding a value not yet written back to rv->X
+  uint32_t dirty;
+  // time each host register was last used, for eviction
+  uint32_t last_use[RV_JIT_HOST_REGS];
+  uint32_t time;
+};
+
+// enter translated code at a given block
+typedef void (*jit_enter_t)(struct riscv_t *rv, const uint8_t *code);
+
 struct riscv_jit_t {
   // memory range for code buffer
   uint8_t *start;
   uint8_t *end;
   // code buffer write point
   uint8_t *head;
-  // block hash map
-  uint32_t block_map_size;
-  struct block_t **block_map;
+  // first block in the code buffer, after the trampolines
+  uint8_t *block_start;
+  // true if the code buffer is backed by explicit huge pages
+  bool huge_pages;
+  // counters written by translated code.  they follow the code buffer in
+  // pages of their own so that writing them is not mistaken by the host for
+  // self modifying code.
+  uint8_t *counters;
+  uint8_t *counters_head;
+  uint8_t *counters_end;
+  // block headers, in the order their code was placed.  they follow the
+  // counters so that translated code can reach its own block rip relative.
+  struct block_t *blocks;
+  struct block_t *blocks_head;
+  struct block_t *blocks_end;
+  // block directory pages, allocated on first use
+  struct block_page_t **block_dir;
+  // bit set for each guest code page holding translated code
+  uint32_t *code_pages;
+  // direct map of guest memory used by translated stores, one entry per code
+  // page.  entries are filled in on demand from rv->mem_map and are left NULL
+  // for pages holding translated code so that stores to them take the slow
+  // path and invalidate the code.
+  uint8_t **store_map;
+  // the users memory write handlers, which the jit wraps to watch for stores
+  // into translated code
+  riscv_mem_write_w mem_write_w;
+  riscv_mem_write_s mem_write_s;
+  riscv_mem_write_b mem_write_b;
+  // incremented each time the code cache is flushed so that the dispatcher
+  // can tell that its block pointers have gone stale
+  uint32_t epoch;
+  // blocks are interpreted this many times before they are translated
+  uint32_t threshold;
+  // background translator, or NULL if blocks are translated in place
+  struct jit_worker_t *worker;
+  // files describing translated code to the perf profiler (or NULL)
+  struct jit_perf_t *perf;
+  struct riscv_jit_stats_t stats;
+  // trampolines to enter and leave translated code
+  jit_enter_t enter;
+  uint8_t *exit;
+  // translated code will return to the dispatcher when this is reached
+  uint64_t cycles_target;
+  // stop exactly at the cycle target instead of at the end of a block.  the
+  // dispatcher then only enters blocks that fit within the cycles left and
+  // has translated code return max_instructions early so that it can check.
+  bool exact;
+  // most instructions in any block in the code cache
+  uint32_t max_instructions;
+  // set by translated code to indicate how it returned to the dispatcher
+  struct block_link_t *exit_link;
+  struct block_t *exit_block;
+  // return address stack pushed by translated calls and popped by translated
+  // returns, which jump straight to the code after their call if the top
+  // entry is for the address being returned to.  it wraps around rather than
+  // overflowing so that deep recursion and longjmp only cost mispredictions.
+  // note: ras_top is the byte offset of the top entry
+  uint32_t ras_top;
+  struct jit_ras_entry_t ras[RV_JIT_RAS_SIZE];
+  // register allocator state for the block being translated
+  struct jit_regs_t regs;
+  struct jit_regs_t fregs;
+  // instructions of the block being translated that were already added to
+  // the cycle counter on the path to the current instruction
+  uint32_t retired;
+  // true if the block being translated loops back to its start, in which
+  // case the start of the loop and the guest register held by each host
+  // register there are kept for the jump back
+  bool loop;
+  uint8_t *loop_head;
+  int8_t loop_regs[RV_JIT_HOST_REGS];
+  // guest address ranges already covered by the trace being decoded
+  uint32_t run_start;
+  uint32_t num_runs;
+  struct {
+    uint32_t start;
+    uint32_t end;
+  } runs[RV_JIT_MAX_RUNS];
+  // helpers called by translated code for float operations that are not
+  // translated inline
+  float (*helper_fmin)(float, float);
+  float (*helper_fmax)(float, float);
+  uint32_t (*helper_fclass)(uint32_t);
+  // optimization passes run over blocks before translation (rv_jit_pass_*)
+  uint32_t passes;
+  // instruction set extensions translated code may use (cg_feature_*)
+  uint32_t features;
+  // count block executions for rv_get_jit_profile
+  bool profile;
+  // profile of the blocks discarded by flushes, ordered by guest address
+  struct riscv_jit_profile_t *profile_saved;
+  uint32_t profile_saved_count;
+  // decoded instructions of the block being translated and the one being
+  // generated.  ir_next is where the block continues if it is not ended by
+  // its last instruction, and ir_links counts the exits taken by the trace.
+  uint32_t ir_count;
+  uint32_t ir_pos;
+  uint32_t ir_next;
+  uint32_t ir_links;
+  struct jit_insn_t ir[RV_JIT_MAX_INSNS];
 };
 
 struct riscv_t {
@@ -94,6 +340,8 @@ struct riscv_t {
   riscv_word_t PC;
   // user provided data
   riscv_user_t userdata;
+  // optional direct map of guest memory chunks
+  uint8_t *const *mem_map;
   // exception status
   riscv_exception_t exception;
   // CSRs
@@ -109,6 +357,48 @@ struct riscv_t {
   struct riscv_jit_t jit;
 };
 
+#if RISCV_VM_SUPPORT_RV32F
+enum {
+  //             ....xxxx....xxxx....xxxx....xxxx
+  FMASK_SIGN = 0b10000000000000000000000000000000,
+  FMASK_EXPN = 0b01111111100000000000000000000000,
+  FMASK_FRAC = 0b00000000011111111111111111111111,
+  //             ........xxxxxxxx........xxxxxxxx
+};
+
+static inline uint32_t calc_fclass(uint32_t f) {
+  const uint32_t sign = f & FMASK_SIGN;
+  const uint32_t expn = f & FMASK_EXPN;
+  const uint32_t frac = f & FMASK_FRAC;
+
+  // note: this could be turned into a binary decision tree for speed
+
+  uint32_t out = 0;
+  // 0x001    rs1 is -INF
+  out |= (f == 0xff800000)                               ? 0x001 : 0;
+  // 0x002    rs1 is negative normal
+  out |= (expn && expn < 0x78000000 && sign)             ? 0x002 : 0;
+  // 0x004    rs1 is negative subnormal
+  out |= (!expn && frac && sign)                         ? 0x004 : 0;
+  // 0x008    rs1 is -0
+  out |= (f == 0x80000000)                               ? 0x008 : 0;
+  // 0x010    rs1 is +0
+  out |= (f == 0x00000000)                               ? 0x010 : 0;
+  // 0x020    rs1 is positive subnormal
+  out |= (!expn && frac && !sign)                        ? 0x020 : 0;
+  // 0x040    rs1 is positive normal
+  out |= (expn && expn < 0x78000000 && !sign)            ? 0x040 : 0;
+  // 0x080    rs1 is +INF
+  out |= (f == 0x7f800000)                               ? 0x080 : 0;
+  // 0x100    rs1 is a signaling NaN
+  out |= (expn == FMASK_EXPN && (frac <= 0x7ff) && frac) ? 0x100 : 0;
+  // 0x200    rs1 is a quiet NaN
+  out |= (expn == FMASK_EXPN && (frac >= 0x800))         ? 0x200 : 0;
+
+  return out;
+}
+#endif  // RISCV_VM_SUPPORT_RV32F
+
 // decode rd field
 static inline uint32_t dec_rd(uint32_t inst) {
   return (inst & FR_RD) >> 7;
@@ -200,4 +490,8 @@ static inline uint32_t sign_extend_b(uint32_t x) {
 }
 
 bool rv_init_jit(struct riscv_t *rv);
+// release everything rv_init_jit and later use of the jit allocated
+void rv_free_jit(struct riscv_t *rv);
 bool rv_step_jit(struct riscv_t *rv, const uint64_t cycles_target);
+// discard all translated code, for FENCE.I
+void rv_jit_fence_i(struct riscv_t *rv);
@@ -1,11 +1,24 @@
 #include <cstdio>
+#include <cstdlib>
 #include <cstring>
 
+#include "../riscv_core/riscv.h"
+
 
 extern bool g_arg_trace;
 extern bool g_arg_compliance;
 extern bool g_arg_show_mips;
 extern bool g_fullscreen;
+extern bool g_arg_jit_stats;
+extern int g_arg_jit_threshold;
+extern bool g_arg_jit_async;
+extern bool g_arg_jit_exact;
+extern int g_arg_jit_perf;
+extern bool g_arg_jit_baseline;
+extern int g_arg_jit_passes;
+extern const char *g_arg_jit_cache;
+extern bool g_arg_jit_report;
+extern const char *g_arg_jit_profile;
 
 extern const char *g_arg_program;
 
@@ -13,16 +26,67 @@ extern const char *g_arg_program;
 void print_usage(const char *filename) {
   fprintf(stderr, R"(
   Usage: %s [options]
-  Option:        | Description:
- ----------------+-----------------------------------
-  program        | RV32IM ELF file to execute
-  --compliance   | Generate a compliance signature
-  --trace        | Print execution trace
-  --show-mips    | Show MIPS throughput
-  --fullscreen   | Run in a fullscreen window
+  Option:            | Description:
+ --------------------+-----------------------------------
+  program            | RV32IM ELF file to execute
+  --compliance       | Generate a compliance signature
+  --trace            | Print execution trace
+  --show-mips        | Show MIPS throughput
+  --fullscreen       | Run in a fullscreen window
+  --jit-stats        | Print JIT code cache statistics on exit
+  --jit-threshold N  | Interpret blocks N times before translating them
+  --jit-async        | Translate blocks on a background thread
+  --jit-exact        | Stop translated code at exact cycle counts
+  --jit-perf-map     | Name translated code in /tmp/perf-<pid>.map for perf
+  --jit-perf-dump    | Write translated code to /tmp/jit-<pid>.dump for perf
+  --jit-baseline     | Translate for baseline x86-64 without BMI2 or AVX
+  --jit-cache FILE   | Load translated code from FILE and save it on exit
+  --jit-report       | Print the blocks that ran the most on exit
+  --jit-profile FILE | Translate the hot blocks listed in FILE up front and
+                     | save the block execution counts to it on exit
+  --jit-passes LIST  | Comma separated JIT optimization passes to run, from
+                     | const-prop, copy-prop, dead-write and load-elim, or
+                     | 'none' (all are run by default)
 )", filename);
 }
 
+namespace {
+
+// parse a list of jit optimization pass names into a mask, or return -1
+int parse_jit_passes(const char *list) {
+  static const struct {
+    const char *name;
+    int mask;
+  } passes[] = {
+    {"const-prop", rv_jit_pass_const_prop},
+    {"copy-prop",  rv_jit_pass_copy_prop},
+    {"dead-write", rv_jit_pass_dead_write},
+    {"load-elim",  rv_jit_pass_load_elim},
+  };
+  if (0 == strcmp(list, "none")) {
+    return 0;
+  }
+  int mask = 0;
+  while (*list) {
+    const size_t len = strcspn(list, ",");
+    int found = -1;
+    for (const auto &pass : passes) {
+      if (strlen(pass.name) == len && 0 == strncmp(list, pass.name, len)) {
+        found = pass.mask;
+      }
+    }
+    if (found < 0) {
+      return -1;
+    }
+    mask |= found;
+    list += len;
+    list += (*list == ',') ? 1 : 0;
+  }
+  return mask;
+}
+
+} // namespace {}
+
 bool parse_args(int argc, char **args) {
   // parse each argument in turn
   for (int i = 1; i < argc; ++i) {
@@ -48,6 +112,54 @@ bool parse_args(int argc, char **args) {
         g_fullscreen = true;
         continue;
       }
+      if (0 == strcmp(arg, "--jit-stats")) {
+        g_arg_jit_stats = true;
+        continue;
+      }
+      if (0 == strcmp(arg, "--jit-threshold") && i + 1 < argc) {
+        g_arg_jit_threshold = atoi(args[++i]);
+        continue;
+      }
+      if (0 == strcmp(arg, "--jit-async")) {
+        g_arg_jit_async = true;
+        continue;
+      }
+      if (0 == strcmp(arg, "--jit-exact")) {
+        g_arg_jit_exact = true;
+        continue;
+      }
+      if (0 == strcmp(arg, "--jit-perf-map")) {
+        g_arg_jit_perf |= rv_jit_perf_map;
+        continue;
+      }
+      if (0 == strcmp(arg, "--jit-perf-dump")) {
+        g_arg_jit_perf |= rv_jit_perf_dump;
+        continue;
+      }
+      if (0 == strcmp(arg, "--jit-baseline")) {
+        g_arg_jit_baseline = true;
+        continue;
+      }
+      if (0 == strcmp(arg, "--jit-passes") && i + 1 < argc) {
+        g_arg_jit_passes = parse_jit_passes(args[++i]);
+        if (g_arg_jit_passes < 0) {
+          fprintf(stderr, "Unknown JIT pass in '%s'\n", args[i]);
+          return false;
+        }
+        continue;
+      }
+      if (0 == strcmp(arg, "--jit-cache") && i + 1 < argc) {
+        g_arg_jit_cache = args[++i];
+        continue;
+      }
+      if (0 == strcmp(arg, "--jit-report")) {
+        g_arg_jit_report = true;
+        continue;
+      }
+      if (0 == strcmp(arg, "--jit-profile") && i + 1 < argc) {
+        g_arg_jit_profile = args[++i];
+        continue;
+      }
       // error
       fprintf(stderr, "Unknown argument '%s'\n", arg);
       return false;
@@ -40,6 +40,29 @@ bool elf_t::upload(struct riscv_t *rv, memory_t &mem) const {
   return true;
 }
 
+uint64_t elf_t::hash_segments() const {
+  // fnv-1a
+  uint64_t hash = 0xcbf29ce484222325ull;
+  auto mix = [&hash](const void *data, size_t size) {
+    const uint8_t *ptr = (const uint8_t*)data;
+    for (size_t i = 0; i < size; ++i) {
+      hash = (hash ^ ptr[i]) * 0x100000001b3ull;
+    }
+  };
+  mix(&hdr->e_entry, sizeof(hdr->e_entry));
+  for (int p = 0; p < hdr->e_phnum; ++p) {
+    uint32_t offset = hdr->e_phoff + (p * hdr->e_phentsize);
+    const ELF::Elf32_Phdr *phdr = (const ELF::Elf32_Phdr*)(data() + offset);
+    if (phdr->p_type != ELF::PT_LOAD) {
+      continue;
+    }
+    mix(&phdr->p_vaddr, sizeof(phdr->p_vaddr));
+    mix(&phdr->p_memsz, sizeof(phdr->p_memsz));
+    mix(data() + phdr->p_offset, std::min(phdr->p_memsz, phdr->p_filesz));
+  }
+  return hash;
+}
+
 bool elf_t::load(const char *path) {
   // free previous memory
   if (raw_data) {
@@ -79,6 +102,26 @@ bool elf_t::load(const char *path) {
   return true;
 }
 
+void elf_t::get_function_addrs(std::vector<uint32_t> &out) const {
+  // get the string table
+  const char *strtab = get_strtab();
+  if (!strtab) {
+    return;
+  }
+  // get the symbol table
+  const ELF::Elf32_Shdr *shdr = get_section_header(".symtab");
+  if (!shdr) {
+    return;
+  }
+  const ELF::Elf32_Sym *sym = (const ELF::Elf32_Sym *)(data() + shdr->sh_offset);
+  const ELF::Elf32_Sym *end = (const ELF::Elf32_Sym *)(data() + shdr->sh_offset + shdr->sh_size);
+  for (; sym < end; ++sym) {
+    if (ELF_ST_TYPE(sym->st_info) == ELF::STT_FUNC) {
+      out.push_back(sym->st_value);
+    }
+  }
+}
+
 void elf_t::fill_symbols() {
   // init the symbol table
   symbols.clear();
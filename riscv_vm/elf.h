@@ -4,6 +4,7 @@
 
 #include <memory>
 #include <map>
+#include <vector>
 
 
 namespace ELF {
@@ -272,6 +273,17 @@ struct elf_t {
   // load the ELF file into a memory abstraction
   bool upload(struct riscv_t *rv, memory_t &mem) const;
 
+  // return a hash of the segments that upload would load
+  uint64_t hash_segments() const;
+
+  // get the address of every function symbol
+  void get_function_addrs(std::vector<uint32_t> &out) const;
+
+  // get the program entry point
+  uint32_t get_entry() const {
+    return hdr->e_entry;
+  }
+
   const uint8_t *data() const {
     return raw_data.get();
   }
@@ -288,6 +300,20 @@ struct elf_t {
     return (itt == symbols.end()) ? nullptr : itt->second;
   }
 
+  // find the closest symbol at or below an address and its address
+  const char * find_nearest_symbol(uint32_t addr, uint32_t &base) {
+    if (symbols.empty()) {
+      fill_symbols();
+    }
+    auto itt = symbols.upper_bound(addr);
+    // skip the placeholder entry for address zero
+    if (itt == symbols.begin() || (--itt)->first == 0) {
+      return nullptr;
+    }
+    base = itt->first;
+    return itt->second;
+  }
+
 protected:
 
   void fill_symbols();
@@ -1,6 +1,8 @@
+#include <algorithm>
 #include <cstring>
 #include <ctime>
 #include <memory>
+#include <vector>
 
 #include "elf.h"
 #include "file.h"
@@ -20,6 +22,26 @@ const char *g_arg_program = "a.out";
 bool g_arg_show_mips = false;
 // run in fullscreen
 bool g_fullscreen = false;
+// print jit statistics on exit
+bool g_arg_jit_stats = false;
+// jit translation threshold (or -1 for the default)
+int g_arg_jit_threshold = -1;
+// translate blocks on a background thread
+bool g_arg_jit_async = false;
+// stop translated code at exact cycle counts
+bool g_arg_jit_exact = false;
+// rv_jit_perf_* files to write for the perf profiler
+int g_arg_jit_perf = 0;
+// only use baseline x86-64 in translated code
+bool g_arg_jit_baseline = false;
+// jit optimization passes to run (or -1 for the default)
+int g_arg_jit_passes = -1;
+// file to load translated code from and save it to (or nullptr)
+const char *g_arg_jit_cache = nullptr;
+// print the blocks that ran the most on exit
+bool g_arg_jit_report = false;
+// file to load hot block addresses from and save block counts to (or nullptr)
+const char *g_arg_jit_profile = nullptr;
 
 // main syscall handler
 void syscall_handler(struct riscv_t *);
@@ -81,6 +103,14 @@ void imp_on_ebreak(struct riscv_t *rv, riscv_word_t addr, uint32_t inst) {
   rv_set_exception(rv, rv_except_halt);
 }
 
+// the program being run, used to name translated code for perf
+elf_t *g_jit_perf_elf = nullptr;
+
+const char *imp_jit_symbolize(struct riscv_t *, riscv_word_t addr,
+                              riscv_word_t *base) {
+  return g_jit_perf_elf->find_nearest_symbol(addr, *base);
+}
+
 // run the core - printing out an instruction trace
 void run_and_trace(riscv_t *rv, state_t *state, elf_t &elf) {
   static const uint32_t cycles_per_step = 1;
@@ -153,6 +183,118 @@ void print_signature(state_t *state, elf_t &elf) {
   }
 }
 
+void print_jit_stats(struct riscv_t *rv) {
+  riscv_jit_stats_t stats;
+  rv_get_jit_stats(rv, &stats);
+  fprintf(stderr, "jit translations:   %llu\n",
+          (unsigned long long)stats.translations);
+  fprintf(stderr, "jit retranslations: %llu\n",
+          (unsigned long long)stats.retranslations);
+  fprintf(stderr, "jit flushes:        %llu\n",
+          (unsigned long long)stats.flushes);
+  fprintf(stderr, "jit invalidations:  %llu\n",
+          (unsigned long long)stats.invalidations);
+  fprintf(stderr, "jit interpreted:    %llu\n",
+          (unsigned long long)stats.interpreted);
+  fprintf(stderr, "jit speculative:    %llu\n",
+          (unsigned long long)stats.speculative);
+  fprintf(stderr, "jit ic hits:        %llu\n",
+          (unsigned long long)stats.ic_hits);
+  fprintf(stderr, "jit ic misses:      %llu\n",
+          (unsigned long long)stats.ic_misses);
+  fprintf(stderr, "jit ras hits:       %llu\n",
+          (unsigned long long)stats.ras_hits);
+  fprintf(stderr, "jit ras misses:     %llu\n",
+          (unsigned long long)stats.ras_misses);
+  fprintf(stderr, "jit code cache:     %u / %u bytes\n", stats.code_used,
+          stats.code_size);
+  if (stats.code_instructions) {
+    fprintf(stderr, "jit code per insn:  %.1f bytes\n",
+            double(stats.code_used) / double(stats.code_instructions));
+  }
+  if (stats.code_size) {
+    fprintf(stderr, "jit huge pages:     %s\n",
+            stats.code_huge_pages ? "explicit" : "transparent (if enabled)");
+  }
+}
+
+// return the profile of every block, hottest first
+std::vector<riscv_jit_profile_t> get_jit_profile(struct riscv_t *rv) {
+  std::vector<riscv_jit_profile_t> profile(rv_get_jit_profile(rv, nullptr, 0));
+  rv_get_jit_profile(rv, profile.data(), uint32_t(profile.size()));
+  return profile;
+}
+
+void print_jit_report(struct riscv_t *rv, elf_t &elf) {
+  static const size_t max_blocks = 20;
+  const auto profile = get_jit_profile(rv);
+  uint64_t total = 0;
+  for (const auto &block : profile) {
+    total += block.executions * block.instructions;
+  }
+  fprintf(stderr, "jit hot blocks:     %zu of %zu\n",
+          std::min(profile.size(), max_blocks), profile.size());
+  fprintf(stderr, "  %-17s  %-32s %12s %5s %5s %9s %6s\n", "guest pc", "symbol",
+          "executions", "insns", "bytes", "fallbacks", "insns%");
+  for (size_t i = 0; i < profile.size() && i < max_blocks; ++i) {
+    const riscv_jit_profile_t &block = profile[i];
+    // name the block after the function it is in
+    char name[64] = "";
+    uint32_t base = 0;
+    if (const char *sym = elf.find_nearest_symbol(block.pc_start, base)) {
+      snprintf(name, sizeof(name), "%s+0x%x", sym, block.pc_start - base);
+    }
+    // executions * instructions is an upper bound as side exits leave early
+    const uint64_t insns = block.executions * block.instructions;
+    fprintf(stderr, "  %08x-%08x  %-32.32s %12llu %5u %5u %9llu %5.1f%%\n",
+            block.pc_start, block.pc_end, name,
+            (unsigned long long)block.executions, block.instructions,
+            block.code_size, (unsigned long long)block.fallbacks,
+            total ? 100.0 * double(insns) / double(total) : 0.0);
+  }
+}
+
+// translate the blocks a previous run found to be hot, hottest first
+bool load_jit_profile(struct riscv_t *rv, const char *path) {
+  FILE *fd = fopen(path, "r");
+  if (!fd) {
+    return false;
+  }
+  std::vector<uint32_t> addrs;
+  char line[256];
+  while (fgets(line, sizeof(line), fd)) {
+    unsigned int pc_start = 0, pc_end = 0;
+    unsigned long long executions = 0;
+    if (line[0] == '#' ||
+        sscanf(line, "%x %x %llu", &pc_start, &pc_end, &executions) != 3) {
+      continue;
+    }
+    if (executions) {
+      addrs.push_back(pc_start);
+    }
+  }
+  fclose(fd);
+  rv_translate_jit_blocks(rv, addrs.data(), uint32_t(addrs.size()));
+  return true;
+}
+
+// write the profile of every block, hottest first, one block per line
+bool save_jit_profile(struct riscv_t *rv, const char *path) {
+  FILE *fd = fopen(path, "w");
+  if (!fd) {
+    return false;
+  }
+  fprintf(fd, "# riscv_vm jit profile\n");
+  fprintf(fd, "# pc_start pc_end executions instructions code_size "
+              "fallbacks\n");
+  for (const auto &block : get_jit_profile(rv)) {
+    fprintf(fd, "%08x %08x %llu %u %u %llu\n", block.pc_start, block.pc_end,
+            (unsigned long long)block.executions, block.instructions,
+            block.code_size, (unsigned long long)block.fallbacks);
+  }
+  return fclose(fd) == 0;
+}
+
 } // namespace {}
 
 
@@ -202,12 +344,52 @@ int main(int argc, char **args) {
     return 1;
   }
 
+  // let the core access our memory directly
+  rv_set_mem_map(rv, state->mem.chunk_map());
+
+  if (g_arg_jit_threshold >= 0) {
+    rv_set_jit_threshold(rv, g_arg_jit_threshold);
+  }
+  if (g_arg_jit_async) {
+    rv_set_jit_async(rv, true);
+  }
+  // a trace steps one instruction at a time
+  if (g_arg_jit_exact || g_arg_trace) {
+    rv_set_jit_exact(rv, true);
+  }
+  if (g_arg_jit_passes >= 0) {
+    rv_set_jit_passes(rv, g_arg_jit_passes);
+  }
+  if (g_arg_jit_baseline) {
+    rv_set_jit_baseline(rv, true);
+  }
+  if (g_arg_jit_report || g_arg_jit_profile) {
+    rv_set_jit_profile(rv, true);
+  }
+  if (g_arg_jit_perf) {
+    g_jit_perf_elf = &elf;
+    if (!rv_set_jit_perf(rv, g_arg_jit_perf, imp_jit_symbolize)) {
+      fprintf(stderr, "Unable to create perf files for the JIT\n");
+    }
+  }
+
   // upload the ELF file into our memory abstraction
   if (!elf.upload(rv, state->mem)) {
     fprintf(stderr, "Unable to upload ELF file '%s'\n", args[1]);
     return 1;
   }
 
+  // start with the code translated by previous runs of this program
+  const uint64_t jit_key = elf.hash_segments();
+  bool jit_cache_loaded = false;
+  if (g_arg_jit_cache) {
+    jit_cache_loaded = rv_load_jit_cache(rv, g_arg_jit_cache, jit_key);
+  }
+  // then with the blocks a previous run spent its time in
+  if (g_arg_jit_profile) {
+    load_jit_profile(rv, g_arg_jit_profile);
+  }
+
   // run based on the chosen mode
   if (g_arg_trace) {
     run_and_trace(rv, state.get(), elf);
@@ -224,6 +406,29 @@ int main(int argc, char **args) {
     print_signature(state.get(), elf);
   }
 
+  if (g_arg_jit_stats) {
+    print_jit_stats(rv);
+  }
+  if (g_arg_jit_report) {
+    print_jit_report(rv, elf);
+  }
+  if (g_arg_jit_profile) {
+    if (!save_jit_profile(rv, g_arg_jit_profile)) {
+      fprintf(stderr, "Unable to save JIT profile '%s'\n", g_arg_jit_profile);
+    }
+  }
+
+  // save the translated code unless nothing was added to what we loaded
+  if (g_arg_jit_cache) {
+    riscv_jit_stats_t stats;
+    rv_get_jit_stats(rv, &stats);
+    if (!jit_cache_loaded || stats.translations) {
+      if (!rv_save_jit_cache(rv, g_arg_jit_cache, jit_key)) {
+        fprintf(stderr, "Unable to save JIT cache '%s'\n", g_arg_jit_cache);
+      }
+    }
+  }
+
   // delete the VM
   rv_delete(rv);
   return 0;
@@ -4,6 +4,8 @@
 #include <cstring>
 #include <cassert>
 
+#include "../riscv_core/riscv.h"
+
 
 struct memory_t {
 
@@ -149,6 +151,15 @@ struct memory_t {
     }
   }
 
+  // return the chunk table so guest memory can be accessed directly
+  // note: a chunk only holds its data so a chunk pointer also points to its
+  //       first byte.
+  uint8_t *const *chunk_map() const {
+    static_assert(sizeof(chunk_t) == (1u << RV_MEM_CHUNK_BITS),
+                  "chunk size must match the core");
+    return reinterpret_cast<uint8_t *const *>(chunks.data());
+  }
+
   void clear() {
     for (chunk_t *c : chunks) {
       if (c) {
@@ -2,6 +2,12 @@
 #include <cstdio>
 #include <ctime>
 
+#ifdef _WIN32
+#include <malloc.h>
+#else
+#include <alloca.h>
+#endif
+
 #include "../riscv_core/riscv.h"
 #include "state.h"
 
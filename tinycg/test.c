@@ -0,0 +1,327 @@
+// tinycg encoding tests
+//
+// each case emits instructions into an empty buffer and compares them with
+// the bytes they are known to encode to.  the expected bytes were checked
+// against the GNU assembler.
+
+#include <stdio.h>
+#include <string.h>
+
+#include "tinycg.h"
+
+static uint8_t buffer[1024];
+static struct cg_state_t state;
+static struct cg_state_t *cg = &state;
+static int failures;
+
+static void print_bytes(const char *label, const uint8_t *data, size_t size) {
+  printf("  %s:", label);
+  for (size_t i = 0; i < size; ++i) {
+    printf(" %02x", data[i]);
+  }
+  printf("\n");
+}
+
+// compare the code emitted from 'from' onwards with the expected bytes
+static void check(const char *name, const uint8_t *from, const uint8_t *want,
+                  size_t size) {
+  const size_t got = (size_t)(cg->head - from);
+  if (!cg->error && got == size && memcmp(from, want, size) == 0) {
+    return;
+  }
+  printf("FAIL %s%s\n", name, cg->error ? " (error set)" : "");
+  print_bytes("got ", from, got);
+  print_bytes("want", want, size);
+  failures += 1;
+}
+
+static void check_error(const char *name, int want) {
+  if (!cg->error != !want) {
+    printf("FAIL %s: error %s\n", name, want ? "not set" : "set");
+    failures += 1;
+  }
+}
+
+// emit 'call' into an empty buffer and compare it with the bytes that follow
+#define TEST(call, ...)                                                        \
+  do {                                                                         \
+    const uint8_t want[] = {__VA_ARGS__};                                      \
+    cg_reset(cg);                                                              \
+    call;                                                                      \
+    check(#call, cg->start, want, sizeof(want));                               \
+  } while (0)
+
+static void emit_nops(uint32_t count) {
+  for (uint32_t i = 0; i < count; ++i) {
+    cg_nop(cg);
+  }
+}
+
+// register operands, where r8-r15 need rex.r or rex.b and spl, bpl, sil and
+// dil need a rex prefix of their own
+static void test_reg(void) {
+  TEST(cg_mov_r64_r64(cg, cg_rax, cg_r8), 0x4c, 0x89, 0xc0);
+  TEST(cg_mov_r64_r64(cg, cg_r15, cg_rbx), 0x49, 0x89, 0xdf);
+  TEST(cg_mov_r32_r32(cg, cg_eax, cg_ecx), 0x89, 0xc8);
+  TEST(cg_mov_r32_r32(cg, cg_r9, cg_r10), 0x45, 0x89, 0xd1);
+  TEST(cg_add_r32_r32(cg, cg_r8, cg_eax), 0x41, 0x01, 0xc0);
+  TEST(cg_add_r64_r64(cg, cg_rax, cg_r13), 0x4c, 0x01, 0xe8);
+  TEST(cg_sub_r32_r32(cg, cg_esi, cg_r14), 0x44, 0x29, 0xf6);
+  TEST(cg_xor_r64_r64(cg, cg_rax, cg_rax), 0x48, 0x31, 0xc0);
+  TEST(cg_cmp_r32_r32(cg, cg_r11, cg_r12), 0x45, 0x39, 0xe3);
+  TEST(cg_test_r64_r64(cg, cg_r8, cg_r8), 0x4d, 0x85, 0xc0);
+  TEST(cg_cmov_r32_r32(cg, cg_cc_ne, cg_eax, cg_r9), 0x41, 0x0f, 0x45, 0xc1);
+  TEST(cg_cmov_r32_r32(cg, cg_cc_lt, cg_r10, cg_edx), 0x44, 0x0f, 0x4c, 0xd2);
+  TEST(cg_neg_r32(cg, cg_r13), 0x41, 0xf7, 0xdd);
+  TEST(cg_div_r32(cg, cg_r8), 0x41, 0xf7, 0xf0);
+  TEST(cg_imul_r32(cg, cg_ecx), 0xf7, 0xe9);
+  TEST(cg_push_r64(cg, cg_rbx), 0x53);
+  TEST(cg_push_r64(cg, cg_r12), 0x41, 0x54);
+  TEST(cg_pop_r64(cg, cg_r15), 0x41, 0x5f);
+  TEST(cg_jmp_r64(cg, cg_r11), 0x41, 0xff, 0xe3);
+  TEST(cg_shl_r32_i8(cg, cg_r8, 1), 0x41, 0xd1, 0xe0);
+  TEST(cg_shr_r32_i8(cg, cg_eax, 3), 0xc1, 0xe8, 0x03);
+  TEST(cg_sar_r32_cl(cg, cg_r15), 0x41, 0xd3, 0xff);
+  TEST(cg_movzx_r32_r16(cg, cg_r8, cg_ax), 0x44, 0x0f, 0xb7, 0xc0);
+  TEST(cg_movsx_r32_r16(cg, cg_eax, cg_r9), 0x41, 0x0f, 0xbf, 0xc1);
+  // byte registers
+  TEST(cg_movzx_r32_r8(cg, cg_eax, cg_bl), 0x0f, 0xb6, 0xc3);
+  TEST(cg_movzx_r32_r8(cg, cg_eax, cg_sil), 0x40, 0x0f, 0xb6, 0xc6);
+  TEST(cg_movzx_r32_r8(cg, cg_r10, cg_dil), 0x44, 0x0f, 0xb6, 0xd7);
+  TEST(cg_movzx_r32_r8(cg, cg_eax, cg_r8), 0x41, 0x0f, 0xb6, 0xc0);
+  TEST(cg_movsx_r32_r8(cg, cg_ecx, cg_bpl), 0x40, 0x0f, 0xbe, 0xcd);
+  TEST(cg_setcc_r8(cg, cg_cc_ne, cg_al), 0x0f, 0x95, 0xc0);
+  TEST(cg_setcc_r8(cg, cg_cc_eq, cg_dil), 0x40, 0x0f, 0x94, 0xc7);
+  TEST(cg_setcc_r8(cg, cg_cc_lt, cg_r12), 0x41, 0x0f, 0x9c, 0xc4);
+  TEST(cg_and_r8_i8(cg, cg_al, 0x0f), 0x24, 0x0f);
+  TEST(cg_and_r8_i8(cg, cg_bl, 0x01), 0x80, 0xe3, 0x01);
+  TEST(cg_and_r8_i8(cg, cg_spl, 0x01), 0x40, 0x80, 0xe4, 0x01);
+  TEST(cg_and_r8_i8(cg, cg_r9, 0x01), 0x41, 0x80, 0xe1, 0x01);
+}
+
+// immediate operands, which use the sign extended 8 bit form when they fit
+// and the short eax form when there is one
+static void test_imm(void) {
+  TEST(cg_mov_r32_i32(cg, cg_r11, 0x12345678),
+       0x41, 0xbb, 0x78, 0x56, 0x34, 0x12);
+  TEST(cg_mov_r64_i32(cg, cg_r12, -1),
+       0x49, 0xc7, 0xc4, 0xff, 0xff, 0xff, 0xff);
+  TEST(cg_add_r32_i32(cg, cg_ecx, 1), 0x83, 0xc1, 0x01);
+  TEST(cg_add_r32_i32(cg, cg_eax, 0x1000), 0x05, 0x00, 0x10, 0x00, 0x00);
+  TEST(cg_add_r32_i32(cg, cg_r14, 0x1000),
+       0x41, 0x81, 0xc6, 0x00, 0x10, 0x00, 0x00);
+  TEST(cg_add_r32_i32(cg, cg_edx, -128), 0x83, 0xc2, 0x80);
+  TEST(cg_add_r32_i32(cg, cg_edx, 128), 0x81, 0xc2, 0x80, 0x00, 0x00, 0x00);
+  TEST(cg_sub_r64_i32(cg, cg_rsp, 8), 0x48, 0x83, 0xec, 0x08);
+  TEST(cg_and_r32_i32(cg, cg_r8, 0xff), 0x41, 0x81, 0xe0, 0xff, 0x00, 0x00,
+       0x00);
+  TEST(cg_xor_r32_i32(cg, cg_esi, 0xffffffff), 0x83, 0xf6, 0xff);
+  TEST(cg_cmp_r32_i32(cg, cg_r15, 5), 0x41, 0x83, 0xff, 0x05);
+  // always a 32 bit immediate so that it can be patched
+  TEST(cg_cmp_r32_imm32(cg, cg_eax, 5), 0x3d, 0x05, 0x00, 0x00, 0x00);
+  TEST(cg_cmp_r32_imm32(cg, cg_r10, 5),
+       0x41, 0x81, 0xfa, 0x05, 0x00, 0x00, 0x00);
+}
+
+// memory operands, where rsp and r12 as a base need a sib byte and rbp and r13
+// as a base need a displacement
+static void test_mem(void) {
+  TEST(cg_mov_r32_r64disp(cg, cg_eax, cg_rbx, 8), 0x8b, 0x43, 0x08);
+  TEST(cg_mov_r32_r64disp(cg, cg_eax, cg_rsp, 8), 0x8b, 0x44, 0x24, 0x08);
+  TEST(cg_mov_r32_r64disp(cg, cg_eax, cg_r12, 8),
+       0x41, 0x8b, 0x44, 0x24, 0x08);
+  TEST(cg_mov_r32_r64disp(cg, cg_eax, cg_rbp, 0), 0x8b, 0x45, 0x00);
+  TEST(cg_mov_r32_r64disp(cg, cg_eax, cg_r13, 0), 0x41, 0x8b, 0x45, 0x00);
+  TEST(cg_mov_r32_r64disp(cg, cg_r9, cg_rbx, 0x1000),
+       0x44, 0x8b, 0x8b, 0x00, 0x10, 0x00, 0x00);
+  TEST(cg_mov_r64disp_r32(cg, cg_r12, -4, cg_r8),
+       0x45, 0x89, 0x44, 0x24, 0xfc);
+  TEST(cg_mov_r64disp_r64(cg, cg_rsp, -8, cg_rax),
+       0x48, 0x89, 0x44, 0x24, 0xf8);
+  TEST(cg_mov_r64_r64disp(cg, cg_rax, cg_r12, 16),
+       0x49, 0x8b, 0x44, 0x24, 0x10);
+  TEST(cg_mov_r64disp_i32(cg, cg_r13, 4, 7),
+       0x41, 0xc7, 0x45, 0x04, 0x07, 0x00, 0x00, 0x00);
+  TEST(cg_call_r64disp(cg, cg_r12, 0x80),
+       0x41, 0xff, 0x94, 0x24, 0x80, 0x00, 0x00, 0x00);
+  TEST(cg_jmp_r64disp(cg, cg_rbp, 8), 0xff, 0x65, 0x08);
+  TEST(cg_cmp_r64_r64disp(cg, cg_rdx, cg_rbx, 0x20), 0x48, 0x3b, 0x53, 0x20);
+  TEST(cg_add_r32_r64disp(cg, cg_r8, cg_rsp, 4),
+       0x44, 0x03, 0x44, 0x24, 0x04);
+  TEST(cg_xor_r32_r64disp(cg, cg_ecx, cg_r13, 0x100),
+       0x41, 0x33, 0x8d, 0x00, 0x01, 0x00, 0x00);
+  // [base + index * scale]
+  TEST(cg_mov_r32_r64idx(cg, cg_eax, cg_rbx, cg_rcx, 4), 0x8b, 0x04, 0x8b);
+  TEST(cg_mov_r32_r64idx(cg, cg_eax, cg_rbp, cg_rcx, 1),
+       0x8b, 0x44, 0x0d, 0x00);
+  TEST(cg_mov_r32_r64idx(cg, cg_eax, cg_r13, cg_rcx, 1),
+       0x41, 0x8b, 0x44, 0x0d, 0x00);
+  TEST(cg_mov_r32_r64idx(cg, cg_r10, cg_r12, cg_r9, 8),
+       0x47, 0x8b, 0x14, 0xcc);
+  TEST(cg_mov_r64_r64idx(cg, cg_rax, cg_rsp, cg_rcx, 8),
+       0x48, 0x8b, 0x04, 0xcc);
+  TEST(cg_movzx_r32_r64idx8(cg, cg_eax, cg_rbx, cg_rdx, 1),
+       0x0f, 0xb6, 0x04, 0x13);
+  TEST(cg_movsx_r32_r64idx16(cg, cg_r11, cg_rsi, cg_rdi, 2),
+       0x44, 0x0f, 0xbf, 0x1c, 0x7e);
+  TEST(cg_mov_r64idx_r16(cg, cg_rbx, cg_rcx, 1, cg_r8),
+       0x66, 0x44, 0x89, 0x04, 0x0b);
+  TEST(cg_mov_r64idx_r8(cg, cg_rbx, cg_rcx, 1, cg_al), 0x88, 0x04, 0x0b);
+  TEST(cg_mov_r64idx_r8(cg, cg_rbx, cg_rcx, 1, cg_sil),
+       0x40, 0x88, 0x34, 0x0b);
+  TEST(cg_mov_r64idx_r8(cg, cg_rbx, cg_r9, 1, cg_sil),
+       0x42, 0x88, 0x34, 0x0b);
+  // rip relative, from the start of the buffer
+  TEST(cg_inc_rip32(cg, buffer + 64), 0xff, 0x05, 0x3a, 0x00, 0x00, 0x00);
+  TEST(cg_inc_rip64(cg, buffer + 64),
+       0x48, 0xff, 0x05, 0x39, 0x00, 0x00, 0x00);
+  TEST(cg_lea_r64_rip(cg, cg_r9, buffer + 64),
+       0x4c, 0x8d, 0x0d, 0x39, 0x00, 0x00, 0x00);
+}
+
+// sse and vex encoded instructions
+static void test_sse(void) {
+  TEST(cg_movd_xmm_r32(cg, cg_xmm8, cg_eax), 0x66, 0x44, 0x0f, 0x6e, 0xc0);
+  TEST(cg_movd_r32_xmm(cg, cg_r9, cg_xmm1), 0x66, 0x41, 0x0f, 0x7e, 0xc9);
+  TEST(cg_addss_xmm_xmm(cg, cg_xmm0, cg_xmm9), 0xf3, 0x41, 0x0f, 0x58, 0xc1);
+  TEST(cg_ucomiss_xmm_xmm(cg, cg_xmm0, cg_xmm1), 0x0f, 0x2e, 0xc1);
+  TEST(cg_cvttss2si_r64_xmm(cg, cg_rax, cg_xmm0),
+       0xf3, 0x48, 0x0f, 0x2c, 0xc0);
+  TEST(cg_movss_xmm_r64disp(cg, cg_xmm1, cg_r12, 4),
+       0xf3, 0x41, 0x0f, 0x10, 0x4c, 0x24, 0x04);
+  TEST(cg_movups_r64disp_xmm(cg, cg_rsp, 0x100, cg_xmm15),
+       0x44, 0x0f, 0x11, 0xbc, 0x24, 0x00, 0x01, 0x00, 0x00);
+  // the two byte vex form can only extend the modrm reg field
+  TEST(cg_vaddss_xmm_xmm_xmm(cg, cg_xmm0, cg_xmm1, cg_xmm2),
+       0xc5, 0xf2, 0x58, 0xc2);
+  TEST(cg_vsubss_xmm_xmm_xmm(cg, cg_xmm1, cg_xmm14, cg_xmm2),
+       0xc5, 0x8a, 0x5c, 0xca);
+  TEST(cg_vdivss_xmm_xmm_xmm(cg, cg_xmm9, cg_xmm1, cg_xmm2),
+       0xc5, 0x72, 0x5e, 0xca);
+  TEST(cg_vmulss_xmm_xmm_xmm(cg, cg_xmm8, cg_xmm9, cg_xmm10),
+       0xc4, 0x41, 0x32, 0x59, 0xc2);
+  TEST(cg_shlx_r32_r32_r32(cg, cg_eax, cg_ecx, cg_edx),
+       0xc4, 0xe2, 0x69, 0xf7, 0xc1);
+  TEST(cg_shrx_r32_r32_r32(cg, cg_r8, cg_r9, cg_r10),
+       0xc4, 0x42, 0x2b, 0xf7, 0xc1);
+  TEST(cg_sarx_r32_r32_r32(cg, cg_eax, cg_r11, cg_ecx),
+       0xc4, 0xc2, 0x72, 0xf7, 0xc3);
+}
+
+// jumps to addresses and labels
+static void test_jump(void) {
+  TEST(cg_jmp_rel32(cg, buffer + 64), 0xe9, 0x3b, 0x00, 0x00, 0x00);
+  TEST(cg_jcc_rel32(cg, cg_cc_ne, buffer + 64),
+       0x0f, 0x85, 0x3a, 0x00, 0x00, 0x00);
+
+  struct cg_label_t label;
+  // backward jumps take an 8 bit displacement while -128 reaches
+  {
+    const uint8_t want[] = {0xeb, 0x80};
+    cg_reset(cg);
+    cg_label_init(&label);
+    cg_bind(cg, &label);
+    emit_nops(126);
+    cg_jmp_label(cg, &label);
+    check("jmp back 128", cg->start + 126, want, sizeof(want));
+  }
+  {
+    const uint8_t want[] = {0xe9, 0x7c, 0xff, 0xff, 0xff};
+    cg_reset(cg);
+    cg_label_init(&label);
+    cg_bind(cg, &label);
+    emit_nops(127);
+    cg_jmp_label(cg, &label);
+    check("jmp back 132", cg->start + 127, want, sizeof(want));
+  }
+  {
+    const uint8_t want[] = {0x74, 0xfe};
+    cg_reset(cg);
+    cg_label_init(&label);
+    cg_bind(cg, &label);
+    cg_jcc_label(cg, cg_cc_eq, &label);
+    check("jcc back 2", cg->start, want, sizeof(want));
+  }
+  {
+    const uint8_t want[] = {0x0f, 0x8f, 0x78, 0xff, 0xff, 0xff};
+    cg_reset(cg);
+    cg_label_init(&label);
+    cg_bind(cg, &label);
+    emit_nops(130);
+    cg_jcc_label(cg, cg_cc_gt, &label);
+    check("jcc back 136", cg->start + 130, want, sizeof(want));
+  }
+  // forward jumps take a 32 bit displacement unless asked to be short
+  {
+    const uint8_t want[] = {0xe9, 0x01, 0x00, 0x00, 0x00, 0x90};
+    cg_reset(cg);
+    cg_label_init(&label);
+    cg_jmp_label(cg, &label);
+    cg_nop(cg);
+    cg_bind(cg, &label);
+    check("jmp forward", cg->start, want, sizeof(want));
+  }
+  {
+    const uint8_t want[] = {0x75, 0x01, 0x90};
+    cg_reset(cg);
+    cg_label_init(&label);
+    cg_jcc_label_short(cg, cg_cc_ne, &label);
+    cg_nop(cg);
+    cg_bind(cg, &label);
+    check("jcc forward short", cg->start, want, sizeof(want));
+  }
+  {
+    const uint8_t want[] = {0xeb, 0x06, 0x0f, 0x84, 0x00, 0x00, 0x00, 0x00};
+    cg_reset(cg);
+    cg_label_init(&label);
+    cg_jmp_label_short(cg, &label);
+    cg_jcc_label(cg, cg_cc_eq, &label);
+    cg_bind(cg, &label);
+    check("two forward jumps", cg->start, want, sizeof(want));
+  }
+  {
+    const uint8_t want[] = {0xeb, 0x7f};
+    cg_reset(cg);
+    cg_label_init(&label);
+    cg_jmp_label_short(cg, &label);
+    emit_nops(127);
+    cg_bind(cg, &label);
+    check_error("jmp forward short 127", 0);
+    // only compare the jump
+    cg->head = cg->start + sizeof(want);
+    check("jmp forward short 127", cg->start, want, sizeof(want));
+  }
+  // a short jump that doesn't reach and too many jumps waiting on one label
+  // can't be encoded
+  cg_reset(cg);
+  cg_label_init(&label);
+  cg_jmp_label_short(cg, &label);
+  emit_nops(128);
+  cg_bind(cg, &label);
+  check_error("jmp forward short 128", 1);
+
+  cg_reset(cg);
+  check_error("reset", 0);
+  cg_label_init(&label);
+  for (uint32_t i = 0; i < CG_LABEL_FIXUPS; ++i) {
+    cg_jmp_label(cg, &label);
+  }
+  check_error("label fixups full", 0);
+  cg_jmp_label(cg, &label);
+  check_error("label fixups overflow", 1);
+}
+
+int main(void) {
+  cg_init(cg, buffer, buffer + sizeof(buffer));
+  test_reg();
+  test_imm();
+  test_mem();
+  test_sse();
+  test_jump();
+  if (failures) {
+    printf("%d failed\n", failures);
+    return 1;
+  }
+  printf("all passed\n");
+  return 0;
+}
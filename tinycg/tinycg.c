@@ -9,8 +9,15 @@
 //
 
 #include <assert.h>
+#include <stddef.h>
 #include <string.h>
 
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+
 #include "tinycg.h"
 
 const char *cg_r64_str(cg_r32_t reg) {
@@ -24,22 +31,25 @@ const char *cg_r64_str(cg_r32_t reg) {
 const char *cg_r32_str(cg_r32_t reg) {
   static const char *str[] = {
     "eax", "ecx", "edx", "ebx", "esp", "ebp", "esi", "edi",
+    "r8d", "r9d", "r10d", "r11d", "r12d", "r13d", "r14d", "r15d",
   };
-  return str[reg & 0x7];
+  return str[reg & 0xf];
 }
 
 const char *cg_r16_str(cg_r32_t reg) {
   static const char *str[] = {
     "ax", "cx", "dx", "bx", "sp", "bp", "si", "di",
+    "r8w", "r9w", "r10w", "r11w", "r12w", "r13w", "r14w", "r15w",
   };
-  return str[reg & 0x7];
+  return str[reg & 0xf];
 }
 
 const char *cg_r8_str(cg_r32_t reg) {
   static const char *str[] = {
-    "al", "cl", "dl", "bl", "ah", "ch", "dh", "bh",
+    "al", "cl", "dl", "bl", "spl", "bpl", "sil", "dil",
+    "r8b", "r9b", "r10b", "r11b", "r12b", "r13b", "r14b", "r15b",
   };
-  return str[reg & 0x7];
+  return str[reg & 0xf];
 }
 
 static void cg_emit_data(struct cg_state_t *cg, const void *data, size_t size) {
@@ -53,7 +63,8 @@ static void cg_modrm(struct cg_state_t *cg, uint32_t mod, uint32_t reg,
   const uint8_t data = ((mod & 3) << 6) | ((reg & 7) << 3) | (rm & 7);
   cg_emit_data(cg, &data, 1);
   // if we need a sib byte
-  if (mod < 3 && rm == 4) {
+  // note: this is also the case for r12 as only the low bits are encoded
+  if (mod < 3 && (rm & 7) == 4) {
     // scale = 0, index = none, base = esp
     const uint8_t sib = (0 << 6) | (4 << 3) | 4;
     cg_emit_data(cg, &sib, 1);
@@ -65,6 +76,37 @@ static void cg_rex(struct cg_state_t *cg, int w, int r, int x, int b) {
   cg_emit_data(cg, &rex, 1);
 }
 
+// emit a rex prefix only if one is needed to encode the operands
+static void cg_rex_opt(struct cg_state_t *cg, int w, int r, int x, int b) {
+  if (w || r || x || b) {
+    cg_rex(cg, w, r, x, b);
+  }
+}
+
+// emit a rex prefix for an instruction with a byte register operand 'r8'
+// note: one is always needed for spl, bpl, sil and dil, which would otherwise
+//       encode ah, ch, dh and bh
+static void cg_rex_r8(struct cg_state_t *cg, int r, int x, int b,
+                      uint32_t r8) {
+  if (r || x || b || (r8 >= 4 && r8 < 8)) {
+    cg_rex(cg, 0, r, x, b);
+  }
+}
+
+// emit a modrm byte addressing [base + disp] using the shortest displacement
+static void cg_modrm_disp(struct cg_state_t *cg, uint32_t reg, uint32_t base,
+                          int32_t disp) {
+  if (disp >= -128 && disp <= 127) {
+    cg_modrm(cg, 1, reg, base);
+    const int8_t disp8 = disp;
+    cg_emit_data(cg, &disp8, 1);
+  }
+  else {
+    cg_modrm(cg, 2, reg, base);
+    cg_emit_data(cg, &disp, sizeof(disp));
+  }
+}
+
 uint32_t cg_size(struct cg_state_t *cg) {
   return (uint32_t)(cg->head - cg->start);
 }
@@ -76,11 +118,13 @@ void cg_mov_r64_r64(struct cg_state_t *cg, cg_r32_t r1, cg_r32_t r2) {
 }
 
 void cg_mov_r32_r32(struct cg_state_t *cg, cg_r32_t r1, cg_r32_t r2) {
+  cg_rex_opt(cg, 0, r2 >= cg_r8, 0, r1 >= cg_r8);
   cg_emit_data(cg, "\x89", 1);
   cg_modrm(cg, 3, r2, r1);
 }
 
 void cg_mov_r32_i32(struct cg_state_t *cg, cg_r32_t r1, uint32_t imm) {
+  cg_rex_opt(cg, 0, 0, 0, r1 >= cg_r8);
   const uint8_t inst = 0xb8 | (r1 & 0x7);
   cg_emit_data(cg, &inst, 1);
   cg_emit_data(cg, &imm, sizeof(imm));
@@ -131,8 +175,7 @@ void cg_ret(struct cg_state_t *cg) {
 
 void cg_mov_r32_r64disp(struct cg_state_t *cg, cg_r32_t r1, cg_r64_t base,
                         int32_t disp) {
-  assert(r1   == (r1   & 0x7));
-  assert(base == (base & 0x7));
+  cg_rex_opt(cg, 0, r1 >= cg_r8, 0, base >= cg_r8);
   if (disp >= -128 && disp <= 127) {
     cg_emit_data(cg, "\x8b", 1);
     cg_modrm(cg, 1, r1, base);
@@ -148,8 +191,7 @@ void cg_mov_r32_r64disp(struct cg_state_t *cg, cg_r32_t r1, cg_r64_t base,
 
 void cg_mov_r64disp_r32(struct cg_state_t *cg, cg_r64_t base, int32_t disp,
                         cg_r32_t r1) {
-  assert(r1   == (r1   & 0x7));
-  assert(base == (base & 0x7));
+  cg_rex_opt(cg, 0, r1 >= cg_r8, 0, base >= cg_r8);
   if (disp >= -128 && disp <= 127) {
     cg_emit_data(cg, "\x89", 1);
     cg_modrm(cg, 1, r1, base);
@@ -164,64 +206,114 @@ void cg_mov_r64disp_r32(struct cg_state_t *cg, cg_r64_t base, int32_t disp,
 }
 
 void cg_movsx_r32_r8(struct cg_state_t *cg, cg_r32_t r1, cg_r8_t r2) {
+  cg_rex_r8(cg, r1 >= cg_r8, 0, r2 >= cg_r8, r2);
   cg_emit_data(cg, "\x0f\xbe", 2);
   cg_modrm(cg, 3, r1, r2);
 }
 
 void cg_movsx_r32_r16(struct cg_state_t *cg, cg_r32_t r1, cg_r16_t r2) {
+  cg_rex_opt(cg, 0, r1 >= cg_r8, 0, r2 >= cg_r8);
   cg_emit_data(cg, "\x0f\xbf", 2);
   cg_modrm(cg, 3, r1, r2);
 }
 
 void cg_movzx_r32_r8(struct cg_state_t *cg, cg_r32_t r1, cg_r8_t r2) {
+  cg_rex_r8(cg, r1 >= cg_r8, 0, r2 >= cg_r8, r2);
   cg_emit_data(cg, "\x0f\xb6", 2);
   cg_modrm(cg, 3, r1, r2);
 }
 
 void cg_movzx_r32_r16(struct cg_state_t *cg, cg_r32_t r1, cg_r16_t r2) {
+  cg_rex_opt(cg, 0, r1 >= cg_r8, 0, r2 >= cg_r8);
   cg_emit_data(cg, "\x0f\xb7", 2);
   cg_modrm(cg, 3, r1, r2);
 }
 
-void cg_add_r64_i32(struct cg_state_t *cg, cg_r64_t r1, int32_t imm) {
-  if (imm == 0) {
-    return;
-  }
-  cg_rex(cg, 1, 0, 0, r1 >= cg_r8);
-  cg_add_r32_i32(cg, r1, imm);
-}
-
-void cg_add_r32_i32(struct cg_state_t *cg, cg_r32_t r1, int32_t imm) {
-  if (imm == 0) {
-    return;
-  }
+// emit an alu instruction with an immediate operand
+// note: ext is the opcode extension placed in the modrm reg field
+static void cg_alu_ri(struct cg_state_t *cg, int w, uint32_t ext, cg_r32_t r1,
+                      int32_t imm) {
+  cg_rex_opt(cg, w, 0, 0, r1 >= cg_r8);
   if (imm >= -128 && imm <= 127) {
     cg_emit_data(cg, "\x83", 1);
-    cg_modrm(cg, 3, 0, r1);
+    cg_modrm(cg, 3, ext, r1);
     const int8_t imm8 = imm;
     cg_emit_data(cg, &imm8, 1);
   }
   else {
     if (r1 == cg_eax) {
-      cg_emit_data(cg, "\x05", 1);
+      const uint8_t op = 0x05 | (ext << 3);
+      cg_emit_data(cg, &op, 1);
     }
     else {
       cg_emit_data(cg, "\x81", 1);
-      cg_modrm(cg, 3, 0, r1);
+      cg_modrm(cg, 3, ext, r1);
     }
     cg_emit_data(cg, &imm, sizeof(imm));
   }
 }
 
-void cg_add_r32_r32(struct cg_state_t *cg, cg_r32_t r1, cg_r32_t r2) {
-  cg_emit_data(cg, "\x01", 1);
+// emit an alu instruction of the form 'op r1, r2'
+static void cg_alu_rr(struct cg_state_t *cg, int w, uint8_t op, cg_r32_t r1,
+                      cg_r32_t r2) {
+  cg_rex_opt(cg, w, r2 >= cg_r8, 0, r1 >= cg_r8);
+  cg_emit_data(cg, &op, 1);
   cg_modrm(cg, 3, r2, r1);
 }
 
+// emit a shift by an immediate amount
+// note: ext is the opcode extension placed in the modrm reg field
+static void cg_shift_ri(struct cg_state_t *cg, uint32_t ext, cg_r32_t r1,
+                        uint8_t imm) {
+  if (imm == 0) {
+    return;
+  }
+  cg_rex_opt(cg, 0, 0, 0, r1 >= cg_r8);
+  if (imm == 1) {
+    cg_emit_data(cg, "\xd1", 1);
+    cg_modrm(cg, 3, ext, r1);
+  }
+  else {
+    cg_emit_data(cg, "\xc1", 1);
+    cg_modrm(cg, 3, ext, r1);
+    cg_emit_data(cg, &imm, 1);
+  }
+}
+
+// emit a shift by the amount in cl
+static void cg_shift_rcl(struct cg_state_t *cg, uint32_t ext, cg_r32_t r1) {
+  cg_rex_opt(cg, 0, 0, 0, r1 >= cg_r8);
+  cg_emit_data(cg, "\xd3", 1);
+  cg_modrm(cg, 3, ext, r1);
+}
+
+void cg_add_r64_i32(struct cg_state_t *cg, cg_r64_t r1, int32_t imm) {
+  if (imm == 0) {
+    return;
+  }
+  cg_alu_ri(cg, 1, 0, r1, imm);
+}
+
+void cg_add_r32_i32(struct cg_state_t *cg, cg_r32_t r1, int32_t imm) {
+  if (imm == 0) {
+    return;
+  }
+  cg_alu_ri(cg, 0, 0, r1, imm);
+}
+
+void cg_add_r32_r32(struct cg_state_t *cg, cg_r32_t r1, cg_r32_t r2) {
+  cg_alu_rr(cg, 0, 0x01, r1, r2);
+}
+
+void cg_add_r64_r64(struct cg_state_t *cg, cg_r64_t r1, cg_r64_t r2) {
+  cg_alu_rr(cg, 1, 0x01, r1, r2);
+}
+
 void cg_and_r8_i8(struct cg_state_t *cg, cg_r8_t r1, uint8_t imm) {
   if (imm == 0xff) {
     return;
   }
+  cg_rex_r8(cg, 0, 0, r1 >= cg_r8, r1);
   if (r1 == cg_al) {
     cg_emit_data(cg, "\x24", 1);
   }
@@ -236,221 +328,141 @@ void cg_and_r32_i32(struct cg_state_t *cg, cg_r32_t r1, uint32_t imm) {
   if (imm == ~0u) {
     return;
   }
-  if (r1 == cg_eax) {
-    cg_emit_data(cg, "\x25", 1);
-  }
-  else {
-    cg_emit_data(cg, "\x81", 1);
-    cg_modrm(cg, 3, 4, r1);
-  }
-  cg_emit_data(cg, &imm, sizeof(imm));
+  cg_alu_ri(cg, 0, 4, r1, (int32_t)imm);
 }
 
 void cg_and_r32_r32(struct cg_state_t *cg, cg_r32_t r1, cg_r32_t r2) {
-  cg_emit_data(cg, "\x21", 1);
-  cg_modrm(cg, 3, r2, r1);
+  cg_alu_rr(cg, 0, 0x21, r1, r2);
 }
 
 void cg_sub_r64_i32(struct cg_state_t *cg, cg_r64_t r1, int32_t imm) {
   if (imm == 0) {
     return;
   }
-  cg_rex(cg, 1, 0, 0, r1 >= cg_r8);
-  cg_sub_r32_i32(cg, r1, imm);
+  cg_alu_ri(cg, 1, 5, r1, imm);
 }
 
 void cg_sub_r32_i32(struct cg_state_t *cg, cg_r32_t r1, int32_t imm) {
   if (imm == 0) {
     return;
   }
-  if (imm >= -128 && imm <= 127) {
-    cg_emit_data(cg, "\x83", 1);
-    const uint8_t op = 0xe8 | (r1 & 0x7);
-    cg_emit_data(cg, &op, 1);
-    const int8_t imm8 = imm;
-    cg_emit_data(cg, &imm8, 1);
-  }
-  else {
-    if (r1 == cg_eax) {
-      cg_emit_data(cg, "\x2d", 1);
-    }
-    else {
-      cg_emit_data(cg, "\x81", 1);
-      cg_modrm(cg, 3, 5, r1);
-    }
-    cg_emit_data(cg, &imm, sizeof(imm));
-  }
+  cg_alu_ri(cg, 0, 5, r1, imm);
 }
 
 void cg_sub_r32_r32(struct cg_state_t *cg, cg_r32_t r1, cg_r32_t r2) {
-  cg_emit_data(cg, "\x29", 1);
-  cg_modrm(cg, 3, r2, r1);
+  cg_alu_rr(cg, 0, 0x29, r1, r2);
 }
 
 void cg_shl_r32_i8(struct cg_state_t *cg, cg_r32_t r1, uint8_t imm) {
-  if (imm == 0) {
-    return;
-  }
-  if (imm == 1) {
-    const uint8_t op = 0xe0 | (r1 & 0x7);
-    cg_emit_data(cg, "\xd1", 1);
-    cg_emit_data(cg, &op, 1);
-  }
-  else {
-    cg_emit_data(cg, "\xc1", 1);
-    cg_modrm(cg, 3, 4, r1);
-    cg_emit_data(cg, &imm, sizeof(imm));
-  }
+  cg_shift_ri(cg, 4, r1, imm);
 }
 
 void cg_shl_r32_cl(struct cg_state_t *cg, cg_r32_t r1) {
-  cg_emit_data(cg, "\xd3", 1);
-  cg_modrm(cg, 3, 4, r1);
+  cg_shift_rcl(cg, 4, r1);
 }
 
 void cg_sar_r32_i8(struct cg_state_t *cg, cg_r32_t r1, uint8_t imm) {
-  if (imm == 0) {
-    return;
-  }
-  if (imm == 1) {
-    const uint8_t op = 0xf8 | (r1 & 0x7);
-    cg_emit_data(cg, "\xd1", 1);
-    cg_emit_data(cg, &op, 1);
-  }
-  else {
-    cg_emit_data(cg, "\xc1", 1);
-    cg_modrm(cg, 3, 7, r1);
-    cg_emit_data(cg, &imm, 1);
-  }
+  cg_shift_ri(cg, 7, r1, imm);
 }
 
 void cg_sar_r32_cl(struct cg_state_t *cg, cg_r32_t r1) {
-  cg_emit_data(cg, "\xd3", 1);
-  cg_modrm(cg, 3, 7, r1);
+  cg_shift_rcl(cg, 7, r1);
 }
 
 void cg_shr_r32_i8(struct cg_state_t *cg, cg_r32_t r1, uint8_t imm) {
-  if (imm == 0) {
-    return;
-  }
-  if (imm == 1) {
-    const uint8_t op = 0xe8 | (r1 & 0x7);
-    cg_emit_data(cg, "\xd1", 1);
-    cg_emit_data(cg, &op, 1);
-  }
-  else {
-    cg_emit_data(cg, "\xc1", 1);
-    cg_modrm(cg, 3, 5, r1);
-    cg_emit_data(cg, &imm, sizeof(imm));
-  }
+  cg_shift_ri(cg, 5, r1, imm);
 }
 
 void cg_shr_r32_cl(struct cg_state_t *cg, cg_r32_t r1) {
-  cg_emit_data(cg, "\xd3", 1);
-  cg_modrm(cg, 3, 5, r1);
+  cg_shift_rcl(cg, 5, r1);
 }
 
 void cg_xor_r32_i32(struct cg_state_t *cg, cg_r32_t r1, uint32_t imm) {
   if (imm == 0) {
     return;
   }
-  if (r1 == cg_eax) {
-    cg_emit_data(cg, "\x35", 1);
-  }
-  else {
-    cg_emit_data(cg, "\x81", 1);
-    cg_modrm(cg, 3, 6, r1);
-  }
-  cg_emit_data(cg, &imm, sizeof(imm));
+  cg_alu_ri(cg, 0, 6, r1, (int32_t)imm);
 }
 
 void cg_xor_r32_r32(struct cg_state_t *cg, cg_r32_t r1, cg_r32_t r2) {
-  cg_emit_data(cg, "\x31", 1);
-  cg_modrm(cg, 3, r2, r1);
+  cg_alu_rr(cg, 0, 0x31, r1, r2);
 }
 
 void cg_xor_r64_r64(struct cg_state_t *cg, cg_r64_t r1, cg_r64_t r2) {
-  cg_rex(cg, 1, r2 >= cg_r8, 0, r1 >= cg_r8);
-  cg_emit_data(cg, "\x31", 1);
-  cg_modrm(cg, 3, r2, r1);
+  cg_alu_rr(cg, 1, 0x31, r1, r2);
 }
 
 void cg_or_r32_i32(struct cg_state_t *cg, cg_r32_t r1, uint32_t imm) {
   if (imm == 0) {
     return;
   }
-  if (r1 == cg_eax) {
-    cg_emit_data(cg, "\x0d", 1);
-  }
-  else {
-    cg_emit_data(cg, "\x81", 1);
-    cg_modrm(cg, 3, 1, r1);
-  }
-  cg_emit_data(cg, &imm, sizeof(imm));
+  cg_alu_ri(cg, 0, 1, r1, (int32_t)imm);
 }
 
 void cg_or_r32_r32(struct cg_state_t *cg, cg_r32_t r1, cg_r32_t r2) {
-  cg_emit_data(cg, "\x09", 1);
-  cg_modrm(cg, 3, r2, r1);
+  cg_alu_rr(cg, 0, 0x09, r1, r2);
 }
 
 void cg_cmp_r64_r64(struct cg_state_t *cg, cg_r64_t r1, cg_r64_t r2) {
-  cg_rex(cg, 1, r2 >= cg_r8, 0, r1 >= cg_r8);
-  cg_emit_data(cg, "\x39", 1);
-  cg_modrm(cg, 3, r2, r1);
+  cg_alu_rr(cg, 1, 0x39, r1, r2);
 }
 
 void cg_cmp_r32_r32(struct cg_state_t *cg, cg_r32_t r1, cg_r32_t r2) {
-  cg_emit_data(cg, "\x39", 1);
-  cg_modrm(cg, 3, r2, r1);
+  cg_alu_rr(cg, 0, 0x39, r1, r2);
 }
 
 void cg_cmp_r32_i32(struct cg_state_t *cg, cg_r32_t r1, uint32_t imm) {
-  if (r1 == cg_eax) {
-    cg_emit_data(cg, "\x3d", 1);
-  }
-  else {
-    cg_emit_data(cg, "\x81", 1);
-    cg_modrm(cg, 3, 7, r1);
-  }
-  cg_emit_data(cg, &imm, sizeof(imm));
+  cg_alu_ri(cg, 0, 7, r1, (int32_t)imm);
 }
 
 void cg_call_r64disp(struct cg_state_t *cg, cg_r64_t base, int32_t disp) {
-  assert(base == (base & 0x7));
-  if (disp >= -128 && disp <= 127) {
-    cg_emit_data(cg, "\xff", 1);
-    const uint8_t op = 0x50 | (base & 0x7);
-    cg_emit_data(cg, &op, 1);
-    const int8_t disp8 = disp;
-    cg_emit_data(cg, &disp8, 1);
-  }
-  else {
-    cg_emit_data(cg, "\xff", 1);
-    const uint8_t op = 0x90 | (base & 0x7);
-    cg_emit_data(cg, &op, 1);
-    cg_emit_data(cg, &disp, sizeof(disp));
-  }
+  cg_rex_opt(cg, 0, 0, 0, base >= cg_r8);
+  cg_emit_data(cg, "\xff", 1);
+  cg_modrm_disp(cg, 2, base, disp);
 }
 
 void cg_mul_r32(struct cg_state_t *cg, cg_r32_t r1) {
+  cg_rex_opt(cg, 0, 0, 0, r1 >= cg_r8);
   cg_emit_data(cg, "\xF7", 1);
   cg_modrm(cg, 3, 4, r1);
 }
 
 void cg_imul_r32(struct cg_state_t *cg, cg_r32_t r1) {
+  cg_rex_opt(cg, 0, 0, 0, r1 >= cg_r8);
   cg_emit_data(cg, "\xF7", 1);
   cg_modrm(cg, 3, 5, r1);
 }
 
+void cg_div_r32(struct cg_state_t *cg, cg_r32_t r1) {
+  cg_rex_opt(cg, 0, 0, 0, r1 >= cg_r8);
+  cg_emit_data(cg, "\xF7", 1);
+  cg_modrm(cg, 3, 6, r1);
+}
+
+void cg_idiv_r32(struct cg_state_t *cg, cg_r32_t r1) {
+  cg_rex_opt(cg, 0, 0, 0, r1 >= cg_r8);
+  cg_emit_data(cg, "\xF7", 1);
+  cg_modrm(cg, 3, 7, r1);
+}
+
+void cg_neg_r32(struct cg_state_t *cg, cg_r32_t r1) {
+  cg_rex_opt(cg, 0, 0, 0, r1 >= cg_r8);
+  cg_emit_data(cg, "\xF7", 1);
+  cg_modrm(cg, 3, 3, r1);
+}
+
+void cg_cdq(struct cg_state_t *cg) {
+  cg_emit_data(cg, "\x99", 1);
+}
+
 void cg_push_r64(struct cg_state_t *cg, cg_r64_t r1) {
-  assert(r1 == (r1 & 0x7));
+  cg_rex_opt(cg, 0, 0, 0, r1 >= cg_r8);
   const uint8_t inst = 0x50 | (r1 & 0x7);
   cg_emit_data(cg, &inst, 1);
 }
 
 void cg_pop_r64(struct cg_state_t *cg, cg_r64_t r1) {
-  assert(r1 == (r1 & 0x7));
+  cg_rex_opt(cg, 0, 0, 0, r1 >= cg_r8);
   const uint8_t inst = 0x58 | (r1 & 0x7);
   cg_emit_data(cg, &inst, 1);
 }
@@ -460,6 +472,7 @@ void cg_nop(struct cg_state_t *cg) {
 }
 
 void cg_setcc_r8(struct cg_state_t *cg, cg_cc_t cc, cg_r8_t r1) {
+  cg_rex_r8(cg, 0, 0, r1 >= cg_r8, r1);
   cg_emit_data(cg, "\x0f", 1);
   const uint8_t op = 0x90 | (cc & 0xf);
   cg_emit_data(cg, &op, 1);
@@ -468,19 +481,535 @@ void cg_setcc_r8(struct cg_state_t *cg, cg_cc_t cc, cg_r8_t r1) {
 
 void cg_cmov_r32_r32(struct cg_state_t *cg, cg_cc_t cc, cg_r32_t r1,
                      cg_r32_t r2) {
+  cg_rex_opt(cg, 0, r1 >= cg_r8, 0, r2 >= cg_r8);
   cg_emit_data(cg, "\x0f", 1);
   const uint8_t op = 0x40 | (cc & 0xf);
   cg_emit_data(cg, &op, 1);
   cg_modrm(cg, 3, r1, r2);
 }
 
+void cg_mov_r64disp_i32(struct cg_state_t *cg, cg_r64_t base, int32_t disp,
+                        uint32_t imm) {
+  cg_rex_opt(cg, 0, 0, 0, base >= cg_r8);
+  cg_emit_data(cg, "\xc7", 1);
+  cg_modrm_disp(cg, 0, base, disp);
+  cg_emit_data(cg, &imm, sizeof(imm));
+}
+
+
+// emit an alu instruction of the form 'op r1, [base + disp]'
+static void cg_alu_rm(struct cg_state_t *cg, int w, uint8_t op, cg_r32_t r1,
+                      cg_r64_t base, int32_t disp) {
+  cg_rex_opt(cg, w, r1 >= cg_r8, 0, base >= cg_r8);
+  cg_emit_data(cg, &op, 1);
+  cg_modrm_disp(cg, r1, base, disp);
+}
+
+void cg_cmp_r64_r64disp(struct cg_state_t *cg, cg_r64_t r1, cg_r64_t base,
+                        int32_t disp) {
+  cg_alu_rm(cg, 1, 0x3b, r1, base, disp);
+}
+
+void cg_cmp_r32_r64disp(struct cg_state_t *cg, cg_r32_t r1, cg_r64_t base,
+                        int32_t disp) {
+  cg_alu_rm(cg, 0, 0x3b, r1, base, disp);
+}
+
+void cg_add_r32_r64disp(struct cg_state_t *cg, cg_r32_t r1, cg_r64_t base,
+                        int32_t disp) {
+  cg_alu_rm(cg, 0, 0x03, r1, base, disp);
+}
+
+void cg_or_r32_r64disp(struct cg_state_t *cg, cg_r32_t r1, cg_r64_t base,
+                       int32_t disp) {
+  cg_alu_rm(cg, 0, 0x0b, r1, base, disp);
+}
+
+void cg_and_r32_r64disp(struct cg_state_t *cg, cg_r32_t r1, cg_r64_t base,
+                        int32_t disp) {
+  cg_alu_rm(cg, 0, 0x23, r1, base, disp);
+}
+
+void cg_sub_r32_r64disp(struct cg_state_t *cg, cg_r32_t r1, cg_r64_t base,
+                        int32_t disp) {
+  cg_alu_rm(cg, 0, 0x2b, r1, base, disp);
+}
+
+void cg_xor_r32_r64disp(struct cg_state_t *cg, cg_r32_t r1, cg_r64_t base,
+                        int32_t disp) {
+  cg_alu_rm(cg, 0, 0x33, r1, base, disp);
+}
+
+uint8_t *cg_lea_r64_rip(struct cg_state_t *cg, cg_r64_t r1,
+                        const void *target) {
+  cg_rex(cg, 1, r1 >= cg_r8, 0, 0);
+  cg_emit_data(cg, "\x8d", 1);
+  // mod = 0, rm = 5 selects rip relative addressing
+  cg_modrm(cg, 0, r1, 5);
+  // displacement is relative to the end of this instruction
+  uint8_t *ptr = cg->head;
+  const int32_t rel = (int32_t)((const uint8_t *)target - (cg->head + 4));
+  cg_emit_data(cg, &rel, sizeof(rel));
+  return ptr;
+}
+
+void cg_inc_rip32(struct cg_state_t *cg, const void *target) {
+  cg_emit_data(cg, "\xff", 1);
+  // mod = 0, rm = 5 selects rip relative addressing
+  cg_modrm(cg, 0, 0, 5);
+  const int32_t rel = (int32_t)((const uint8_t *)target - (cg->head + 4));
+  cg_emit_data(cg, &rel, sizeof(rel));
+}
+
+void cg_inc_rip64(struct cg_state_t *cg, const void *target) {
+  cg_rex(cg, 1, 0, 0, 0);
+  cg_inc_rip32(cg, target);
+}
+
+uint8_t *cg_cmp_r32_imm32(struct cg_state_t *cg, cg_r32_t r1, uint32_t imm) {
+  cg_rex_opt(cg, 0, 0, 0, r1 >= cg_r8);
+  if (r1 == cg_eax) {
+    cg_emit_data(cg, "\x3d", 1);
+  }
+  else {
+    cg_emit_data(cg, "\x81", 1);
+    cg_modrm(cg, 3, 7, r1);
+  }
+  uint8_t *ptr = cg->head;
+  cg_emit_data(cg, &imm, sizeof(imm));
+  return ptr;
+}
+
+void cg_jmp_r64(struct cg_state_t *cg, cg_r64_t r1) {
+  cg_rex_opt(cg, 0, 0, 0, r1 >= cg_r8);
+  cg_emit_data(cg, "\xff", 1);
+  cg_modrm(cg, 3, 4, r1);
+}
+
+void cg_jmp_r64disp(struct cg_state_t *cg, cg_r64_t base, int32_t disp) {
+  cg_rex_opt(cg, 0, 0, 0, base >= cg_r8);
+  cg_emit_data(cg, "\xff", 1);
+  cg_modrm_disp(cg, 4, base, disp);
+}
+
+void cg_patch_rel32(uint8_t *disp, const void *target) {
+  // displacement is relative to the end of the jump instruction
+  const int32_t rel =
+    target ? (int32_t)((const uint8_t *)target - (disp + 4)) : 0;
+  memcpy(disp, &rel, sizeof(rel));
+}
+
+uint8_t *cg_jmp_rel32(struct cg_state_t *cg, const void *target) {
+  cg_emit_data(cg, "\xe9", 1);
+  uint8_t *disp = cg->head;
+  cg_emit_data(cg, "\0\0\0\0", 4);
+  cg_patch_rel32(disp, target ? target : cg->head);
+  return disp;
+}
+
+uint8_t *cg_jcc_rel32(struct cg_state_t *cg, cg_cc_t cc, const void *target) {
+  const uint8_t op = 0x80 | (cc & 0xf);
+  cg_emit_data(cg, "\x0f", 1);
+  cg_emit_data(cg, &op, 1);
+  uint8_t *disp = cg->head;
+  cg_emit_data(cg, "\0\0\0\0", 4);
+  cg_patch_rel32(disp, target ? target : cg->head);
+  return disp;
+}
+
+void cg_label_init(struct cg_label_t *label) {
+  memset(label, 0, sizeof(*label));
+}
+
+void cg_bind(struct cg_state_t *cg, struct cg_label_t *label) {
+  assert(!label->target);
+  label->target = cg->head;
+  for (uint32_t i = 0; i < label->num_fixups; ++i) {
+    uint8_t *disp = label->fixup[i];
+    if (label->fixup_short[i]) {
+      const ptrdiff_t rel = cg->head - (disp + 1);
+      if (rel > 127) {
+        cg->error = 1;
+        continue;
+      }
+      const int8_t disp8 = (int8_t)rel;
+      memcpy(disp, &disp8, 1);
+    }
+    else {
+      cg_patch_rel32(disp, cg->head);
+    }
+  }
+  label->num_fixups = 0;
+}
+
+// emit a jump to a label where op8 is the opcode taking an 8 bit displacement
+// and op32 the opcode taking a 32 bit displacement
+static void cg_jump_label(struct cg_state_t *cg, uint8_t op8,
+                          const uint8_t *op32, size_t op32_size,
+                          struct cg_label_t *label, int is_short) {
+  if (label->target) {
+    // both displacements are relative to the end of the instruction
+    const ptrdiff_t rel8 = label->target - (cg->head + 2);
+    if (rel8 >= -128) {
+      const int8_t disp8 = (int8_t)rel8;
+      cg_emit_data(cg, &op8, 1);
+      cg_emit_data(cg, &disp8, 1);
+    }
+    else {
+      cg_emit_data(cg, op32, op32_size);
+      uint8_t *disp = cg->head;
+      cg_emit_data(cg, "\0\0\0\0", 4);
+      cg_patch_rel32(disp, label->target);
+    }
+    return;
+  }
+  if (label->num_fixups >= CG_LABEL_FIXUPS) {
+    // there is nowhere to record the jump so it can never be filled in
+    cg->error = 1;
+    return;
+  }
+  label->fixup_short[label->num_fixups] = is_short;
+  if (is_short) {
+    cg_emit_data(cg, &op8, 1);
+    label->fixup[label->num_fixups++] = cg->head;
+    cg_emit_data(cg, "\0", 1);
+  }
+  else {
+    cg_emit_data(cg, op32, op32_size);
+    label->fixup[label->num_fixups++] = cg->head;
+    cg_emit_data(cg, "\0\0\0\0", 4);
+  }
+}
+
+void cg_jmp_label(struct cg_state_t *cg, struct cg_label_t *label) {
+  cg_jump_label(cg, 0xeb, (const uint8_t *)"\xe9", 1, label, 0);
+}
+
+void cg_jcc_label(struct cg_state_t *cg, cg_cc_t cc, struct cg_label_t *label) {
+  const uint8_t op32[] = {0x0f, 0x80 | (cc & 0xf)};
+  cg_jump_label(cg, 0x70 | (cc & 0xf), op32, sizeof(op32), label, 0);
+}
+
+void cg_jmp_label_short(struct cg_state_t *cg, struct cg_label_t *label) {
+  cg_jump_label(cg, 0xeb, (const uint8_t *)"\xe9", 1, label, 1);
+}
+
+void cg_jcc_label_short(struct cg_state_t *cg, cg_cc_t cc,
+                        struct cg_label_t *label) {
+  const uint8_t op32[] = {0x0f, 0x80 | (cc & 0xf)};
+  cg_jump_label(cg, 0x70 | (cc & 0xf), op32, sizeof(op32), label, 1);
+}
+
+// emit an instruction with a [base + index * scale] memory operand
+// note: any prefix bytes other than rex must already have been emitted
+static void cg_emit_idx(struct cg_state_t *cg, int w, const char *op,
+                        size_t op_size, uint32_t reg, cg_r64_t base,
+                        cg_r64_t index, uint32_t scale) {
+  assert(index != cg_rsp);
+  cg_rex_opt(cg, w, reg >= cg_r8, index >= cg_r8, base >= cg_r8);
+  cg_emit_data(cg, op, op_size);
+  const uint8_t ss = (scale == 8) ? 3 : (scale == 4) ? 2 : (scale == 2) ? 1 : 0;
+  const uint8_t sib = (ss << 6) | ((index & 7) << 3) | (base & 7);
+  // rbp and r13 as a base can only be encoded with a displacement
+  if ((base & 7) == 5) {
+    const uint8_t modrm = (1 << 6) | ((reg & 7) << 3) | 4;
+    cg_emit_data(cg, &modrm, 1);
+    cg_emit_data(cg, &sib, 1);
+    cg_emit_data(cg, "\0", 1);
+  }
+  else {
+    const uint8_t modrm = ((reg & 7) << 3) | 4;
+    cg_emit_data(cg, &modrm, 1);
+    cg_emit_data(cg, &sib, 1);
+  }
+}
+
+void cg_mov_r64_r64idx(struct cg_state_t *cg, cg_r64_t r1, cg_r64_t base,
+                       cg_r64_t index, uint32_t scale) {
+  cg_emit_idx(cg, 1, "\x8b", 1, r1, base, index, scale);
+}
+
+void cg_mov_r32_r64idx(struct cg_state_t *cg, cg_r32_t r1, cg_r64_t base,
+                       cg_r64_t index, uint32_t scale) {
+  cg_emit_idx(cg, 0, "\x8b", 1, r1, base, index, scale);
+}
+
+void cg_movzx_r32_r64idx8(struct cg_state_t *cg, cg_r32_t r1, cg_r64_t base,
+                          cg_r64_t index, uint32_t scale) {
+  cg_emit_idx(cg, 0, "\x0f\xb6", 2, r1, base, index, scale);
+}
+
+void cg_movzx_r32_r64idx16(struct cg_state_t *cg, cg_r32_t r1, cg_r64_t base,
+                           cg_r64_t index, uint32_t scale) {
+  cg_emit_idx(cg, 0, "\x0f\xb7", 2, r1, base, index, scale);
+}
+
+void cg_movsx_r32_r64idx8(struct cg_state_t *cg, cg_r32_t r1, cg_r64_t base,
+                          cg_r64_t index, uint32_t scale) {
+  cg_emit_idx(cg, 0, "\x0f\xbe", 2, r1, base, index, scale);
+}
+
+void cg_movsx_r32_r64idx16(struct cg_state_t *cg, cg_r32_t r1, cg_r64_t base,
+                           cg_r64_t index, uint32_t scale) {
+  cg_emit_idx(cg, 0, "\x0f\xbf", 2, r1, base, index, scale);
+}
+
+void cg_mov_r64idx_r32(struct cg_state_t *cg, cg_r64_t base, cg_r64_t index,
+                       uint32_t scale, cg_r32_t r1) {
+  cg_emit_idx(cg, 0, "\x89", 1, r1, base, index, scale);
+}
+
+void cg_mov_r64idx_r16(struct cg_state_t *cg, cg_r64_t base, cg_r64_t index,
+                       uint32_t scale, cg_r16_t r1) {
+  cg_emit_data(cg, "\x66", 1);
+  cg_emit_idx(cg, 0, "\x89", 1, r1, base, index, scale);
+}
+
+void cg_mov_r64idx_r8(struct cg_state_t *cg, cg_r64_t base, cg_r64_t index,
+                      uint32_t scale, cg_r8_t r1) {
+  // spl, bpl, sil and dil need a rex prefix even if the address doesn't
+  if (r1 >= 4 && r1 < 8 && base < cg_r8 && index < cg_r8) {
+    cg_rex(cg, 0, 0, 0, 0);
+  }
+  cg_emit_idx(cg, 0, "\x88", 1, r1, base, index, scale);
+}
+
+void cg_test_r64_r64(struct cg_state_t *cg, cg_r64_t r1, cg_r64_t r2) {
+  cg_alu_rr(cg, 1, 0x85, r1, r2);
+}
+
+void cg_test_r32_r32(struct cg_state_t *cg, cg_r32_t r1, cg_r32_t r2) {
+  cg_alu_rr(cg, 0, 0x85, r1, r2);
+}
+
+// emit an sse instruction with a register operand in the modrm rm field
+// note: prefix is a mandatory prefix byte or zero if there is none
+static void cg_sse_rr(struct cg_state_t *cg, uint8_t prefix, int w,
+                      uint8_t op, uint32_t reg, uint32_t rm) {
+  if (prefix) {
+    cg_emit_data(cg, &prefix, 1);
+  }
+  cg_rex_opt(cg, w, reg >= 8, 0, rm >= 8);
+  cg_emit_data(cg, "\x0f", 1);
+  cg_emit_data(cg, &op, 1);
+  cg_modrm(cg, 3, reg, rm);
+}
+
+// emit an sse instruction with a [base + disp] memory operand
+static void cg_sse_rm(struct cg_state_t *cg, uint8_t prefix, uint8_t op,
+                      uint32_t reg, cg_r64_t base, int32_t disp) {
+  if (prefix) {
+    cg_emit_data(cg, &prefix, 1);
+  }
+  cg_rex_opt(cg, 0, reg >= 8, 0, base >= cg_r8);
+  cg_emit_data(cg, "\x0f", 1);
+  cg_emit_data(cg, &op, 1);
+  cg_modrm_disp(cg, reg, base, disp);
+}
+
+// emit a vex encoded instruction with register operands
+// note: pp selects the implied prefix (0 none, 1 0x66, 2 0xf3, 3 0xf2) and map
+//       the opcode map (1 0x0f, 2 0x0f38, 3 0x0f3a).  vvvv is the extra
+//       source register.
+static void cg_vex_rrr(struct cg_state_t *cg, uint32_t pp, uint32_t map,
+                       int w, uint8_t op, uint32_t reg, uint32_t vvvv,
+                       uint32_t rm) {
+  const uint32_t r = (reg >= 8) ? 0 : 0x80;
+  const uint32_t b = (rm >= 8) ? 0 : 0x20;
+  const uint32_t v = (~vvvv & 0xf) << 3;
+  if (map == 1 && !w && b) {
+    // two byte form
+    const uint8_t vex[] = {0xc5, (uint8_t)(r | v | pp)};
+    cg_emit_data(cg, vex, sizeof(vex));
+  }
+  else {
+    // three byte form, x is never needed with a register operand
+    const uint8_t vex[] = {0xc4, (uint8_t)(r | 0x40 | b | map),
+                           (uint8_t)((w ? 0x80 : 0) | v | pp)};
+    cg_emit_data(cg, vex, sizeof(vex));
+  }
+  cg_emit_data(cg, &op, 1);
+  cg_modrm(cg, 3, reg, rm);
+}
+
+void cg_shlx_r32_r32_r32(struct cg_state_t *cg, cg_r32_t r1, cg_r32_t r2,
+                         cg_r32_t r3) {
+  cg_vex_rrr(cg, 1, 2, 0, 0xf7, r1, r3, r2);
+}
+
+void cg_shrx_r32_r32_r32(struct cg_state_t *cg, cg_r32_t r1, cg_r32_t r2,
+                         cg_r32_t r3) {
+  cg_vex_rrr(cg, 3, 2, 0, 0xf7, r1, r3, r2);
+}
+
+void cg_sarx_r32_r32_r32(struct cg_state_t *cg, cg_r32_t r1, cg_r32_t r2,
+                         cg_r32_t r3) {
+  cg_vex_rrr(cg, 2, 2, 0, 0xf7, r1, r3, r2);
+}
+
+void cg_vaddss_xmm_xmm_xmm(struct cg_state_t *cg, cg_xmm_t x1, cg_xmm_t x2,
+                           cg_xmm_t x3) {
+  cg_vex_rrr(cg, 2, 1, 0, 0x58, x1, x2, x3);
+}
+
+void cg_vsubss_xmm_xmm_xmm(struct cg_state_t *cg, cg_xmm_t x1, cg_xmm_t x2,
+                           cg_xmm_t x3) {
+  cg_vex_rrr(cg, 2, 1, 0, 0x5c, x1, x2, x3);
+}
+
+void cg_vmulss_xmm_xmm_xmm(struct cg_state_t *cg, cg_xmm_t x1, cg_xmm_t x2,
+                           cg_xmm_t x3) {
+  cg_vex_rrr(cg, 2, 1, 0, 0x59, x1, x2, x3);
+}
+
+void cg_vdivss_xmm_xmm_xmm(struct cg_state_t *cg, cg_xmm_t x1, cg_xmm_t x2,
+                           cg_xmm_t x3) {
+  cg_vex_rrr(cg, 2, 1, 0, 0x5e, x1, x2, x3);
+}
+
+void cg_movss_xmm_r64disp(struct cg_state_t *cg, cg_xmm_t x1, cg_r64_t base,
+                          int32_t disp) {
+  cg_sse_rm(cg, 0xf3, 0x10, x1, base, disp);
+}
+
+void cg_movss_r64disp_xmm(struct cg_state_t *cg, cg_r64_t base, int32_t disp,
+                          cg_xmm_t x1) {
+  cg_sse_rm(cg, 0xf3, 0x11, x1, base, disp);
+}
+
+void cg_movups_xmm_r64disp(struct cg_state_t *cg, cg_xmm_t x1, cg_r64_t base,
+                           int32_t disp) {
+  cg_sse_rm(cg, 0, 0x10, x1, base, disp);
+}
+
+void cg_movups_r64disp_xmm(struct cg_state_t *cg, cg_r64_t base, int32_t disp,
+                           cg_xmm_t x1) {
+  cg_sse_rm(cg, 0, 0x11, x1, base, disp);
+}
+
+void cg_movaps_xmm_xmm(struct cg_state_t *cg, cg_xmm_t x1, cg_xmm_t x2) {
+  cg_sse_rr(cg, 0, 0, 0x28, x1, x2);
+}
+
+void cg_movd_xmm_r32(struct cg_state_t *cg, cg_xmm_t x1, cg_r32_t r1) {
+  cg_sse_rr(cg, 0x66, 0, 0x6e, x1, r1);
+}
+
+void cg_movd_r32_xmm(struct cg_state_t *cg, cg_r32_t r1, cg_xmm_t x1) {
+  cg_sse_rr(cg, 0x66, 0, 0x7e, x1, r1);
+}
+
+void cg_addss_xmm_xmm(struct cg_state_t *cg, cg_xmm_t x1, cg_xmm_t x2) {
+  cg_sse_rr(cg, 0xf3, 0, 0x58, x1, x2);
+}
+
+void cg_subss_xmm_xmm(struct cg_state_t *cg, cg_xmm_t x1, cg_xmm_t x2) {
+  cg_sse_rr(cg, 0xf3, 0, 0x5c, x1, x2);
+}
+
+void cg_mulss_xmm_xmm(struct cg_state_t *cg, cg_xmm_t x1, cg_xmm_t x2) {
+  cg_sse_rr(cg, 0xf3, 0, 0x59, x1, x2);
+}
+
+void cg_divss_xmm_xmm(struct cg_state_t *cg, cg_xmm_t x1, cg_xmm_t x2) {
+  cg_sse_rr(cg, 0xf3, 0, 0x5e, x1, x2);
+}
+
+void cg_sqrtss_xmm_xmm(struct cg_state_t *cg, cg_xmm_t x1, cg_xmm_t x2) {
+  cg_sse_rr(cg, 0xf3, 0, 0x51, x1, x2);
+}
+
+void cg_ucomiss_xmm_xmm(struct cg_state_t *cg, cg_xmm_t x1, cg_xmm_t x2) {
+  cg_sse_rr(cg, 0, 0, 0x2e, x1, x2);
+}
+
+void cg_cvttss2si_r32_xmm(struct cg_state_t *cg, cg_r32_t r1, cg_xmm_t x1) {
+  cg_sse_rr(cg, 0xf3, 0, 0x2c, r1, x1);
+}
+
+void cg_cvttss2si_r64_xmm(struct cg_state_t *cg, cg_r64_t r1, cg_xmm_t x1) {
+  cg_sse_rr(cg, 0xf3, 1, 0x2c, r1, x1);
+}
+
+void cg_cvtsi2ss_xmm_r32(struct cg_state_t *cg, cg_xmm_t x1, cg_r32_t r1) {
+  cg_sse_rr(cg, 0xf3, 0, 0x2a, x1, r1);
+}
+
+void cg_cvtsi2ss_xmm_r64(struct cg_state_t *cg, cg_xmm_t x1, cg_r64_t r1) {
+  cg_sse_rr(cg, 0xf3, 1, 0x2a, x1, r1);
+}
+
+// run cpuid for a leaf and sub-leaf
+static void cg_cpuid(uint32_t leaf, uint32_t sub, uint32_t out[4]) {
+#ifdef _MSC_VER
+  __cpuidex((int *)out, (int)leaf, (int)sub);
+#else
+  __cpuid_count(leaf, sub, out[0], out[1], out[2], out[3]);
+#endif
+}
+
+// read the extended control register listing the state the os saves
+static uint64_t cg_xgetbv(void) {
+#ifdef _MSC_VER
+  return _xgetbv(0);
+#else
+  uint32_t lo, hi;
+  __asm__ volatile("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+  return ((uint64_t)hi << 32) | lo;
+#endif
+}
+
+uint32_t cg_host_features(void) {
+  uint32_t regs[4];
+  cg_cpuid(0, 0, regs);
+  const uint32_t max_leaf = regs[0];
+  cg_cpuid(0x80000000, 0, regs);
+  const uint32_t max_ext_leaf = regs[0];
+  uint32_t features = 0;
+  // leaf 1 ecx: fma (12), osxsave (27), avx (28)
+  cg_cpuid(1, 0, regs);
+  const uint32_t ecx1 = regs[2];
+  // the os must save the xmm and ymm state for avx to be usable
+  const int avx_os = (ecx1 & (1u << 27)) && (cg_xgetbv() & 6) == 6;
+  if (avx_os && (ecx1 & (1u << 28))) {
+    features |= cg_feature_avx;
+    if (ecx1 & (1u << 12)) {
+      features |= cg_feature_fma3;
+    }
+  }
+  // leaf 7 ebx: bmi1 (3), avx2 (5), bmi2 (8)
+  if (max_leaf >= 7) {
+    cg_cpuid(7, 0, regs);
+    const uint32_t ebx7 = regs[1];
+    if (ebx7 & (1u << 3)) {
+      features |= cg_feature_bmi1;
+    }
+    if (ebx7 & (1u << 8)) {
+      features |= cg_feature_bmi2;
+    }
+    if ((features & cg_feature_avx) && (ebx7 & (1u << 5))) {
+      features |= cg_feature_avx2;
+    }
+  }
+  // leaf 0x80000001 ecx: lzcnt (5)
+  if (max_ext_leaf >= 0x80000001) {
+    cg_cpuid(0x80000001, 0, regs);
+    if (regs[2] & (1u << 5)) {
+      features |= cg_feature_lzcnt;
+    }
+  }
+  return features;
+}
+
 void cg_reset(struct cg_state_t *cg) {
   cg->head = cg->start;
+  cg->error = 0;
 }
 
 void cg_init(struct cg_state_t *cg, uint8_t *start, uint8_t *end) {
   cg->start = start;
   cg->head = start;
   cg->end = end;
+  cg->error = 0;
   memset(start, 0xcc, end - start);
 }
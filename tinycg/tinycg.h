@@ -17,16 +17,20 @@ typedef int cg_r16_t;
 typedef int cg_r32_t;
 typedef int cg_r64_t;
 typedef int cg_cc_t;
+typedef int cg_xmm_t;
 
+// byte registers share the numbering of the 64 bit registers.  4-7 are spl,
+// bpl, sil and dil, which need a rex prefix, so ah, ch, dh and bh can't be
+// used.
 enum {
   cg_al,
   cg_cl,
   cg_dl,
   cg_bl,
-  cg_ah,
-  cg_ch,
-  cg_dh,
-  cg_bh,
+  cg_spl,
+  cg_bpl,
+  cg_sil,
+  cg_dil,
 };
 
 enum {
@@ -71,6 +75,25 @@ enum {
   cg_r15,
 };
 
+enum {
+  cg_xmm0,
+  cg_xmm1,
+  cg_xmm2,
+  cg_xmm3,
+  cg_xmm4,
+  cg_xmm5,
+  cg_xmm6,
+  cg_xmm7,
+  cg_xmm8,
+  cg_xmm9,
+  cg_xmm10,
+  cg_xmm11,
+  cg_xmm12,
+  cg_xmm13,
+  cg_xmm14,
+  cg_xmm15,
+};
+
 enum cc_t {
   cg_cc_o  = 0x0, // overflow         JO    (OF=1)
   cg_cc_no = 0x1, // not overflow     JNO   (OF=0)
@@ -90,6 +113,16 @@ enum cc_t {
   cg_cc_gt = 0xf, // greater          JG    (ZF=0 and SF=OF)
 };
 
+// instruction set extensions beyond baseline x86-64
+enum {
+  cg_feature_bmi1  = 1 << 0,  // andn, blsr, tzcnt ...
+  cg_feature_bmi2  = 1 << 1,  // shlx, shrx, sarx, rorx ...
+  cg_feature_lzcnt = 1 << 2,
+  cg_feature_avx   = 1 << 3,  // vex encoded sse with three operands
+  cg_feature_avx2  = 1 << 4,
+  cg_feature_fma3  = 1 << 5,
+};
+
 struct cg_state_t {
   // the start address of the buffer
   uint8_t *start;
@@ -97,6 +130,9 @@ struct cg_state_t {
   const uint8_t *end;
   // the next writing location in the buffer
   uint8_t *head;
+  // set when a label jump could not be encoded, leaving the code unusable
+  // until the next cg_reset
+  int error;
 };
 
 // initalize the code generator
@@ -108,6 +144,10 @@ uint32_t cg_size(struct cg_state_t *);
 // clear all bytes written to the code buffer
 void cg_reset(struct cg_state_t *);
 
+// return the cg_feature_* extensions the host cpu and os support
+// note: the avx features also need the os to save the ymm registers
+uint32_t cg_host_features(void);
+
 void cg_mov_r64_r64(struct cg_state_t *, cg_r32_t r1, cg_r32_t r2);
 void cg_mov_r32_r32(struct cg_state_t *, cg_r32_t r1, cg_r32_t r2);
 void cg_mov_r64_i32(struct cg_state_t *, cg_r32_t r1, int32_t imm);
@@ -133,6 +173,7 @@ void cg_movzx_r32_r16(struct cg_state_t *, cg_r32_t r1, cg_r16_t r2);
 void cg_add_r64_i32(struct cg_state_t *, cg_r64_t t1, int32_t imm);
 void cg_add_r32_i32(struct cg_state_t *, cg_r32_t r1, int32_t imm);
 void cg_add_r32_r32(struct cg_state_t *, cg_r32_t r1, cg_r32_t r2);
+void cg_add_r64_r64(struct cg_state_t *, cg_r64_t r1, cg_r64_t r2);
 
 void cg_and_r8_i8(struct cg_state_t *, cg_r8_t r1, uint8_t imm);
 void cg_and_r32_i32(struct cg_state_t *, cg_r32_t r1, uint32_t imm);
@@ -151,6 +192,15 @@ void cg_sar_r32_cl(struct cg_state_t *, cg_r32_t r1);
 void cg_shr_r32_i8(struct cg_state_t *, cg_r32_t r1, uint8_t imm);
 void cg_shr_r32_cl(struct cg_state_t *, cg_r32_t r1);
 
+// bmi2 shifts of r2 by r3 into r1, which take the count from any register and
+// leave the flags alone
+void cg_shlx_r32_r32_r32(struct cg_state_t *, cg_r32_t r1, cg_r32_t r2,
+                         cg_r32_t r3);
+void cg_shrx_r32_r32_r32(struct cg_state_t *, cg_r32_t r1, cg_r32_t r2,
+                         cg_r32_t r3);
+void cg_sarx_r32_r32_r32(struct cg_state_t *, cg_r32_t r1, cg_r32_t r2,
+                         cg_r32_t r3);
+
 void cg_xor_r64_r64(struct cg_state_t *, cg_r64_t r1, cg_r64_t r2);
 void cg_xor_r32_i32(struct cg_state_t *, cg_r32_t r1, uint32_t imm);
 void cg_xor_r32_r32(struct cg_state_t *, cg_r32_t r1, cg_r32_t r2);
@@ -167,6 +217,12 @@ void cg_call_r64disp(struct cg_state_t *, cg_r64_t base, int32_t disp32);
 
 void cg_mul_r32(struct cg_state_t *, cg_r32_t r1);
 void cg_imul_r32(struct cg_state_t *, cg_r32_t r1);
+void cg_div_r32(struct cg_state_t *, cg_r32_t r1);
+void cg_idiv_r32(struct cg_state_t *, cg_r32_t r1);
+void cg_neg_r32(struct cg_state_t *, cg_r32_t r1);
+
+// sign extend eax into edx
+void cg_cdq(struct cg_state_t *);
 
 void cg_push_r64(struct cg_state_t *, cg_r64_t r1);
 void cg_pop_r64(struct cg_state_t *, cg_r64_t r1);
@@ -175,6 +231,140 @@ void cg_nop(struct cg_state_t *);
 
 void cg_cmov_r32_r32(struct cg_state_t *, cg_cc_t cc, cg_r32_t r1, cg_r32_t r2);
 
+// mov dword [base + disp], imm
+void cg_mov_r64disp_i32(struct cg_state_t *, cg_r64_t base, int32_t disp,
+                        uint32_t imm);
+void cg_cmp_r64_r64disp(struct cg_state_t *, cg_r64_t r1, cg_r64_t base,
+                        int32_t disp);
+void cg_cmp_r32_r64disp(struct cg_state_t *, cg_r32_t r1, cg_r64_t base,
+                        int32_t disp);
+// alu operations of the form 'op r1, dword [base + disp]'
+void cg_add_r32_r64disp(struct cg_state_t *, cg_r32_t r1, cg_r64_t base,
+                        int32_t disp);
+void cg_or_r32_r64disp(struct cg_state_t *, cg_r32_t r1, cg_r64_t base,
+                       int32_t disp);
+void cg_and_r32_r64disp(struct cg_state_t *, cg_r32_t r1, cg_r64_t base,
+                        int32_t disp);
+void cg_sub_r32_r64disp(struct cg_state_t *, cg_r32_t r1, cg_r64_t base,
+                        int32_t disp);
+void cg_xor_r32_r64disp(struct cg_state_t *, cg_r32_t r1, cg_r64_t base,
+                        int32_t disp);
+
+// load the address of target using rip relative addressing.  the location of
+// the displacement is returned so that it can be patched with cg_patch_rel32.
+uint8_t *cg_lea_r64_rip(struct cg_state_t *, cg_r64_t r1, const void *target);
+
+// increment the 32 or 64 bit value at target using rip relative addressing
+void cg_inc_rip32(struct cg_state_t *, const void *target);
+void cg_inc_rip64(struct cg_state_t *, const void *target);
+
+// compare against an immediate that is always encoded in 32 bits.  the
+// location of the immediate is returned so that it can be changed later.
+uint8_t *cg_cmp_r32_imm32(struct cg_state_t *, cg_r32_t r1, uint32_t imm);
+
+void cg_jmp_r64(struct cg_state_t *, cg_r64_t r1);
+// jmp qword [base + disp]
+void cg_jmp_r64disp(struct cg_state_t *, cg_r64_t base, int32_t disp);
+
+// emit a jump to target using a 32 bit displacement.  if target is NULL the
+// jump will fall through to the next instruction.  the location of the
+// displacement is returned so that the jump can be retargeted later.
+uint8_t *cg_jmp_rel32(struct cg_state_t *, const void *target);
+uint8_t *cg_jcc_rel32(struct cg_state_t *, cg_cc_t cc, const void *target);
+
+// retarget a jump displacement returned by cg_jmp_rel32 or cg_jcc_rel32
+void cg_patch_rel32(uint8_t *disp, const void *target);
+
+// the most forward jumps that can wait for one label to be bound
+#define CG_LABEL_FIXUPS 4
+
+// a location in the code that jumps can be emitted to before it is known
+struct cg_label_t {
+  // the location the label was bound to or NULL if it is still unbound
+  uint8_t *target;
+  // displacements of the jumps waiting for the label, and whether each is an
+  // 8 bit rather than a 32 bit displacement
+  uint8_t *fixup[CG_LABEL_FIXUPS];
+  uint8_t fixup_short[CG_LABEL_FIXUPS];
+  uint32_t num_fixups;
+};
+
+void cg_label_init(struct cg_label_t *);
+
+// bind a label to the current location, filling in the jumps waiting for it
+void cg_bind(struct cg_state_t *, struct cg_label_t *);
+
+// emit a jump to a label.  jumps back to a bound label use an 8 bit
+// displacement if it reaches and forward jumps always use a 32 bit one.
+void cg_jmp_label(struct cg_state_t *, struct cg_label_t *);
+void cg_jcc_label(struct cg_state_t *, cg_cc_t cc, struct cg_label_t *);
+
+// as above but forward jumps use an 8 bit displacement, for jumps over code
+// the caller expects to be shorter than 128 bytes
+// note: if the jump doesn't reach when the label is bound, or a label has more
+//       than CG_LABEL_FIXUPS jumps waiting for it, cg_state_t::error is set
+void cg_jmp_label_short(struct cg_state_t *, struct cg_label_t *);
+void cg_jcc_label_short(struct cg_state_t *, cg_cc_t cc, struct cg_label_t *);
+
+// memory operands of the form [base + index * scale]
+void cg_mov_r64_r64idx(struct cg_state_t *, cg_r64_t r1, cg_r64_t base,
+                       cg_r64_t index, uint32_t scale);
+void cg_mov_r32_r64idx(struct cg_state_t *, cg_r32_t r1, cg_r64_t base,
+                       cg_r64_t index, uint32_t scale);
+void cg_movzx_r32_r64idx8(struct cg_state_t *, cg_r32_t r1, cg_r64_t base,
+                          cg_r64_t index, uint32_t scale);
+void cg_movzx_r32_r64idx16(struct cg_state_t *, cg_r32_t r1, cg_r64_t base,
+                           cg_r64_t index, uint32_t scale);
+void cg_movsx_r32_r64idx8(struct cg_state_t *, cg_r32_t r1, cg_r64_t base,
+                          cg_r64_t index, uint32_t scale);
+void cg_movsx_r32_r64idx16(struct cg_state_t *, cg_r32_t r1, cg_r64_t base,
+                           cg_r64_t index, uint32_t scale);
+void cg_mov_r64idx_r32(struct cg_state_t *, cg_r64_t base, cg_r64_t index,
+                       uint32_t scale, cg_r32_t r1);
+void cg_mov_r64idx_r16(struct cg_state_t *, cg_r64_t base, cg_r64_t index,
+                       uint32_t scale, cg_r16_t r1);
+void cg_mov_r64idx_r8(struct cg_state_t *, cg_r64_t base, cg_r64_t index,
+                      uint32_t scale, cg_r8_t r1);
+
+void cg_test_r64_r64(struct cg_state_t *, cg_r64_t r1, cg_r64_t r2);
+void cg_test_r32_r32(struct cg_state_t *, cg_r32_t r1, cg_r32_t r2);
+
+// scalar single precision sse
+void cg_movss_xmm_r64disp(struct cg_state_t *, cg_xmm_t x1, cg_r64_t base,
+                          int32_t disp);
+void cg_movss_r64disp_xmm(struct cg_state_t *, cg_r64_t base, int32_t disp,
+                          cg_xmm_t x1);
+void cg_movups_xmm_r64disp(struct cg_state_t *, cg_xmm_t x1, cg_r64_t base,
+                           int32_t disp);
+void cg_movups_r64disp_xmm(struct cg_state_t *, cg_r64_t base, int32_t disp,
+                           cg_xmm_t x1);
+void cg_movaps_xmm_xmm(struct cg_state_t *, cg_xmm_t x1, cg_xmm_t x2);
+void cg_movd_xmm_r32(struct cg_state_t *, cg_xmm_t x1, cg_r32_t r1);
+void cg_movd_r32_xmm(struct cg_state_t *, cg_r32_t r1, cg_xmm_t x1);
+
+void cg_addss_xmm_xmm(struct cg_state_t *, cg_xmm_t x1, cg_xmm_t x2);
+void cg_subss_xmm_xmm(struct cg_state_t *, cg_xmm_t x1, cg_xmm_t x2);
+void cg_mulss_xmm_xmm(struct cg_state_t *, cg_xmm_t x1, cg_xmm_t x2);
+void cg_divss_xmm_xmm(struct cg_state_t *, cg_xmm_t x1, cg_xmm_t x2);
+void cg_sqrtss_xmm_xmm(struct cg_state_t *, cg_xmm_t x1, cg_xmm_t x2);
+void cg_ucomiss_xmm_xmm(struct cg_state_t *, cg_xmm_t x1, cg_xmm_t x2);
+
+// avx forms of the above computing x1 = x2 op x3 without changing x2
+void cg_vaddss_xmm_xmm_xmm(struct cg_state_t *, cg_xmm_t x1, cg_xmm_t x2,
+                           cg_xmm_t x3);
+void cg_vsubss_xmm_xmm_xmm(struct cg_state_t *, cg_xmm_t x1, cg_xmm_t x2,
+                           cg_xmm_t x3);
+void cg_vmulss_xmm_xmm_xmm(struct cg_state_t *, cg_xmm_t x1, cg_xmm_t x2,
+                           cg_xmm_t x3);
+void cg_vdivss_xmm_xmm_xmm(struct cg_state_t *, cg_xmm_t x1, cg_xmm_t x2,
+                           cg_xmm_t x3);
+
+// convert with truncation
+void cg_cvttss2si_r32_xmm(struct cg_state_t *, cg_r32_t r1, cg_xmm_t x1);
+void cg_cvttss2si_r64_xmm(struct cg_state_t *, cg_r64_t r1, cg_xmm_t x1);
+void cg_cvtsi2ss_xmm_r32(struct cg_state_t *, cg_xmm_t x1, cg_r32_t r1);
+void cg_cvtsi2ss_xmm_r64(struct cg_state_t *, cg_xmm_t x1, cg_r64_t r1);
+
 const char *cg_r64_str(cg_r32_t reg);
 const char *cg_r32_str(cg_r32_t reg);
 const char *cg_r16_str(cg_r32_t reg);